@@ -217,6 +217,22 @@ extern unsigned long _edata;
 extern unsigned long _bss;
 extern unsigned long _ebss;
 
+#ifdef BOOT_PROFILE
+//*****************************************************************************
+//
+// Cycles spent setting up the runtime and in SystemInit(), read by the boot
+// profile in main.c. The DWT cycle counter is started on the first
+// instruction; the registers are used directly as no device header is
+// included here.
+//
+//*****************************************************************************
+#define BOOT_DEMCR          (*(volatile unsigned long *)0xE000EDFC)
+#define BOOT_DWT_CTRL       (*(volatile unsigned long *)0xE0001000)
+#define BOOT_DWT_CYCCNT     (*(volatile unsigned long *)0xE0001004)
+
+extern unsigned long boot_reset_cycles[2];
+#endif
+
 //*****************************************************************************
 // Reset entry point for your code.
 // Sets up a simple runtime environment and initializes the C/C++
@@ -226,6 +242,13 @@ extern unsigned long _ebss;
 void
 ResetISR(void) {
     unsigned long *pulSrc, *pulDest;
+#ifdef BOOT_PROFILE
+    unsigned long ulRuntime;
+
+    BOOT_DEMCR |= 1UL << 24;
+    BOOT_DWT_CYCCNT = 0;
+    BOOT_DWT_CTRL |= 1UL << 0;
+#endif
 
     //
     // Copy the data segment initializers from flash to SRAM.
@@ -250,10 +273,39 @@ ResetISR(void) {
           "        strlt   r2, [r0], #4\n"
           "        blt     zero_loop");
 
+#ifdef STACK_WATERMARK
+    //
+    // Paint the free RAM up to the stack pointer so main.c can find how deep
+    // the stack has been. Same value as STACK_PAINT in main.c.
+    //
+    __asm("    ldr     r0, =_ebss\n"
+          "    mov     r1, sp\n"
+          "    ldr     r2, =0xA5A5A5A5\n"
+          "    .thumb_func\n"
+          "paint_loop:\n"
+          "        cmp     r0, r1\n"
+          "        it      lt\n"
+          "        strlt   r2, [r0], #4\n"
+          "        blt     paint_loop");
+#endif
+
+#ifdef BOOT_PROFILE
+    //
+    // The runtime is set up, boot_reset_cycles[] is only written after this
+    // since it lives in the bss.
+    //
+    ulRuntime = BOOT_DWT_CYCCNT;
+#endif
+
 #ifdef __USE_CMSIS
 	SystemInit();
 #endif
 
+#ifdef BOOT_PROFILE
+    boot_reset_cycles[0] = ulRuntime;
+    boot_reset_cycles[1] = BOOT_DWT_CYCCNT - ulRuntime;
+#endif
+
 #if defined (__cplusplus)
 	//
 	// Call C++ library initialisation
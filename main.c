@@ -4,7 +4,7 @@
  *   Copyright(C) 2016, Liu Ren Jie, Ong Ming Lun
  *   All rights reserved.
  *
-/******************************************************************************/
+ ******************************************************************************/
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //Libraries Import
@@ -16,6 +16,7 @@
 
 #include "lpc17xx_pinsel.h"
 #include "lpc17xx_gpio.h"
+#include "lpc17xx_gpdma.h"
 #include "lpc17xx_i2c.h"
 #include "lpc17xx_ssp.h"
 #include "lpc17xx_timer.h"
@@ -30,6 +31,7 @@
 #include "led7seg.h"
 #include "rotary.h"
 #include "light.h"
+#include "font5x7.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //Define Global Constants
@@ -41,9 +43,79 @@
 #define RGB_BLINK_TIME			333
 #define JOYSTICK_TIME_UNIT		20
 #define FULL_TIME_UNIT			2000
+#define INPUT_POLL_TIME_UNIT	5				//SW4 and rotary switch polling
 #define TEMP_SCALAR_DIV10 		1
 #define NUM_HALF_PERIODS 		300
 
+//Uncomment to measure cycles spent computing temperature in EINT3_IRQHandler
+//#define TEMP_ISR_BENCH
+
+//Uncomment to report loop and ISR cycle counts over UART3 each time a mode loop exits
+//#define BENCH
+
+//Set to 0, or build with -DISR_PROFILE=0 or -DNO_ISR_PROFILE, to compile out ISR latency and
+//execution time histograms ('p' on UART3 dumps them)
+#ifndef ISR_PROFILE
+#ifdef NO_ISR_PROFILE
+#define ISR_PROFILE				0
+#else
+#define ISR_PROFILE				1
+#endif
+#endif
+
+//Uncomment to measure temperature in hardware with TIMER3 counting sensor edges on CAP3.0
+//Temperature sensor output (J25) must be wired to P0.23 instead of P0.2
+//#define TEMP_CAPTURE_MODE
+
+//Uncomment to detect algae and waste with the light sensor's threshold interrupt on P2.5
+//instead of comparing the readings taken at 5, A and F
+//#define LIGHT_IRQ_MODE
+
+//Uncomment to leave the accelerometer out of sensor reads until it reports motion
+//MMA7455 INT1 must be wired to P0.3
+//#define ACC_MOTION_MODE
+#define ACC_MOTION_MG			250				//wake up threshold on X or Y, in mg
+#define ACC_CAL_SAMPLES			8				//readings averaged for the zero-g offset at boot
+#define ACC_CAL_INTERVAL		10				//ms between them, MMA7455 updates at 125Hz
+
+//Uncomment to keep sensor records in on-chip flash while SAFE is not listening and send
+//them once it is back, SAFE must send a byte at least every FLOG_LINK_TIMEOUT ms
+//#define FLASH_LOG
+
+//Uncomment to timestamp boot from reset to the first sensor reading ('b' on UART3 prints it)
+//Define it project wide so cr_startup_lpc17.c also stamps the C runtime setup
+//#define BOOT_PROFILE
+
+//Uncomment to bring the peripherals up strictly one after the other, for comparing boot profiles
+//#define BOOT_SEQUENTIAL
+#define LIGHT_CONVERSION_MS		100				//ISL29003 16 bit integration time, first reading after light_enable()
+
+//Uncomment to find how deep the stack has been since reset ('h' on UART3 prints it)
+//Define it project wide so cr_startup_lpc17.c paints the stack
+//#define STACK_WATERMARK
+
+//Uncomment to enter DATE mode as soon as SW4 is pressed instead of once the 7 segment display
+//has shown 'F', the mode then changes within INPUT_POLL_TIME_UNIT of the press
+//#define SW4_IMMEDIATE
+
+//Uncomment to record sensor readings and inputs for replay in the host build
+//('t' on UART3 dumps the trace, see Sensor trace)
+//#define SENSOR_TRACE
+
+#define TELEMETRY_TEXT			0				//human readable lines for SAFE
+#define TELEMETRY_BINARY		1				//COBS framed binary records for SAFE
+#define TELEMETRY_BATCH			2				//binary records batched and delta coded, see Binary telemetry frames
+#ifndef TELEMETRY_MODE
+#define TELEMETRY_MODE			TELEMETRY_TEXT	//or -DTELEMETRY_MODE=TELEMETRY_BINARY
+#endif
+
+//Biofuel layout for CHARGE mode
+#define BIOFUEL_LAYOUT_GRID		0				//4x4 grid at X1..X4, Y1..Y4
+#define BIOFUEL_LAYOUT_SCATTER	1				//BIOFUEL_SCATTER_COUNT targets at pseudo random spots
+#define BIOFUEL_LAYOUT			BIOFUEL_LAYOUT_GRID
+#define BIOFUEL_SCATTER_COUNT	200
+#define BIOFUEL_SCATTER_SEED	0x2024u
+
 #define X1		10
 #define X2		25
 #define X3		40
@@ -58,7 +130,7 @@
 // Declare Global Sensors Variables
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 uint32_t light = 0;
-static float temperature;
+static int32_t temperature;					//in 0.1 deg C, no floats anywhere in the pipeline
 static int8_t xoff = 0, yoff = 0, zoff = 0;
 static int8_t x = 0, y = 0, z = 0;
 
@@ -80,23 +152,20 @@ static int UART_msg_counter = 0;
 static bool Algae_Flag = false;
 static bool Waste_Flag = false;
 
-static bool Start_Flag = false;
-static bool Date_Flag = false;
-static bool Passive_Flag = false;
-static bool Charge_Flag = false;
+static bool EXIT = false;							//joystick center or SPACEBAR in CHARGE mode
+static bool SW3 = false;
 
-static bool FULL = false;
-static bool EXIT = false;
+//States of the mode state machine, see Mode state machine
+#define MODE_IDLE				0					//waiting for SW4 to start
+#define MODE_RUN				1					//started, one of the three modes below
+#define MODE_PASSIVE			2
+#define MODE_DATE				3
+#define MODE_CHARGE				4
+#define MODE_STATES				5
+#define MODE_NONE				0xFF
 
-static bool SW4 = false;
-static bool next_SW4 = false;
-static bool SW3 = false;
+static volatile uint8_t mode_state = MODE_IDLE;		//a leaf between transitions, read by EINT3_IRQHandler
 
-static bool uartUp = false;
-static bool uartDown = false;
-static bool uartRight = false;
-static bool uartLeft = false;
-static bool uartGet = false;
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Declare Temperature Sensor related interrupt Global variables
@@ -105,13 +174,192 @@ uint32_t old_temp_ticks = 0;
 uint32_t temp_time_period = 0;
 int temp_period_count = 0;
 
+#ifdef TEMP_ISR_BENCH
+//DWT cycle count of the temperature calculation in EINT3_IRQHandler
+uint32_t temp_isr_cycles = 0;
+uint32_t temp_isr_cycles_max = 0;
+#endif
+
+#ifdef BENCH
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Benchmark counters
+// DWT CYCCNT only runs while the core is awake, so a mode loop iteration is
+// its busy cycles. Time spent in ISRs that preempt a loop iteration or a
+// lower priority ISR is subtracted from it and charged to the ISR instead.
+// Under HOST_SIM the simulator's cycle model drives CYCCNT.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define BENCH_ISR_SYSTICK		0
+#define BENCH_ISR_TIMER0		1
+#define BENCH_ISR_EINT3			2
+#define BENCH_ISR_UART3			3
+#define BENCH_ISR_COUNT			4
+
+#define BENCH_SPAN_F_REPORT		0					//sensor read done at 'F' to telemetry queued
+#define BENCH_SPAN_COUNT		1
+
+typedef struct {
+	uint32_t count;
+	uint32_t max;
+	uint64_t total;
+} BENCH_STAT;
+
+BENCH_STAT bench_loop;
+BENCH_STAT bench_isr[BENCH_ISR_COUNT];
+BENCH_STAT bench_span[BENCH_SPAN_COUNT];
+uint32_t bench_start_ms = 0;
+static volatile uint32_t bench_nested = 0;			//cycles of ISRs that preempted the current context
+
+static void bench_record(BENCH_STAT *stat, uint32_t cycles){
+	stat->count++;
+	stat->total += cycles;
+	if (cycles > stat->max){
+		stat->max = cycles;
+	}
+}
+
+//Start timing the current context, returns nested ISR cycles of the context it preempted
+static inline uint32_t bench_enter(void){
+	uint32_t outer = bench_nested;
+
+	bench_nested = 0;
+	return outer;
+}
+
+//Record own cycles of an ISR and hand its full time to the context it preempted
+static void bench_isr_exit(int id, uint32_t start, uint32_t outer){
+	uint32_t elapsed = DWT->CYCCNT - start;
+
+	bench_record(&bench_isr[id], elapsed - bench_nested);
+	bench_nested = outer + elapsed;
+}
+
+#define BENCH_ISR_BEGIN()		uint32_t bench_outer = bench_enter(); uint32_t bench_t0 = DWT->CYCCNT
+#define BENCH_ISR_END(id)		bench_isr_exit((id), bench_t0, bench_outer)
+#define BENCH_LOOP_BEGIN()		uint32_t bench_t0 = DWT->CYCCNT; bench_enter()
+#define BENCH_LOOP_END()		bench_record(&bench_loop, DWT->CYCCNT - bench_t0 - bench_nested)
+#define BENCH_SPAN_BEGIN()		uint32_t bench_s0 = DWT->CYCCNT; uint32_t bench_n0 = bench_nested
+#define BENCH_SPAN_END(id)		bench_record(&bench_span[id], DWT->CYCCNT - bench_s0 - (bench_nested - bench_n0))
+#else
+#define BENCH_ISR_BEGIN()
+#define BENCH_ISR_END(id)
+#define BENCH_LOOP_BEGIN()
+#define BENCH_LOOP_END()
+#define BENCH_SPAN_BEGIN()
+#define BENCH_SPAN_END(id)
+#endif
+
+#if ISR_PROFILE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// ISR profiling
+// Entry latency and execution time of EINT3, TIMER0 and UART3 handlers in
+// CPU cycles, kept as min/max/mean and log2 histograms for the whole run.
+// Execution time leaves out profiled ISRs that preempted the handler.
+// TIMER0 latency is exact, from TC and PC since the match. EINT3 and UART3
+// events carry no timestamp: when a handler is tail-chained behind another
+// profiled ISR its latency is taken as the time since that ISR was entered
+// (an upper bound), otherwise as 0 (taken straight away). CYCCNT stops in
+// __WFI() sleep, so the exit to entry gap is measured with SysTick instead.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define ISR_PROF_EINT3			0
+#define ISR_PROF_TIMER0			1
+#define ISR_PROF_UART3			2
+#define ISR_PROF_COUNT			3
+
+#define ISR_PROF_BUCKETS		16					//bucket n holds values below 2^n, last one the rest
+#define ISR_PROF_TAILCHAIN		32					//exit to entry gap in cycles seen as tail-chaining
+#define ISR_PROF_DUMP_KEY		'p'
+#define TIMER_PCLK_DIV			4					//timer PCLK = CCLK / 4
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	uint32_t hist[ISR_PROF_BUCKETS];
+} ISR_PROF_HIST;
+
+typedef struct {
+	ISR_PROF_HIST latency;
+	ISR_PROF_HIST exec;
+} ISR_PROF;
+
+ISR_PROF isr_prof[ISR_PROF_COUNT];
+static volatile uint32_t isr_prof_nested = 0;		//cycles of profiled ISRs that preempted the current one
+static volatile uint32_t isr_prof_last_start = 0;	//CYCCNT at entry of the last profiled ISR to return
+static volatile uint32_t isr_prof_last_exit = 0;	//SysTick VAL when it returned
+
+static void isr_prof_record(ISR_PROF_HIST *h, uint32_t cycles){
+	int bucket = (cycles == 0) ? 0 : 32 - __builtin_clz(cycles);
+
+	if (bucket >= ISR_PROF_BUCKETS){
+		bucket = ISR_PROF_BUCKETS - 1;
+	}
+	h->hist[bucket]++;
+	h->total += cycles;
+	if ((h->count == 0) || (cycles < h->min)){
+		h->min = cycles;
+	}
+	if (cycles > h->max){
+		h->max = cycles;
+	}
+	h->count++;
+}
+
+//Cycles since TIMER0 matched MR0, TC holds MR0 for one tick then restarts from 0
+static inline uint32_t isr_prof_timer0_latency(void){
+	uint32_t ticks = (LPC_TIM0->TC == LPC_TIM0->MR0) ? 0 : LPC_TIM0->TC + 1;
+
+	return (ticks * (LPC_TIM0->PR + 1) + LPC_TIM0->PC) * TIMER_PCLK_DIV;
+}
+
+//Cycles this ISR may have waited behind the profiled ISR that just returned
+static inline uint32_t isr_prof_chain_latency(uint32_t now){
+	uint32_t val = SysTick->VAL;
+	uint32_t gap = isr_prof_last_exit - val;			//SysTick counts down
+
+	if (val > isr_prof_last_exit){
+		gap += SysTick->LOAD + 1;
+	}
+	return (gap < ISR_PROF_TAILCHAIN) ? now - isr_prof_last_start : 0;
+}
+
+//Record entry latency, returns nested cycles of the context this ISR preempted
+static inline uint32_t isr_prof_enter(int id, uint32_t latency){
+	uint32_t outer = isr_prof_nested;
+
+	isr_prof_record(&isr_prof[id].latency, latency);
+	isr_prof_nested = 0;
+	return outer;
+}
+
+static void isr_prof_exit(int id, uint32_t start, uint32_t outer){
+	uint32_t now = DWT->CYCCNT;
+	uint32_t elapsed = now - start;
+
+	isr_prof_record(&isr_prof[id].exec, elapsed - isr_prof_nested);
+	isr_prof_nested = outer + elapsed;
+	isr_prof_last_start = start;
+	isr_prof_last_exit = SysTick->VAL;
+}
+
+#define ISR_PROF_BEGIN(id, latency)	uint32_t isr_prof_t0 = DWT->CYCCNT; uint32_t isr_prof_outer = isr_prof_enter((id), (latency))
+#define ISR_PROF_END(id)			isr_prof_exit((id), isr_prof_t0, isr_prof_outer)
+
+static void isr_prof_dump(void);
+#else
+#define ISR_PROF_BEGIN(id, latency)
+#define ISR_PROF_END(id)
+#endif
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Set up msTicks related variables and functions
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 volatile uint32_t msTicks = 0;
 
 void SysTick_Handler(void){
+	BENCH_ISR_BEGIN();
 	msTicks++;
+	BENCH_ISR_END(BENCH_ISR_SYSTICK);
 }
 
 volatile uint32_t getTicks(void){
@@ -131,6 +379,251 @@ int check_time (int millis, int *initial_time) {
 	}
 }
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Cooperative task scheduler
+// Periodic and one-shot tasks are kept in a binary heap ordered by due time.
+// SysTick wakes the CPU every 1ms, sched_run() dispatches the earliest due
+// task or sleeps with __WFI() until the next interrupt.
+// Each mode registers its own set of tasks after sched_clear().
+// ISRs hand work to the main loop with sched_post(), posted functions run
+// ahead of timed tasks.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SCHED_MAX_TASKS			8
+#define SCHED_MAX_STATS			16
+#define SCHED_MAX_POSTED		8					//must be a power of 2
+
+typedef void (*TASK_FN)(void);
+
+//Jitter stats are kept per task function so they survive mode changes
+typedef struct {
+	TASK_FN fn;
+	uint32_t runs;
+	uint32_t late_max;				//worst dispatch delay after due time, in CPU cycles
+	uint64_t late_sum;				//for mean dispatch delay
+} SCHED_STAT;
+
+typedef struct {
+	TASK_FN fn;
+	uint32_t period;				//ms, 0 for one-shot
+	uint32_t due;					//msTicks when task should run next
+	SCHED_STAT *stat;
+} SCHED_TASK;
+
+static SCHED_TASK sched_tasks[SCHED_MAX_TASKS];
+static uint8_t sched_heap[SCHED_MAX_TASKS];			//indices into sched_tasks, earliest due first
+static uint8_t sched_count = 0;
+static uint32_t sched_gen = 0;						//bumped by sched_clear() so a running task can clear the table
+static TASK_FN sched_posted[SCHED_MAX_POSTED];
+static volatile uint8_t sched_post_head = 0;
+static volatile uint8_t sched_post_tail = 0;
+
+SCHED_STAT sched_stats[SCHED_MAX_STATS];
+uint64_t sched_idle_cycles = 0;						//CPU cycles spent in __WFI()
+uint64_t sched_stats_start = 0;						//sched_cycles64() when stats were last reset
+
+//Cycle timestamp built from msTicks and the SysTick down counter
+//Keeps counting while the core sleeps, wraps only with msTicks (~49 days)
+static uint64_t sched_cycles64(void){
+	uint32_t ms, val;
+
+	do {
+		ms = msTicks;
+		val = SysTick->VAL;
+	} while (ms != msTicks);
+
+	return (uint64_t)ms * (SysTick->LOAD + 1) + (SysTick->LOAD - val);
+}
+
+//Low 32 bits, wraps every ~42s at 100MHz, for intervals shorter than that
+static uint32_t sched_cycles(void){
+	return (uint32_t)sched_cycles64();
+}
+
+static bool sched_before(uint8_t a, uint8_t b){
+	return (int32_t)(sched_tasks[a].due - sched_tasks[b].due) < 0;
+}
+
+static void sched_push(uint8_t id){
+	int i = sched_count++;
+	uint8_t tmp;
+
+	sched_heap[i] = id;
+	while ((i > 0) && sched_before(sched_heap[i], sched_heap[(i - 1) / 2])){
+		tmp = sched_heap[i];
+		sched_heap[i] = sched_heap[(i - 1) / 2];
+		sched_heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+static uint8_t sched_pop(void){
+	uint8_t top = sched_heap[0];
+	uint8_t tmp;
+	int i = 0;
+	int child;
+
+	sched_heap[0] = sched_heap[--sched_count];
+	while ((child = 2*i + 1) < sched_count){
+		if ((child + 1 < sched_count) && sched_before(sched_heap[child + 1], sched_heap[child])){
+			child++;
+		}
+		if (!sched_before(sched_heap[child], sched_heap[i])){
+			break;
+		}
+		tmp = sched_heap[i];
+		sched_heap[i] = sched_heap[child];
+		sched_heap[child] = tmp;
+		i = child;
+	}
+	return top;
+}
+
+static SCHED_STAT *sched_stat_for(TASK_FN fn){
+	int i;
+
+	for (i = 0; i < SCHED_MAX_STATS; i++){
+		if (sched_stats[i].fn == fn || sched_stats[i].fn == NULL){
+			sched_stats[i].fn = fn;
+			return &sched_stats[i];
+		}
+	}
+	return NULL;
+}
+
+//Remove all tasks, used when switching modes
+void sched_clear(void){
+	int i;
+
+	for (i = 0; i < SCHED_MAX_TASKS; i++){
+		sched_tasks[i].fn = NULL;
+	}
+	sched_count = 0;
+	sched_gen++;
+
+	//Work posted for the old mode is dropped too
+	__disable_irq();
+	sched_post_tail = sched_post_head;
+	__enable_irq();
+}
+
+//Run fn once from the main loop as soon as possible, safe to call from ISRs
+void sched_post(TASK_FN fn){
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if ((uint8_t)(sched_post_head - sched_post_tail) < SCHED_MAX_POSTED){
+		sched_posted[sched_post_head & (SCHED_MAX_POSTED - 1)] = fn;
+		sched_post_head++;
+	}
+	__set_PRIMASK(primask);
+}
+
+//Register fn to run every period ms (first run after delay ms), period 0 runs it once
+int sched_add(TASK_FN fn, uint32_t delay, uint32_t period){
+	uint8_t id;
+
+	for (id = 0; id < SCHED_MAX_TASKS; id++){
+		if (sched_tasks[id].fn == NULL){
+			break;
+		}
+	}
+	if (id == SCHED_MAX_TASKS){
+		return -1;
+	}
+	sched_tasks[id].fn = fn;
+	sched_tasks[id].period = period;
+	sched_tasks[id].due = getTicks() + delay;
+	sched_tasks[id].stat = sched_stat_for(fn);
+	sched_push(id);
+	return id;
+}
+
+//Sleep until the next interrupt, counting the idle time
+//One sleep is well under the ~42s sched_cycles() wrap, the sum is 64 bit
+void sched_idle(void){
+	uint32_t start = sched_cycles();
+
+	__WFI();
+	sched_idle_cycles += sched_cycles() - start;
+}
+
+//Run the earliest task if it is due, otherwise sleep until the next interrupt
+void sched_run(void){
+	SCHED_TASK *task;
+	uint32_t late;
+	uint32_t gen = sched_gen;
+	uint8_t id;
+
+	if (sched_post_tail != sched_post_head){
+		TASK_FN fn = sched_posted[sched_post_tail & (SCHED_MAX_POSTED - 1)];
+		sched_post_tail++;
+		fn();
+		return;
+	}
+
+	if ((sched_count == 0) || ((int32_t)(getTicks() - sched_tasks[sched_heap[0]].due) < 0)){
+		sched_idle();
+		return;
+	}
+
+	id = sched_pop();
+	task = &sched_tasks[id];
+
+	late = sched_cycles() - task->due * (SysTick->LOAD + 1);
+	if (task->stat){
+		task->stat->runs++;
+		task->stat->late_sum += late;
+		if (late > task->stat->late_max){
+			task->stat->late_max = late;
+		}
+	}
+
+	task->fn();
+
+	//Reschedule periodic tasks unless the task table was cleared while it ran
+	if ((task->period != 0) && (gen == sched_gen)){
+		task->due += task->period;
+		if ((int32_t)(getTicks() - task->due) >= 0){
+			task->due = getTicks() + task->period;			//fell behind, skip missed runs instead of bursting
+		}
+		sched_push(id);
+	}
+	else if (gen == sched_gen){
+		task->fn = NULL;								//one-shot done, free the slot
+	}
+}
+
+//Block for ms milliseconds without running tasks, sleeping in between
+void sched_sleep(uint32_t ms){
+	uint32_t start = getTicks();
+
+	while ((getTicks() - start) < ms){
+		sched_idle();
+	}
+}
+
+//CPU load since last reset in 0.1%
+uint32_t sched_cpu_load(void){
+	uint64_t total = sched_cycles64() - sched_stats_start;
+
+	if (total == 0){
+		return 0;
+	}
+	return 1000 - (uint32_t)((sched_idle_cycles * 1000) / total);
+}
+
+void sched_stats_reset(void){
+	int i;
+
+	for (i = 0; i < SCHED_MAX_STATS; i++){
+		sched_stats[i].runs = 0;
+		sched_stats[i].late_max = 0;
+		sched_stats[i].late_sum = 0;
+	}
+	sched_idle_cycles = 0;
+	sched_stats_start = sched_cycles64();
+}
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Set up usTicks related variables and functions
 // Generation of 100us for reading temperature sensor using GPIO Interrupt
@@ -143,6 +636,359 @@ uint32_t getusTicks(void)
 	return usTicks;
 }
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Varints
+// 7 bits per byte, low bits first, bit 7 set on all but the last byte.
+// Signed values are zig-zag coded first so small negatives stay short.
+// The sensor trace and the batched telemetry frames are made of them.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//Write v at p, returns the number of bytes (at most 5)
+static uint32_t varint_put(uint8_t *p, uint32_t v){
+	uint32_t n = 0;
+
+	while (v >= 0x80){
+		p[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static inline uint32_t zigzag(int32_t v){
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+#ifdef HOST_SIM
+//Read the varint at *pos and move past it, false if it runs off the end
+static bool varint_get(const uint8_t *buf, uint32_t len, uint32_t *pos, uint32_t *v){
+	uint32_t shift = 0;
+
+	*v = 0;
+	while ((*pos < len) && (shift < 32)){
+		*v |= (uint32_t)(buf[*pos] & 0x7F) << shift;
+		if (!(buf[(*pos)++] & 0x80)){
+			return true;
+		}
+		shift += 7;
+	}
+	return false;
+}
+
+static inline int32_t unzigzag(uint32_t v){
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+#endif
+
+#ifdef SENSOR_TRACE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sensor trace
+// Sensor reads, temperature updates, joystick polls, CHARGE mode keys and
+// mode entries are appended to trace_buf, one record each:
+//   type (1 byte), time since the previous record (varint), values (varints)
+// Signed values are zig-zag coded, see Varints.
+//   TRACE_REC_SENSORS  light, x, y, z (signed)
+//   TRACE_REC_TEMP     temperature in 0.1 deg C (signed)
+//   TRACE_REC_JOY      joystick state, number of polls it was read
+//   TRACE_REC_KEY      byte taken by charge_uart_input()
+//   TRACE_REC_MODE     'P', 'D' or 'C' on entering PASSIVE, DATE or CHARGE
+// Time is in TRACE_TICK_US units. Joystick polls are run length coded, a
+// run is written (and stamped) when the state changes or just before any
+// other main loop record, so joystick and keyboard input keep their order.
+// Recording stops once trace_buf is full. TRACE_DUMP_KEY on UART3 sends
+// the trace to SAFE as binary telemetry frames, sim/host_sim.c replays it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TRACE_BUF_SIZE			4096
+#define TRACE_TICK_US			100
+#define TRACE_VALS_MAX			4					//values in the largest record
+#define TRACE_DUMP_KEY			't'
+
+#define TRACE_REC_SENSORS		1
+#define TRACE_REC_TEMP			2
+#define TRACE_REC_JOY			3
+#define TRACE_REC_KEY			4
+#define TRACE_REC_MODE			5
+#define TRACE_REC_COUNT			6
+
+static const uint8_t trace_rec_vals[TRACE_REC_COUNT] = {0, 4, 1, 2, 1, 1};
+
+static uint8_t trace_buf[TRACE_BUF_SIZE];
+static uint32_t trace_len = 0;
+static uint32_t trace_last = 0;						//time of the previous record
+static bool trace_on = true;
+static uint8_t trace_joy_state = 0;					//open joystick run, main loop only
+static uint32_t trace_joy_polls = 0;
+
+uint32_t trace_records = 0;
+uint32_t trace_dropped = 0;							//records lost because trace_buf was full
+
+//Trace clock in TRACE_TICK_US units
+static uint32_t trace_now(void){
+#ifdef TEMP_CAPTURE_MODE
+	return getTicks() * (1000 / TRACE_TICK_US);		//no 100us TIMER0 interrupt in this mode
+#else
+	return getusTicks();
+#endif
+}
+
+//Append one record, safe to call from ISRs
+static void trace_put(uint8_t type, const uint32_t *vals){
+	uint8_t rec[1 + 5 + TRACE_VALS_MAX*5];
+	uint8_t body[TRACE_VALS_MAX*5];
+	uint32_t body_len = 0;
+	uint32_t primask = __get_PRIMASK();
+	uint32_t now, len;
+	int i;
+
+	for (i = 0; i < trace_rec_vals[type]; i++){
+		body_len += varint_put(&body[body_len], vals[i]);
+	}
+
+	__disable_irq();
+	if (trace_on){
+		now = trace_now();
+		rec[0] = type;
+		len = 1 + varint_put(&rec[1], now - trace_last);
+		memcpy(&rec[len], body, body_len);
+		len += body_len;
+		if (trace_len + len <= TRACE_BUF_SIZE){
+			memcpy(&trace_buf[trace_len], rec, len);
+			trace_len += len;
+			trace_last = now;
+			trace_records++;
+		}
+		else{
+			trace_dropped++;
+		}
+	}
+	__set_PRIMASK(primask);
+}
+
+//Write the open joystick run, if any
+static void trace_joy_flush(void){
+	uint32_t vals[2];
+
+	if (trace_joy_polls != 0){
+		vals[0] = trace_joy_state;
+		vals[1] = trace_joy_polls;
+		trace_joy_polls = 0;
+		trace_put(TRACE_REC_JOY, vals);
+	}
+}
+
+//Records from the main loop go after the joystick polls before them
+static void trace_main(uint8_t type, const uint32_t *vals){
+	trace_joy_flush();
+	trace_put(type, vals);
+}
+
+static void trace_sensors(void){
+	uint32_t vals[4] = {light, zigzag(x), zigzag(y), zigzag(z)};
+
+	trace_main(TRACE_REC_SENSORS, vals);
+}
+
+static void trace_temp(int32_t deci){
+	uint32_t val = zigzag(deci);
+
+	trace_put(TRACE_REC_TEMP, &val);
+}
+
+static void trace_joy(uint8_t state){
+	if ((trace_joy_polls != 0) && (state != trace_joy_state)){
+		trace_joy_flush();
+	}
+	trace_joy_state = state;
+	trace_joy_polls++;
+}
+
+static void trace_key(uint8_t c){
+	uint32_t val = c;
+
+	trace_main(TRACE_REC_KEY, &val);
+}
+
+static void trace_mode(char mode){
+	uint32_t val = (uint8_t)mode;
+
+	trace_main(TRACE_REC_MODE, &val);
+}
+
+static void trace_dump(void);
+
+#ifdef HOST_SIM
+typedef struct {
+	uint8_t type;
+	uint32_t dt;									//TRACE_TICK_US since the previous record
+	uint32_t val[TRACE_VALS_MAX];
+} TRACE_REC;
+
+//Host side decoder for the replay driver in sim/host_sim.c
+//Decodes the record at *pos and moves past it, returns false at the end or
+//on a corrupt record
+bool trace_decode(const uint8_t *buf, uint32_t len, uint32_t *pos, TRACE_REC *rec){
+	int i;
+
+	if ((*pos >= len) || (buf[*pos] == 0) || (buf[*pos] >= TRACE_REC_COUNT)){
+		return false;
+	}
+	rec->type = buf[(*pos)++];
+	if (!varint_get(buf, len, pos, &rec->dt)){
+		return false;
+	}
+	for (i = 0; i < trace_rec_vals[rec->type]; i++){
+		if (!varint_get(buf, len, pos, &rec->val[i])){
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+#define TRACE_SENSORS()			trace_sensors()
+#define TRACE_TEMP(deci)		trace_temp(deci)
+#define TRACE_JOY(state)		trace_joy(state)
+#define TRACE_KEY(c)			trace_key(c)
+#define TRACE_MODE(mode)		trace_mode(mode)
+#else
+#define TRACE_SENSORS()
+#define TRACE_TEMP(deci)
+#define TRACE_JOY(state)
+#define TRACE_KEY(c)
+#define TRACE_MODE(mode)
+#endif
+
+#ifdef BOOT_PROFILE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Boot profile
+// TIMER2 counts microseconds from the top of main(). The boot sequence
+// stamps when each stage starts and is done, BOOT_MARK() when the start
+// screen is ready for SW4, the first temperature is measured, the first
+// PASSIVE screen is drawn and its first sensor reading is in.
+// ResetISR starts the DWT cycle counter on its first instruction and leaves
+// the cycles spent on .data/.bss and in SystemInit() in boot_reset_cycles
+// (the core runs from the 4MHz IRC until SystemInit() switches to the PLL,
+// so they are reported as cycles). BOOT_DUMP_KEY on UART3 prints it all.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define BOOT_STAGES_MAX			20
+#define BOOT_DUMP_KEY			'b'
+
+#define BOOT_MARK_READY			0
+#define BOOT_MARK_TEMP			1
+#define BOOT_MARK_PASSIVE		2
+#define BOOT_MARK_READING		3
+#define BOOT_MARK_COUNT			4
+
+unsigned long boot_reset_cycles[2];					//written by ResetISR in cr_startup_lpc17.c
+uint32_t boot_stage_start[BOOT_STAGES_MAX];			//us since main()
+uint32_t boot_stage_done[BOOT_STAGES_MAX];
+static volatile uint32_t boot_marks[BOOT_MARK_COUNT];	//us since main(), 0 until reached
+
+//Free running microsecond counter, first thing in main()
+static void boot_prof_start(void){
+	TIM_TIMERCFG_Type timer_cfg;
+
+	timer_cfg.PrescaleOption = TIM_PRESCALE_USVAL;
+	timer_cfg.PrescaleValue = 1;
+	TIM_Init(LPC_TIM2, TIM_TIMER_MODE, &timer_cfg);
+	TIM_Cmd(LPC_TIM2, ENABLE);
+	TIM_ResetCounter(LPC_TIM2);
+}
+
+static uint32_t boot_prof_now(void){
+	uint32_t us = LPC_TIM2->TC;
+
+	return (us == 0) ? 1 : us;						//0 is not reached yet
+}
+
+//Record the first time mark is reached, safe to call from ISRs
+static void boot_mark(int mark){
+	if (boot_marks[mark] == 0){
+		boot_marks[mark] = boot_prof_now();
+	}
+}
+
+static void boot_prof_dump(void);
+
+#define BOOT_MARK(mark)			boot_mark(mark)
+#else
+#define BOOT_MARK(mark)
+#endif
+
+#ifdef TEMP_CAPTURE_MODE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Hardware temperature measurement
+// TIMER3 counts rising edges of the sensor on CAP3.0 and interrupts once every
+// TEMP_CAPTURE_PERIODS periods. TIMER0 runs free at PCLK (25MHz) without
+// interrupts and timestamps each window, replacing 10000 usTicks IRQs/s and
+// 1 EINT3 IRQ per sensor edge with a single IRQ per measurement
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TEMP_CAPTURE_PERIODS		(NUM_HALF_PERIODS / 2)
+#define TEMP_CAPTURE_TICKS_PER_US	25					//TIMER0 PCLK = 100MHz / 4
+
+uint32_t old_temp_capture = 0;
+
+//Initialise Timer0 as a free running 25MHz timestamp counter
+void init_timer(void){
+	TIM_TIMERCFG_Type timer_cfg;
+
+	timer_cfg.PrescaleOption = TIM_PRESCALE_TICKVAL;
+	timer_cfg.PrescaleValue = 1;						//TC increments on every PCLK
+	TIM_Init(LPC_TIM0, TIM_TIMER_MODE, &timer_cfg);
+
+	TIM_Cmd(LPC_TIM0, ENABLE);
+	TIM_ResetCounter(LPC_TIM0);
+}
+
+//Initialise Timer3 to count temperature sensor edges on CAP3.0 (P0.23)
+void init_temp_capture(void){
+	TIM_COUNTERCFG_Type counter_cfg;
+	TIM_MATCHCFG_Type match_cfg;
+	PINSEL_CFG_Type PinCfg;
+
+	PinCfg.Portnum = 0;
+	PinCfg.Pinnum = 23;
+	PinCfg.Funcnum = 3;									//CAP3.0
+	PinCfg.OpenDrain = 0;
+	PinCfg.Pinmode = 0;
+	PINSEL_ConfigPin(&PinCfg);
+
+	counter_cfg.CounterOption = TIM_COUNTER_INCAP0;
+	counter_cfg.CountInputSelect = TIM_COUNTER_INCAP0;
+	TIM_Init(LPC_TIM3, TIM_COUNTER_RISING_MODE, &counter_cfg);
+
+	match_cfg.ExtMatchOutputType = 0;
+	match_cfg.IntOnMatch = ENABLE;
+	match_cfg.MatchChannel = 0;
+	match_cfg.MatchValue = TEMP_CAPTURE_PERIODS - 1;	//TC runs 0..MR0, so MR0+1 edges per window
+	match_cfg.ResetOnMatch = ENABLE;
+	match_cfg.StopOnMatch = DISABLE;
+	TIM_ConfigMatch(LPC_TIM3, &match_cfg);
+
+	TIM_Cmd(LPC_TIM3, ENABLE);
+	TIM_ResetCounter(LPC_TIM3);
+}
+
+//Convert TIMER0 ticks spanning TEMP_CAPTURE_PERIODS periods into 0.1 deg C
+int32_t temp_from_capture(uint32_t ticks){
+	uint32_t div = TEMP_CAPTURE_TICKS_PER_US * NUM_HALF_PERIODS * TEMP_SCALAR_DIV10;
+
+	return (int32_t)((2*ticks + div/2) / div) - 2731;
+}
+
+//One interrupt per measurement window
+void TIMER3_IRQHandler(void){
+	uint32_t now = LPC_TIM0->TC;
+
+	temp_time_period = now - old_temp_capture;
+	old_temp_capture = now;
+	temperature = temp_from_capture(temp_time_period);
+	TRACE_TEMP(temperature);
+	BOOT_MARK(BOOT_MARK_TEMP);
+
+	LPC_TIM3->IR = 0x01;								//Clear MR0 interrupt
+}
+
+#else
 //Initialise Timer0 to produces a interrupt in every 100us
 void init_timer(void){
 	TIM_TIMERCFG_Type timer_cfg;
@@ -153,92 +999,1547 @@ void init_timer(void){
 	timer_cfg.PrescaleValue = 25;							//Clear Prescale counter when PC == 25 and produce a tick in TC
 	TIM_Init(LPC_TIM0, TIM_TIMER_MODE, &timer_cfg);			//Calls even more functions to set frequency of Timer0 = (Timer0_Peripheral_Clk_Freq / 4) = (100MHz / 4) = 25MHz
 
-	match_cfg.ExtMatchOutputType = 0;						//External Match Register (EMR): Do nothing for external output pin if match
-	match_cfg.IntOnMatch = ENABLE;							//Interrupt on Match Enabled
-	match_cfg.MatchChannel = 0;								//Match to Timer0
-	match_cfg.MatchValue = 100;								//Generate an interrupt when TC = 100 (ie. match MR0)
-	match_cfg.ResetOnMatch = ENABLE;
-	match_cfg.StopOnMatch = DISABLE;
-	TIM_ConfigMatch(LPC_TIM0, &match_cfg);
+	match_cfg.ExtMatchOutputType = 0;						//External Match Register (EMR): Do nothing for external output pin if match
+	match_cfg.IntOnMatch = ENABLE;							//Interrupt on Match Enabled
+	match_cfg.MatchChannel = 0;								//Match to Timer0
+	match_cfg.MatchValue = 100;								//Generate an interrupt when TC = 100 (ie. match MR0)
+	match_cfg.ResetOnMatch = ENABLE;
+	match_cfg.StopOnMatch = DISABLE;
+	TIM_ConfigMatch(LPC_TIM0, &match_cfg);
+
+	TIM_Cmd(LPC_TIM0, ENABLE);
+	TIM_ResetCounter(LPC_TIM0);
+
+}
+#endif
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// UART3 transmit ring buffer
+// Main loop only copies msgs into uart_tx_buf, UART3_IRQHandler drains it
+// into the 16 byte TX FIFO every time THRE (TX FIFO empty) is raised
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define UART_TX_BUF_SIZE		256					//must be a power of 2
+#define UART_TX_FIFO_DEPTH		16
+
+static uint8_t uart_tx_buf[UART_TX_BUF_SIZE];
+static volatile uint32_t uart_tx_head = 0;			//only written by main loop
+static volatile uint32_t uart_tx_tail = 0;			//only written by UART3_IRQHandler
+static volatile bool uart_tx_busy = false;			//TX FIFO is loaded and a THRE interrupt will follow
+
+uint32_t uart_tx_overflow = 0;						//bytes dropped because ring was full
+uint32_t uart_tx_highwater = 0;						//most bytes ever waiting in ring
+
+#ifdef HOST_SIM
+//Host stand-in for UART3: bytes written to THR are appended to sim_uart3_out,
+//sim/host_sim.c empties the simulated TX FIFO one character at a time
+uint8_t sim_uart3_out[4096];
+uint32_t sim_uart3_out_len = 0;
+static uint32_t sim_uart3_fifo = 0;
+
+#define UART3_TX_PUT(c)	do { if (sim_uart3_out_len < sizeof(sim_uart3_out)) sim_uart3_out[sim_uart3_out_len++] = (c); sim_uart3_fifo++; } while (0)
+#else
+#define UART3_TX_PUT(c)	(LPC_UART3->THR = (c))
+#endif
+
+#ifdef FLASH_LOG
+static volatile bool flog_draining;
+static void flog_drain(void);
+#endif
+
+#define TLM_RING_LOW			32					//telemetry waits in its queues until the ring is down to this
+static volatile uint32_t tlm_waiting = 0;			//messages in the telemetry queues
+static volatile bool tlm_pump_posted = false;
+static void tlm_pump(void);
+
+//Load up to 16 queued bytes into the TX FIFO
+//Called on THRE, or by uart_tx_write when the transmitter is idle
+static void uart_tx_fill(void){
+	uint32_t tail = uart_tx_tail;
+	int n = 0;
+
+	while ((n < UART_TX_FIFO_DEPTH) && (tail != uart_tx_head)){
+		UART3_TX_PUT(uart_tx_buf[tail & (UART_TX_BUF_SIZE - 1)]);
+		tail++;
+		n++;
+	}
+	uart_tx_tail = tail;
+	uart_tx_busy = (n != 0);					//no THRE will follow if nothing was loaded
+	if ((tlm_waiting != 0) && !tlm_pump_posted && ((uart_tx_head - tail) <= TLM_RING_LOW)){
+		tlm_pump_posted = true;
+		sched_post(tlm_pump);					//room for the next telemetry msg by priority
+	}
+#ifdef FLASH_LOG
+	if ((n == 0) && flog_draining){
+		sched_post(flog_drain);					//ring is empty, send the next stored records
+	}
+#endif
+}
+
+//Queue a msg for UART3 without waiting for it to be sent
+//Msg is dropped as a whole if it does not fit, returns number of bytes queued
+uint32_t uart_tx_write(const uint8_t *data, uint32_t len){
+	uint32_t head = uart_tx_head;
+	uint32_t used = head - uart_tx_tail;
+	uint32_t i;
+
+	if (len > (UART_TX_BUF_SIZE - used)){
+		uart_tx_overflow += len;
+		return 0;
+	}
+
+	for (i = 0; i < len; i++){
+		uart_tx_buf[(head + i) & (UART_TX_BUF_SIZE - 1)] = data[i];
+	}
+	uart_tx_head = head + len;
+
+	used += len;
+	if (used > uart_tx_highwater){
+		uart_tx_highwater = used;
+	}
+
+	//Start the transmitter if THRE interrupt is not already draining the ring
+	NVIC_DisableIRQ(UART3_IRQn);
+	if (!uart_tx_busy){
+		uart_tx_fill();
+	}
+	NVIC_EnableIRQ(UART3_IRQn);
+
+	return len;
+}
+
+//Queue a text line, sleeping until the ring has room for all of it
+//Line must be shorter than UART_TX_BUF_SIZE
+void uart_tx_print(const char *line){
+	while (uart_tx_write((const uint8_t *)line, strlen(line)) == 0){
+		sched_idle();
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Telemetry scheduler
+// Msgs for SAFE wait in one queue per class, highest priority first:
+//   TLM_CLASS_ALERT    algae and waste detections
+//   TLM_CLASS_MODE     entering and leaving modes
+//   TLM_CLASS_SAMPLE   sensor records, also detections sent with old
+//                      records from the flash log
+// A msg moves on to the TX ring only once the ring is down to TLM_RING_LOW
+// bytes, so an alert waits behind at most that much and one msg instead of
+// a full ring of samples. tlm_pump() runs as each msg is queued and is
+// posted by uart_tx_fill() when the ring gets low.
+// When the link cannot keep up the sample queue fills, a new sample then
+// replaces the oldest one waiting, which is stale by now. Alerts and mode
+// msgs are never dropped for room, only if their own queue is full.
+// Diagnostic reports use uart_tx_print() and go straight to the ring.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TLM_CLASS_ALERT			0
+#define TLM_CLASS_MODE			1
+#define TLM_CLASS_SAMPLE		2
+#define TLM_CLASSES				3
+#define TLM_QUEUE_SIZE			4					//must be a power of 2
+#define TLM_MSG_MAX				72					//largest binary frame, or text line
+
+typedef struct {
+	uint8_t data[TLM_MSG_MAX];
+	uint8_t len;
+	uint32_t queued;								//sched_cycles() at tlm_queue()
+} TLM_MSG;
+
+typedef struct {
+	uint32_t queued;
+	uint32_t sent;
+	uint32_t dropped;								//stale samples replaced, or no room
+	uint32_t depth_max;
+	uint32_t latency_max;							//tlm_queue() to the TX ring, cycles
+	uint64_t latency_sum;
+} TLM_STATS;
+
+static TLM_MSG tlm_queue_msgs[TLM_CLASSES][TLM_QUEUE_SIZE];
+static uint32_t tlm_queue_head[TLM_CLASSES];		//only main loop and tasks touch the queues
+static uint32_t tlm_queue_tail[TLM_CLASSES];
+
+TLM_STATS tlm_stats[TLM_CLASSES];
+static const char *tlm_class_names[TLM_CLASSES] = {"ALERT", "MODE", "SAMPLE"};
+
+void tlm_stats_reset(void){
+	memset(tlm_stats, 0, sizeof(tlm_stats));
+}
+
+//Free slots in the queue of cls
+static uint32_t tlm_queue_free(int cls){
+	return TLM_QUEUE_SIZE - (tlm_queue_head[cls] - tlm_queue_tail[cls]);
+}
+
+//Move queued msgs to the TX ring by priority while it is low
+static void tlm_pump(void){
+	TLM_MSG *msg;
+	uint32_t latency;
+	int cls;
+
+	tlm_pump_posted = false;
+	while ((uart_tx_head - uart_tx_tail) <= TLM_RING_LOW){
+		for (cls = 0; (cls < TLM_CLASSES) && (tlm_queue_tail[cls] == tlm_queue_head[cls]); cls++);
+		if (cls == TLM_CLASSES){
+			return;
+		}
+		msg = &tlm_queue_msgs[cls][tlm_queue_tail[cls] & (TLM_QUEUE_SIZE - 1)];
+		if (uart_tx_write(msg->data, msg->len) == 0){
+			return;
+		}
+		latency = sched_cycles() - msg->queued;
+		tlm_stats[cls].sent++;
+		tlm_stats[cls].latency_sum += latency;
+		if (latency > tlm_stats[cls].latency_max){
+			tlm_stats[cls].latency_max = latency;
+		}
+		tlm_queue_tail[cls]++;
+		tlm_waiting--;
+	}
+}
+
+//Queue a msg for SAFE in class cls, returns len or 0 if it was dropped
+static uint32_t tlm_queue(int cls, const uint8_t *data, uint32_t len){
+	TLM_MSG *msg;
+	uint32_t depth;
+
+	if (len > TLM_MSG_MAX){
+		tlm_stats[cls].dropped++;
+		return 0;
+	}
+	if (tlm_queue_free(cls) == 0){
+		tlm_stats[cls].dropped++;
+		if (cls != TLM_CLASS_SAMPLE){
+			return 0;
+		}
+		tlm_queue_tail[cls]++;						//oldest sample makes way
+		tlm_waiting--;
+	}
+	msg = &tlm_queue_msgs[cls][tlm_queue_head[cls] & (TLM_QUEUE_SIZE - 1)];
+	memcpy(msg->data, data, len);
+	msg->len = len;
+	msg->queued = sched_cycles();
+	tlm_queue_head[cls]++;
+	tlm_waiting++;
+
+	tlm_stats[cls].queued++;
+	depth = tlm_queue_head[cls] - tlm_queue_tail[cls];
+	if (depth > tlm_stats[cls].depth_max){
+		tlm_stats[cls].depth_max = depth;
+	}
+	tlm_pump();
+	return len;
+}
+
+//Fixed text msg for SAFE
+static void tlm_queue_text(int cls, const char *msg){
+	tlm_queue(cls, (const uint8_t *)msg, strlen(msg));
+}
+
+//Senders for tlm_batch_flush()
+static uint32_t tlm_queue_alert(const uint8_t *data, uint32_t len){
+	return tlm_queue(TLM_CLASS_ALERT, data, len);
+}
+
+static uint32_t tlm_queue_sample(const uint8_t *data, uint32_t len){
+	return tlm_queue(TLM_CLASS_SAMPLE, data, len);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// UART3 receive ring buffer
+// UART3_IRQHandler empties the RX FIFO into uart_rx_buf on RDA (8 chars in)
+// and character timeout, the main loop reads it with uart_rx_read().
+// Single producer, single consumer: head is only written by the ISR and
+// tail only by the main loop, so no locking is needed.
+// RX stays enabled in every mode so the FIFO never overruns, keys are only
+// queued while uart_rx_enable(true).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define UART_RX_BUF_SIZE		64					//must be a power of 2
+
+static uint8_t uart_rx_buf[UART_RX_BUF_SIZE];
+static volatile uint32_t uart_rx_head = 0;			//only written by UART3_IRQHandler
+static volatile uint32_t uart_rx_tail = 0;			//only written by main loop
+static volatile bool uart_rx_keys = false;			//queue keys, otherwise only commands are acted on
+
+uint32_t uart_rx_count = 0;							//bytes queued
+uint32_t uart_rx_dropped = 0;						//bytes lost because ring was full
+uint32_t uart_rx_overrun = 0;						//RX FIFO overruns (OE), at least 1 byte lost each
+
+#ifdef FLASH_LOG
+#define FLOG_REPORT_KEY			'f'
+static void flog_rx(void);
+static void flog_report(void);
+#endif
+
+#ifdef STACK_WATERMARK
+#define STACK_REPORT_KEY		'h'
+static void stack_report(void);
+#endif
+
+//Read everything in the RX FIFO, called from UART3_IRQHandler
+static void uart_rx_drain(void){
+	uint32_t head = uart_rx_head;
+	uint8_t lsr;
+	uint8_t data;
+
+	while ((lsr = UART_GetLineStatus(LPC_UART3)) & UART_LSR_RDR){
+		data = UART_ReceiveByte(LPC_UART3);
+		if (lsr & UART_LSR_OE){
+			uart_rx_overrun++;
+		}
+#ifdef FLASH_LOG
+		flog_rx();									//any byte from SAFE means the link is up
+		if (data == FLOG_REPORT_KEY){
+			sched_post(flog_report);
+			continue;
+		}
+#endif
+#ifdef BOOT_PROFILE
+		if (data == BOOT_DUMP_KEY){
+			sched_post(boot_prof_dump);
+			continue;
+		}
+#endif
+#ifdef STACK_WATERMARK
+		if (data == STACK_REPORT_KEY){
+			sched_post(stack_report);
+			continue;
+		}
+#endif
+#if ISR_PROFILE
+		if (data == ISR_PROF_DUMP_KEY){
+			sched_post(isr_prof_dump);
+			continue;
+		}
+#endif
+#ifdef SENSOR_TRACE
+		if (data == TRACE_DUMP_KEY){
+			sched_post(trace_dump);
+			continue;
+		}
+#endif
+		if (!uart_rx_keys){
+			continue;
+		}
+		if ((head - uart_rx_tail) == UART_RX_BUF_SIZE){
+			uart_rx_dropped++;
+			continue;
+		}
+		uart_rx_buf[head & (UART_RX_BUF_SIZE - 1)] = data;
+		head++;
+		uart_rx_count++;
+	}
+	uart_rx_head = head;
+}
+
+//Take the oldest queued byte, returns false if there is none
+bool uart_rx_read(uint8_t *data){
+	uint32_t tail = uart_rx_tail;
+
+	if (tail == uart_rx_head){
+		return false;
+	}
+	*data = uart_rx_buf[tail & (UART_RX_BUF_SIZE - 1)];
+	uart_rx_tail = tail + 1;
+	return true;
+}
+
+//Start or stop queueing keyboard input from UART3, transmit keeps running
+//Starting drops anything typed while input was off
+void uart_rx_enable(bool enable){
+	if (enable){
+		uart_rx_tail = uart_rx_head;
+	}
+	uart_rx_keys = enable;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Interrupt-driven I2C2 engine
+// Transactions (write, read, or write then repeated START and read) are
+// queued with i2c_submit() and run back to back by I2C2_IRQHandler.
+// The done callback of each transaction runs in interrupt context.
+// Baseboard driver calls (light_*, acc_*, pca9532_*) poll the bus
+// themselves and must be wrapped in i2c_suspend()/i2c_resume().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define I2C_CLOCK_RATE			400000				//ISL29003, MMA7455 and PCA9532 all support fast-mode
+#define I2C_QUEUE_SIZE			8					//must be a power of 2
+
+#define I2C_XFER_IDLE			0
+#define I2C_XFER_PENDING		1
+#define I2C_XFER_OK				2
+#define I2C_XFER_ERROR			3
+
+typedef struct I2C_XFER {
+	uint8_t addr;									//7 bit slave address
+	uint8_t *tx;
+	uint8_t tx_len;
+	uint8_t *rx;
+	uint8_t rx_len;
+	void (*done)(struct I2C_XFER *xfer);			//called from I2C2_IRQHandler, may be NULL
+	volatile uint8_t status;
+} I2C_XFER;
+
+static I2C_XFER *i2c_queue[I2C_QUEUE_SIZE];
+static volatile uint8_t i2c_queue_head = 0;
+static volatile uint8_t i2c_queue_tail = 0;
+static volatile bool i2c_busy = false;
+#ifndef HOST_SIM
+static uint8_t i2c_tx_idx = 0;
+static uint8_t i2c_rx_idx = 0;
+#endif
+
+uint32_t i2c_xfer_count = 0;
+uint32_t i2c_error_count = 0;
+uint32_t i2c_queue_full = 0;
+
+#ifdef HOST_SIM
+//Mock I2C bus for the host build: every 7 bit address owns 256 registers,
+//a write sets the register pointer (first byte) then stores the rest,
+//a read returns registers from the pointer with auto increment.
+//sim_i2c_step() completes one queued transaction, like one I2C2 burst would
+uint8_t sim_i2c_regs[128][256];
+static uint8_t sim_i2c_ptr[128];
+
+static void i2c_finish(uint8_t status);
+
+static void i2c_start(void){
+}
+
+void sim_i2c_step(void){
+	I2C_XFER *xfer;
+	uint8_t i;
+
+	if (!i2c_busy){
+		return;
+	}
+	xfer = i2c_queue[i2c_queue_tail & (I2C_QUEUE_SIZE - 1)];
+	for (i = 0; i < xfer->tx_len; i++){
+		if (i == 0){
+			sim_i2c_ptr[xfer->addr] = xfer->tx[0];
+		}
+		else{
+			sim_i2c_regs[xfer->addr][sim_i2c_ptr[xfer->addr]++] = xfer->tx[i];
+		}
+	}
+	for (i = 0; i < xfer->rx_len; i++){
+		xfer->rx[i] = sim_i2c_regs[xfer->addr][sim_i2c_ptr[xfer->addr]++];
+	}
+	i2c_finish(I2C_XFER_OK);
+}
+#else
+static void i2c_start(void){
+	i2c_tx_idx = 0;
+	i2c_rx_idx = 0;
+	LPC_I2C2->I2CONSET = I2C_I2CONSET_STA;
+}
+#endif
+
+//Complete the transaction at the queue tail and start the next one
+static void i2c_finish(uint8_t status){
+	I2C_XFER *xfer = i2c_queue[i2c_queue_tail & (I2C_QUEUE_SIZE - 1)];
+
+	i2c_queue_tail++;
+	xfer->status = status;
+	i2c_xfer_count++;
+	if (status == I2C_XFER_ERROR){
+		i2c_error_count++;
+	}
+
+	i2c_busy = (i2c_queue_tail != i2c_queue_head);
+	if (i2c_busy){
+		i2c_start();									//STA is sent after the pending STOP
+	}
+
+	if (xfer->done){
+		xfer->done(xfer);
+	}
+}
+
+//Queue a transaction, safe to call from ISRs and done callbacks
+//Returns false if xfer is still pending or the queue is full
+bool i2c_submit(I2C_XFER *xfer){
+	uint32_t primask = __get_PRIMASK();
+	bool ok = false;
+
+	__disable_irq();
+	if ((xfer->status != I2C_XFER_PENDING) && ((uint8_t)(i2c_queue_head - i2c_queue_tail) < I2C_QUEUE_SIZE)){
+		xfer->status = I2C_XFER_PENDING;
+		i2c_queue[i2c_queue_head & (I2C_QUEUE_SIZE - 1)] = xfer;
+		i2c_queue_head++;
+		if (!i2c_busy){
+			i2c_busy = true;
+			i2c_start();
+		}
+		ok = true;
+	}
+	else if (xfer->status != I2C_XFER_PENDING){
+		i2c_queue_full++;
+	}
+	__set_PRIMASK(primask);
+	return ok;
+}
+
+//Wait for queued transactions to finish and hand the bus to the polled drivers
+void i2c_suspend(void){
+	while (i2c_busy){
+#ifdef HOST_SIM
+		sim_i2c_step();
+#endif
+	}
+	NVIC_DisableIRQ(I2C2_IRQn);
+}
+
+void i2c_resume(void){
+	NVIC_ClearPendingIRQ(I2C2_IRQn);
+	NVIC_EnableIRQ(I2C2_IRQn);
+}
+
+#ifndef HOST_SIM
+void I2C2_IRQHandler(void){
+	I2C_XFER *xfer = i2c_queue[i2c_queue_tail & (I2C_QUEUE_SIZE - 1)];
+
+	switch (LPC_I2C2->I2STAT & 0xF8){
+	case 0x08:											//START sent
+	case 0x10:											//repeated START sent
+		LPC_I2C2->I2DAT = (xfer->addr << 1) | ((i2c_tx_idx < xfer->tx_len) ? 0 : 1);
+		LPC_I2C2->I2CONCLR = I2C_I2CONCLR_STAC;
+		break;
+
+	case 0x18:											//SLA+W ACKed
+	case 0x28:											//data ACKed
+		if (i2c_tx_idx < xfer->tx_len){
+			LPC_I2C2->I2DAT = xfer->tx[i2c_tx_idx++];
+		}
+		else if (xfer->rx_len > 0){
+			LPC_I2C2->I2CONSET = I2C_I2CONSET_STA;		//repeated START for the read phase
+		}
+		else{
+			LPC_I2C2->I2CONSET = I2C_I2CONSET_STO;
+			i2c_finish(I2C_XFER_OK);
+		}
+		break;
+
+	case 0x40:											//SLA+R ACKed
+		if (xfer->rx_len > 1){
+			LPC_I2C2->I2CONSET = I2C_I2CONSET_AA;
+		}
+		else{
+			LPC_I2C2->I2CONCLR = I2C_I2CONCLR_AAC;
+		}
+		break;
+
+	case 0x50:											//data received, ACK sent
+		xfer->rx[i2c_rx_idx++] = LPC_I2C2->I2DAT;
+		if (i2c_rx_idx + 1 >= xfer->rx_len){
+			LPC_I2C2->I2CONCLR = I2C_I2CONCLR_AAC;		//NACK the last byte
+		}
+		break;
+
+	case 0x58:											//last byte received, NACK sent
+		xfer->rx[i2c_rx_idx++] = LPC_I2C2->I2DAT;
+		LPC_I2C2->I2CONSET = I2C_I2CONSET_STO;
+		i2c_finish(I2C_XFER_OK);
+		break;
+
+	default:											//NACK, arbitration lost or bus error
+		LPC_I2C2->I2CONSET = I2C_I2CONSET_STO;
+		i2c_finish(I2C_XFER_ERROR);
+		break;
+	}
+	LPC_I2C2->I2CONCLR = I2C_I2CONCLR_SIC;
+}
+#endif
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Interrupt Handlers
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#ifdef LIGHT_IRQ_MODE
+static void light_irq_edge(void);
+#endif
+#ifdef ACC_MOTION_MODE
+static void acc_motion_edge(void);
+#endif
+
+void EINT3_IRQHandler(void){
+	ISR_PROF_BEGIN(ISR_PROF_EINT3, isr_prof_chain_latency(isr_prof_t0));
+	BENCH_ISR_BEGIN();
+
+	if ((LPC_GPIOINT->IO2IntStatF>>10)& 0x1){		// Determine whether SW3 is pressed n falling edge
+		if(mode_state == MODE_DATE){				//Trigger only in DATE Mode
+			SW3 = true;
+			// Clear GPIO Interrupt P2.10
+			LPC_GPIOINT->IO2IntClr = 1<<10;
+		}
+		else{
+			// Clear GPIO Interrupt P2.10
+			LPC_GPIOINT->IO2IntClr = 1<<10;
+		}
+	}
+
+#ifdef LIGHT_IRQ_MODE
+	if ((LPC_GPIOINT->IO2IntStatF>>5)& 0x1){			// Light sensor INT (P2.5) pulled low, reading left the window
+		LPC_GPIOINT->IO2IntClr = 1<<5;
+		light_irq_edge();
+	}
+#endif
+
+#ifdef ACC_MOTION_MODE
+	if ((LPC_GPIOINT->IO0IntStatR>>3)& 0x1){			// Accelerometer INT1 (P0.3) high, motion over ACC_MOTION_MG
+		LPC_GPIOINT->IO0IntClr = 1<<3;
+		acc_motion_edge();
+	}
+#endif
+
+#ifndef TEMP_CAPTURE_MODE
+	//Obtain Temperature
+	if ((LPC_GPIOINT->IO0IntStatR>>2)& 0x1){						// Determine whether P0.2 (Temperature sensor GPIO) is at rising edge
+		//Continue to add period counter if periods sampled < 151
+		if(temp_period_count < 151){								// (temp_period_count < ((NUM_HALF_PERIODS / 2) + 1);
+			temp_period_count++;
+		}
+		else{
+#ifdef TEMP_ISR_BENCH
+			uint32_t start_cycles = DWT->CYCCNT;
+#endif
+			//Get time interval for 151 periods
+			temp_time_period = getusTicks() - old_temp_ticks;
+			old_temp_ticks = getusTicks();
+			temp_period_count = 0;								//reset period counter
+
+			//calculate temperature in 0.1 deg C using formula, integer only
+			temperature = (int32_t)((2*100*temp_time_period) / (NUM_HALF_PERIODS*TEMP_SCALAR_DIV10)) - 2731;
+			TRACE_TEMP(temperature);
+			BOOT_MARK(BOOT_MARK_TEMP);
+#ifdef TEMP_ISR_BENCH
+			temp_isr_cycles = DWT->CYCCNT - start_cycles;
+			if (temp_isr_cycles > temp_isr_cycles_max){
+				temp_isr_cycles_max = temp_isr_cycles;
+			}
+#endif
+		}
+		// Clear GPIO Interrupt P0.2
+		LPC_GPIOINT->IO0IntClr = 1<<2;
+	}
+#endif
+
+	BENCH_ISR_END(BENCH_ISR_EINT3);
+	ISR_PROF_END(ISR_PROF_EINT3);
+}
+
+//Count instances of 100us using interrupt handlers and usTicks
+void TIMER0_IRQHandler(void)
+{
+		ISR_PROF_BEGIN(ISR_PROF_TIMER0, isr_prof_timer0_latency());
+		BENCH_ISR_BEGIN();
+		usTicks++;
+		LPC_TIM0->IR|=0x01;			//Clear Timer0 Interrupt by writing '1' to Interrupt Register
+		BENCH_ISR_END(BENCH_ISR_TIMER0);
+		ISR_PROF_END(ISR_PROF_TIMER0);
+}
+
+// When user keys in a character, UART receives it
+// Keys are queued in uart_rx_buf and parsed by charge_uart_input()
+void UART3_IRQHandler(void) {
+	ISR_PROF_BEGIN(ISR_PROF_UART3, isr_prof_chain_latency(isr_prof_t0));
+	BENCH_ISR_BEGIN();
+	uint32_t intsrc = LPC_UART3->IIR & UART_IIR_INTID_MASK;		//Reading IIR also clears THRE
+
+	//TX FIFO empty, load the next bytes from the ring buffer
+	if (intsrc == UART_IIR_INTID_THRE){
+		uart_tx_fill();
+		BENCH_ISR_END(BENCH_ISR_UART3);
+		ISR_PROF_END(ISR_PROF_UART3);
+		return;
+	}
+
+	//RX data available or character timeout, queue it for the main loop
+	uart_rx_drain();
+
+	BENCH_ISR_END(BENCH_ISR_UART3);
+	ISR_PROF_END(ISR_PROF_UART3);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// SSP1 DMA engine
+// The OLED and the 7 segment display share SSP1 and differ only in chip
+// select (plus the OLED D/C line). Transactions are queued per device with
+// ssp_submit() and sent by GPDMA: one channel feeds the TX FIFO, the other
+// empties the RX FIFO and its terminal count interrupt means the last bit
+// has left the wire. DMA_IRQHandler then releases the chip select, starts
+// the next transaction and calls the done callback.
+// Between transactions the 7 segment queue goes first, a one byte digit
+// update never waits behind a whole OLED frame.
+// Baseboard driver calls that poll SSP1 (led7seg_setChar) must come after
+// ssp_drain().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SSP_QUEUE_SIZE			16					//per device, must be a power of 2
+#define SSP_XFER_MAX			(3 + OLED_DISPLAY_WIDTH)	//OLED page address command and one page
+#define SSP_DMA_TX_CH			0
+#define SSP_DMA_RX_CH			1
+
+#define SSP_DEV_LED7SEG			0					//also the arbitration order
+#define SSP_DEV_OLED			1
+#define SSP_DEV_COUNT			2
+
+#define SSP_XFER_IDLE			0
+#define SSP_XFER_PENDING		1
+#define SSP_XFER_DONE			2
+
+#define OLED_CS_OFF()			GPIO_SetValue(0, (1<<6))
+#define OLED_CS_ON()			GPIO_ClearValue(0, (1<<6))
+#define OLED_DATA()				GPIO_SetValue(2, (1<<7))
+#define OLED_CMD()				GPIO_ClearValue(2, (1<<7))
+#define LED7SEG_CS_OFF()		GPIO_SetValue(2, (1<<2))
+#define LED7SEG_CS_ON()			GPIO_ClearValue(2, (1<<2))
+
+typedef struct SSP_XFER {
+	uint8_t dev;									//SSP_DEV_*
+	bool data;										//OLED D/C high, pixels rather than commands
+	const uint8_t *tx;
+	uint16_t len;									//1..SSP_XFER_MAX
+	void (*done)(struct SSP_XFER *xfer);			//called from DMA_IRQHandler, may be NULL
+	volatile uint8_t status;
+	uint32_t queued;								//sched_cycles() at ssp_submit()
+} SSP_XFER;
+
+typedef struct {
+	uint32_t xfers;
+	uint32_t bytes;
+	uint64_t busy_cycles;							//chip select asserted, bus occupied
+	uint32_t wait_max;								//longest ssp_submit() to chip select, cycles
+	uint32_t done_max;								//longest ssp_submit() to done, cycles
+	uint32_t queue_full;
+} SSP_STATS;
+
+static SSP_XFER *ssp_queue[SSP_DEV_COUNT][SSP_QUEUE_SIZE];
+static volatile uint8_t ssp_queue_head[SSP_DEV_COUNT];
+static volatile uint8_t ssp_queue_tail[SSP_DEV_COUNT];
+static SSP_XFER * volatile ssp_current = NULL;		//on the bus
+static uint32_t ssp_started;						//sched_cycles() when ssp_current started
+static uint8_t ssp_rx_sink[SSP_XFER_MAX];			//RX channel drains the FIFO here
+
+SSP_STATS ssp_stats[SSP_DEV_COUNT];
+uint64_t ssp_stats_start = 0;						//sched_cycles64() when stats were last reset
+
+//Next transaction by device priority, NULL if every queue is empty
+static SSP_XFER *ssp_next(void){
+	uint8_t dev;
+
+	for (dev = 0; dev < SSP_DEV_COUNT; dev++){
+		if (ssp_queue_tail[dev] != ssp_queue_head[dev]){
+			return ssp_queue[dev][ssp_queue_tail[dev]++ & (SSP_QUEUE_SIZE - 1)];
+		}
+	}
+	return NULL;
+}
+
+//Select the device and hand ssp_current to the DMA channels
+static void ssp_start(void){
+	SSP_XFER *xfer = ssp_current;
+	GPDMA_Channel_CFG_Type cfg;
+	uint32_t wait;
+
+	if (xfer->dev == SSP_DEV_OLED){
+		if (xfer->data){
+			OLED_DATA();
+		}
+		else{
+			OLED_CMD();
+		}
+		OLED_CS_ON();
+	}
+	else{
+		LED7SEG_CS_ON();
+	}
+
+	ssp_started = sched_cycles();
+	wait = ssp_started - xfer->queued;
+	if (wait > ssp_stats[xfer->dev].wait_max){
+		ssp_stats[xfer->dev].wait_max = wait;
+	}
+
+	cfg.ChannelNum = SSP_DMA_RX_CH;
+	cfg.TransferSize = xfer->len;
+	cfg.TransferWidth = GPDMA_WIDTH_BYTE;
+	cfg.SrcMemAddr = 0;
+	cfg.DstMemAddr = (uintptr_t)ssp_rx_sink;
+	cfg.TransferType = GPDMA_TRANSFERTYPE_P2M;
+	cfg.SrcConn = GPDMA_CONN_SSP1_Rx;
+	cfg.DstConn = 0;
+	cfg.DMALLI = 0;
+	GPDMA_Setup(&cfg);
+
+	cfg.ChannelNum = SSP_DMA_TX_CH;
+	cfg.SrcMemAddr = (uintptr_t)xfer->tx;
+	cfg.DstMemAddr = 0;
+	cfg.TransferType = GPDMA_TRANSFERTYPE_M2P;
+	cfg.SrcConn = 0;
+	cfg.DstConn = GPDMA_CONN_SSP1_Tx;
+	GPDMA_Setup(&cfg);
+
+	GPDMA_ChannelCmd(SSP_DMA_RX_CH, ENABLE);			//ready to drain before the first byte goes out
+	GPDMA_ChannelCmd(SSP_DMA_TX_CH, ENABLE);
+}
+
+//Queue a transaction, safe to call from ISRs and done callbacks
+//Returns false if xfer is still pending or its device queue is full
+bool ssp_submit(SSP_XFER *xfer){
+	uint32_t primask = __get_PRIMASK();
+	uint8_t dev = xfer->dev;
+	bool ok = false;
+
+	__disable_irq();
+	if ((xfer->status != SSP_XFER_PENDING) && ((uint8_t)(ssp_queue_head[dev] - ssp_queue_tail[dev]) < SSP_QUEUE_SIZE)){
+		xfer->status = SSP_XFER_PENDING;
+		xfer->queued = sched_cycles();
+		ssp_queue[dev][ssp_queue_head[dev]++ & (SSP_QUEUE_SIZE - 1)] = xfer;
+		if (ssp_current == NULL){
+			ssp_current = ssp_next();
+			ssp_start();
+		}
+		ok = true;
+	}
+	else if (xfer->status != SSP_XFER_PENDING){
+		ssp_stats[dev].queue_full++;
+	}
+	__set_PRIMASK(primask);
+	return ok;
+}
+
+//Sleep until xfer is off the bus, its buffer may then be reused
+static void ssp_wait(SSP_XFER *xfer){
+	while (xfer->status == SSP_XFER_PENDING){
+		sched_idle();
+	}
+}
+
+//Sleep until every queued transaction is sent, then SSP1 may be polled
+void ssp_drain(void){
+	while (ssp_current != NULL){
+		sched_idle();
+	}
+}
+
+void DMA_IRQHandler(void){
+	SSP_XFER *xfer = ssp_current;
+	uint32_t now, busy;
+
+	if (GPDMA_IntGetStatus(GPDMA_STAT_INTTC, SSP_DMA_TX_CH)){
+		GPDMA_ClearIntPending(GPDMA_STATCLR_INTTC, SSP_DMA_TX_CH);	//TX FIFO loaded, bits still shifting
+	}
+	if (!GPDMA_IntGetStatus(GPDMA_STAT_INTTC, SSP_DMA_RX_CH)){
+		return;
+	}
+	GPDMA_ClearIntPending(GPDMA_STATCLR_INTTC, SSP_DMA_RX_CH);
+
+	if (xfer->dev == SSP_DEV_OLED){
+		OLED_CS_OFF();
+	}
+	else{
+		LED7SEG_CS_OFF();
+	}
+
+	now = sched_cycles();
+	busy = now - ssp_started;
+	ssp_stats[xfer->dev].xfers++;
+	ssp_stats[xfer->dev].bytes += xfer->len;
+	ssp_stats[xfer->dev].busy_cycles += busy;
+	if ((now - xfer->queued) > ssp_stats[xfer->dev].done_max){
+		ssp_stats[xfer->dev].done_max = now - xfer->queued;
+	}
+	xfer->status = SSP_XFER_DONE;
+
+	ssp_current = ssp_next();
+	if (ssp_current != NULL){
+		ssp_start();
+	}
+
+	if (xfer->done){
+		xfer->done(xfer);
+	}
+}
+
+//Share of time SSP1 carried each device since the last reset, in 0.1%
+uint32_t ssp_bus_load(uint8_t dev){
+	uint64_t total = sched_cycles64() - ssp_stats_start;
+
+	if (total == 0){
+		return 0;
+	}
+	return (uint32_t)((ssp_stats[dev].busy_cycles * 1000) / total);
+}
+
+void ssp_stats_reset(void){
+	memset(ssp_stats, 0, sizeof(ssp_stats));
+	ssp_stats_start = sched_cycles64();
+}
+
+//Call once the baseboard drivers are done polling SSP1
+static void ssp_dma_init(void){
+	OLED_CS_OFF();
+	LED7SEG_CS_OFF();
+	GPDMA_Init();
+	SSP_DMACmd(LPC_SSP1, SSP_DMA_TX | SSP_DMA_RX, ENABLE);
+	ssp_stats_reset();
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// OLED framebuffer
+// All drawing goes into a 96x64 RAM shadow of the display (8 pages of 96
+// columns, 1 bit per pixel, bit 0 = top row of page). Only bytes that
+// actually change mark their page dirty, fb_flush() then copies just the
+// dirty column range of each dirty page to a DMA buffer and queues it on
+// the SSP1 DMA engine. The panel RAM holds whatever it powered up with, so
+// boot marks all of it dirty once with fb_invalidate().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define OLED_PAGES				(OLED_DISPLAY_HEIGHT / 8)
+#define OLED_X_OFFSET			18					//first visible column of the SSD1305
+#define OLED_CLEAN				0xFF
+
+static uint8_t oled_fb[OLED_PAGES][OLED_DISPLAY_WIDTH];
+static uint8_t oled_dirty_min[OLED_PAGES] = {OLED_CLEAN, OLED_CLEAN, OLED_CLEAN, OLED_CLEAN, OLED_CLEAN, OLED_CLEAN, OLED_CLEAN, OLED_CLEAN};
+static uint8_t oled_dirty_max[OLED_PAGES];
+
+uint32_t oled_flush_count = 0;						//number of fb_flush() that sent anything
+uint32_t oled_flush_bytes = 0;						//total bytes queued for SSP1 (commands + pixels)
+
+static void fb_mark_dirty(uint8_t page, uint8_t col){
+	if (oled_dirty_min[page] == OLED_CLEAN){
+		oled_dirty_min[page] = col;
+		oled_dirty_max[page] = col;
+	}
+	else if (col < oled_dirty_min[page]){
+		oled_dirty_min[page] = col;
+	}
+	else if (col > oled_dirty_max[page]){
+		oled_dirty_max[page] = col;
+	}
+}
+
+void fb_putPixel(uint8_t x, uint8_t y, oled_color_t color){
+	uint8_t page = y >> 3;
+	uint8_t old;
+
+	if ((x >= OLED_DISPLAY_WIDTH) || (y >= OLED_DISPLAY_HEIGHT)){
+		return;
+	}
+
+	old = oled_fb[page][x];
+	if (color == OLED_COLOR_WHITE){
+		oled_fb[page][x] |= (1 << (y & 7));
+	}
+	else{
+		oled_fb[page][x] &= ~(1 << (y & 7));
+	}
+
+	if (oled_fb[page][x] != old){
+		fb_mark_dirty(page, x);
+	}
+}
+
+//Same 6x8 glyph layout as oled_putChar, returns 0 if the char does not fit
+uint8_t fb_putChar(uint8_t x, uint8_t y, uint8_t ch, oled_color_t fb, oled_color_t bg){
+	uint8_t data;
+	uint8_t i, j;
+
+	if ((x > OLED_DISPLAY_WIDTH - 6) || (y > OLED_DISPLAY_HEIGHT - 8)){
+		return 0;
+	}
+	if ((ch < 0x20) || (ch > 0x7f)){
+		ch = 0x20;
+	}
+	ch -= 0x20;
+
+	for (i = 0; i < 8; i++){
+		data = font5x7[ch*8 + i];
+		for (j = 0; j < 6; j++){
+			fb_putPixel(x + j, y + i, (data & (0x80 >> j)) ? fb : bg);
+		}
+	}
+	return 1;
+}
+
+void fb_putString(uint8_t x, uint8_t y, uint8_t *pStr, oled_color_t fb, oled_color_t bg){
+	while (*pStr){
+		if (!fb_putChar(x, y, *pStr++, fb, bg)){
+			break;
+		}
+		x += 6;
+	}
+}
+
+//Send the whole framebuffer on the next fb_flush(), whatever the panel shows
+void fb_invalidate(void){
+	uint8_t page;
+
+	for (page = 0; page < OLED_PAGES; page++){
+		oled_dirty_min[page] = 0;
+		oled_dirty_max[page] = OLED_DISPLAY_WIDTH - 1;
+	}
+}
+
+void fb_clearScreen(oled_color_t color){
+	uint8_t fill = (color == OLED_COLOR_WHITE) ? 0xFF : 0x00;
+	uint8_t page, col;
+
+	for (page = 0; page < OLED_PAGES; page++){
+		for (col = 0; col < OLED_DISPLAY_WIDTH; col++){
+			if (oled_fb[page][col] != fill){
+				oled_fb[page][col] = fill;
+				fb_mark_dirty(page, col);
+			}
+		}
+	}
+}
+
+//Page address command and pixels of the last flush of each page, read by DMA
+static uint8_t oled_tx[OLED_PAGES][SSP_XFER_MAX];
+static SSP_XFER oled_cmd_xfer[OLED_PAGES];
+static SSP_XFER oled_data_xfer[OLED_PAGES];
+
+//Queue dirty parts of the framebuffer for the display, returns without
+//waiting for SSP1 unless a page is still going out from the last flush
+void fb_flush(void){
+	uint8_t page, col, len;
+	bool sent = false;
+
+	for (page = 0; page < OLED_PAGES; page++){
+		if (oled_dirty_min[page] == OLED_CLEAN){
+			continue;
+		}
+		col = oled_dirty_min[page] + OLED_X_OFFSET;
+		len = oled_dirty_max[page] - oled_dirty_min[page] + 1;
+		ssp_wait(&oled_data_xfer[page]);
+
+		//Set page and start column, column address auto increments across the dirty run
+		oled_tx[page][0] = 0xB0 | page;
+		oled_tx[page][1] = 0x00 | (col & 0x0F);
+		oled_tx[page][2] = 0x10 | (col >> 4);
+		memcpy(&oled_tx[page][3], &oled_fb[page][oled_dirty_min[page]], len);
+
+		oled_cmd_xfer[page].dev = SSP_DEV_OLED;
+		oled_cmd_xfer[page].data = false;
+		oled_cmd_xfer[page].tx = oled_tx[page];
+		oled_cmd_xfer[page].len = 3;
+		oled_data_xfer[page].dev = SSP_DEV_OLED;
+		oled_data_xfer[page].data = true;
+		oled_data_xfer[page].tx = &oled_tx[page][3];
+		oled_data_xfer[page].len = len;
+		ssp_submit(&oled_cmd_xfer[page]);
+		ssp_submit(&oled_data_xfer[page]);
+		oled_flush_bytes += 3 + len;
+
+		oled_dirty_min[page] = OLED_CLEAN;
+		oled_dirty_max[page] = 0;
+		sent = true;
+	}
+
+	if (sent){
+		oled_flush_count++;
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Output state cache
+// Last state written to the LED array, RGB LED and 7 segment display is kept
+// here, a write that would not change anything never reaches the device
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define RGB_RED_PORT			2
+#define RGB_RED_PIN				0
+#define RGB_BLUE_PORT			0
+#define RGB_BLUE_PIN			26
+
+typedef struct {
+	uint32_t writes;								//writes that reached the device
+	uint32_t suppressed;							//writes skipped because nothing changed
+} OUTPUT_STATS;
+
+OUTPUT_STATS led_array_stats;
+OUTPUT_STATS rgb_stats;
+OUTPUT_STATS led7seg_stats;
+
+static bool rgb_red = false;
+static bool rgb_blue = false;
+static bool rgb_valid = false;
+static uint8_t led7seg_ch = 0;
+static uint32_t led7seg_raw = 0;
+static bool led7seg_valid = false;
+
+#define LED7SEG_BLANK			0xFF				//segments are active low, what led7seg_setChar sends for ' '
+
+static void led7seg_done(SSP_XFER *xfer);
+
+static volatile uint8_t led7seg_want = LED7SEG_BLANK;	//segment pattern to show
+static uint8_t led7seg_buf;							//pattern on the bus, read by DMA
+static SSP_XFER led7seg_xfer = {SSP_DEV_LED7SEG, false, &led7seg_buf, 1, led7seg_done, SSP_XFER_IDLE, 0};
+
+//Set red and blue LED, only pins that change are touched
+void rgb_write(bool red, bool blue){
+	if (rgb_valid && (red == rgb_red) && (blue == rgb_blue)){
+		rgb_stats.suppressed++;
+		return;
+	}
+	if (!rgb_valid || (red != rgb_red)){
+		if (red){
+			GPIO_SetValue(RGB_RED_PORT, (1 << RGB_RED_PIN));
+		}
+		else{
+			GPIO_ClearValue(RGB_RED_PORT, (1 << RGB_RED_PIN));
+		}
+	}
+	if (!rgb_valid || (blue != rgb_blue)){
+		if (blue){
+			GPIO_SetValue(RGB_BLUE_PORT, (1 << RGB_BLUE_PIN));
+		}
+		else{
+			GPIO_ClearValue(RGB_BLUE_PORT, (1 << RGB_BLUE_PIN));
+		}
+	}
+	rgb_red = red;
+	rgb_blue = blue;
+	rgb_valid = true;
+	rgb_stats.writes++;
+}
+
+static void led7seg_start(void){
+	led7seg_buf = led7seg_want;
+	ssp_submit(&led7seg_xfer);
+}
+
+//Send the newest pattern if it changed while the previous one was on the bus
+static void led7seg_done(SSP_XFER *xfer){
+	if (led7seg_want != led7seg_buf){
+		led7seg_start();
+	}
+}
+
+//led7seg_setChar, skipped if the display already shows ch
+//Raw patterns and blank are queued on the SSP1 DMA engine without waiting,
+//other chars need the driver's font and poll SSP1 once the queue is empty
+void led7seg_write(uint8_t ch, uint32_t rawMode){
+	if (led7seg_valid && (ch == led7seg_ch) && (rawMode == led7seg_raw)){
+		led7seg_stats.suppressed++;
+		return;
+	}
+	if (rawMode || (ch == ' ')){
+		led7seg_want = rawMode ? ch : LED7SEG_BLANK;
+		if (led7seg_xfer.status != SSP_XFER_PENDING){
+			led7seg_start();
+		}
+	}
+	else{
+		ssp_drain();
+		led7seg_setChar(ch, rawMode);
+	}
+	led7seg_ch = ch;
+	led7seg_raw = rawMode;
+	led7seg_valid = true;
+	led7seg_stats.writes++;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sensors and LED array over the I2C2 engine
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define LIGHT_I2C_ADDR			0x44
+#define LIGHT_REG_DATA_LSB		0x04
+#define LIGHT_RANGE_K			973					//same lux scaling as light_read() for LIGHT_RANGE_1000, 16 bit
+#define ACC_I2C_ADDR			0x1D
+#define ACC_REG_XOUT8			0x06				//X, Y, Z 8 bit outputs auto increment
+#define PCA9532_I2C_ADDR		0x60
+#define PCA9532_LS0_AUTO_INC	0x16
+#define PCA9532_LED_ON			0x01
+
+static void sensors_acc_done(I2C_XFER *xfer);
+static void sensors_light_done(I2C_XFER *xfer);
+static void led_array_done(I2C_XFER *xfer);
+
+static uint8_t light_reg = LIGHT_REG_DATA_LSB;
+static uint8_t light_buf[2];
+static uint8_t acc_reg = ACC_REG_XOUT8;
+static uint8_t acc_buf[3];
+static I2C_XFER light_xfer = {LIGHT_I2C_ADDR, &light_reg, 1, light_buf, 2, sensors_light_done, I2C_XFER_IDLE};
+static I2C_XFER acc_xfer = {ACC_I2C_ADDR, &acc_reg, 1, acc_buf, 3, sensors_acc_done, I2C_XFER_IDLE};
+static TASK_FN sensors_then = NULL;
+static uint32_t sensors_gen = 0;
+static volatile bool sensors_acc = true;			//accelerometer is part of the current read
+
+static uint8_t led_array_buf[5];
+static I2C_XFER led_array_xfer = {PCA9532_I2C_ADDR, led_array_buf, 5, NULL, 0, led_array_done, I2C_XFER_IDLE};
+static volatile uint16_t led_array_want = 0;
+static uint16_t led_array_sent = 0;
+static bool led_array_valid = false;
+
+#ifdef ACC_MOTION_MODE
+static bool acc_awake(void);
+static void acc_motion_sample(void);
+#endif
+
+//Runs in the main loop once both sensors have been read
+static void sensors_complete(void){
+	if (sensors_gen != sched_gen){
+		return;										//mode changed while reading
+	}
+	if (light_xfer.status == I2C_XFER_OK){
+		light = (LIGHT_RANGE_K * (uint32_t)(light_buf[0] | (light_buf[1] << 8))) >> 16;
+	}
+	if (sensors_acc && (acc_xfer.status == I2C_XFER_OK)){
+		x = (int8_t)acc_buf[0] + xoff;
+		y = (int8_t)acc_buf[1] + yoff;
+		z = (int8_t)acc_buf[2] + zoff;
+#ifdef ACC_MOTION_MODE
+		acc_motion_sample();
+#endif
+	}
+	TRACE_SENSORS();
+	BOOT_MARK(BOOT_MARK_READING);
+	if (sensors_then){
+		sensors_then();
+	}
+}
+
+//Accelerometer is queued after the light sensor so it finishes last
+static void sensors_acc_done(I2C_XFER *xfer){
+	sched_post(sensors_complete);
+}
+
+static void sensors_light_done(I2C_XFER *xfer){
+	if (!sensors_acc){
+		sched_post(sensors_complete);
+	}
+}
+
+//Start reading light sensor and accelerometer in the background
+//then() runs from the main loop with the new values, unless the mode changes first
+//If the I2C2 queue is full then() still runs, with the last values of what could not be queued
+void Sensors_Read(TASK_FN then){
+	uint32_t primask;
+	bool light_done;
+
+	sensors_then = then;
+	sensors_gen = sched_gen;
+
+	if ((light_xfer.status == I2C_XFER_PENDING) || (acc_xfer.status == I2C_XFER_PENDING)){
+		return;										//already reading, then() runs when it is done
+	}
+#ifdef ACC_MOTION_MODE
+	sensors_acc = acc_awake();						//still board keeps the last x, y, z
+#else
+	sensors_acc = true;
+#endif
+	if (!i2c_submit(&light_xfer)){
+		sched_post(sensors_complete);
+		return;
+	}
+	if (sensors_acc && !i2c_submit(&acc_xfer)){
+		//Light read finishes alone, post here if its done callback already missed sensors_acc
+		primask = __get_PRIMASK();
+		__disable_irq();
+		sensors_acc = false;
+		light_done = (light_xfer.status != I2C_XFER_PENDING);
+		__set_PRIMASK(primask);
+		if (light_done){
+			sched_post(sensors_complete);
+		}
+	}
+}
+
+static void led_array_start(void){
+	uint16_t state = led_array_want;
+	int i, j;
+
+	led_array_buf[0] = PCA9532_LS0_AUTO_INC;
+	for (i = 0; i < 4; i++){
+		led_array_buf[i + 1] = 0;
+		for (j = 0; j < 4; j++){
+			if (state & (1 << (i*4 + j))){
+				led_array_buf[i + 1] |= PCA9532_LED_ON << (j*2);
+			}
+		}
+	}
+	led_array_sent = state;
+	i2c_submit(&led_array_xfer);
+}
+
+//Send the newest state if it changed while the previous write was on the bus
+static void led_array_done(I2C_XFER *xfer){
+	if (led_array_want != led_array_sent){
+		led_array_start();
+	}
+}
+
+//Set LED array without waiting for the I2C write, bit n = LED n+4
+void led_array_write(uint16_t ledOn){
+	if (led_array_valid && (ledOn == led_array_want)){
+		led_array_stats.suppressed++;
+		return;
+	}
+	led_array_valid = true;
+	led_array_stats.writes++;
+	led_array_want = ledOn;
+	if (led_array_xfer.status != I2C_XFER_PENDING){
+		led_array_start();
+	}
+}
+
+#ifdef LIGHT_IRQ_MODE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Light sensor threshold interrupt
+// The ISL29003 compares the top byte of every reading with INT_LT/INT_HT
+// and latches its INT line (P2.5) low once LIGHT_IRQ_PERSIST readings in a
+// row fall outside the window. The window is set to what is still left to
+// detect in PASSIVE mode:
+//   nothing yet      below WARNING_UPPER (algae, or waste if below WARNING_LOWER)
+//   algae            below WARNING_LOWER (waste)
+//   waste            above WARNING_LOWER (algae, if also below WARNING_UPPER)
+//   both, or not in PASSIVE mode, the full range (never fires)
+// EINT3_IRQHandler queues a read of the reading, its done callback raises
+// the flags with check_Waste/check_Algae and writes the next window, which
+// also clears the sensor's interrupt flag and releases INT.
+// Thresholds are 1/256 of full scale, about 4 lux steps at LIGHT_RANGE_1000.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define LIGHT_REG_CONTROL		0x01				//then INT_HT and INT_LT, auto increment
+#define LIGHT_CTRL_PERSIST_1	0x00				//INT after 1 integration cycle outside the window, range 1000
+#define LIGHT_IRQ_PERSIST		LIGHT_CTRL_PERSIST_1
+#define LIGHT_TH_OFF			0xFF00				//INT_HT << 8 | INT_LT, whole range
+
+int check_Waste(int light);
+int check_Algae(int light);
+static void light_th_done(I2C_XFER *xfer);
+static void light_irq_done(I2C_XFER *xfer);
+
+static bool light_irq_on = false;					//PASSIVE mode is watching for detections
+static volatile uint16_t light_th_want = LIGHT_TH_OFF;
+static uint16_t light_th_sent = LIGHT_TH_OFF;
+static uint8_t light_th_buf[4];
+static uint8_t light_irq_buf[2];
+static I2C_XFER light_th_xfer = {LIGHT_I2C_ADDR, light_th_buf, 4, NULL, 0, light_th_done, I2C_XFER_IDLE};
+static I2C_XFER light_irq_xfer = {LIGHT_I2C_ADDR, &light_reg, 1, light_irq_buf, 2, light_irq_done, I2C_XFER_IDLE};
+
+uint32_t light_irq_count = 0;						//sensor interrupts serviced
+
+//Threshold register value for lux, rounded down and clamped to full scale
+static uint8_t light_th(uint32_t lux){
+	uint32_t th = (lux << 8) / LIGHT_RANGE_K;
+
+	return (th > 0xFF) ? 0xFF : th;
+}
+
+//Write the window and clear the sensor's interrupt flag
+static void light_th_start(void){
+	uint16_t th = light_th_want;
+
+	light_th_buf[0] = LIGHT_REG_CONTROL;
+	light_th_buf[1] = LIGHT_IRQ_PERSIST;
+	light_th_buf[2] = th >> 8;
+	light_th_buf[3] = th & 0xFF;
+	light_th_sent = th;
+	i2c_submit(&light_th_xfer);
+}
+
+//Send the newest window if it changed while the previous write was on the bus
+static void light_th_done(I2C_XFER *xfer){
+	if (light_th_want != light_th_sent){
+		light_th_start();
+	}
+}
+
+//Window for the detections still to come, always rewritten to clear INT
+static void light_irq_arm(void){
+	uint16_t th = LIGHT_TH_OFF;
+
+	if (light_irq_on && !Algae_Flag && !Waste_Flag){
+		th = (0xFF << 8) | light_th(WARNING_UPPER);
+	}
+	else if (light_irq_on && !Waste_Flag){
+		th = (0xFF << 8) | light_th(WARNING_LOWER);
+	}
+	else if (light_irq_on && !Algae_Flag){
+		th = light_th(WARNING_LOWER) << 8;
+	}
+	light_th_want = th;
+	if (light_th_xfer.status != I2C_XFER_PENDING){
+		light_th_start();
+	}
+}
+
+static void light_irq_done(I2C_XFER *xfer){
+	if (xfer->status == I2C_XFER_OK){
+		light = (LIGHT_RANGE_K * (uint32_t)(light_irq_buf[0] | (light_irq_buf[1] << 8))) >> 16;
+		if (light_irq_on){
+			check_Waste(light);
+			check_Algae(light);
+		}
+	}
+	light_irq_arm();
+}
 
-	TIM_Cmd(LPC_TIM0, ENABLE);
-	TIM_ResetCounter(LPC_TIM0);
+static void light_irq_edge(void){
+	light_irq_count++;
+	i2c_submit(&light_irq_xfer);					//still pending means INT is not cleared yet either
+}
 
+//Watch for algae and waste from now on, flags must be cleared first
+void light_irq_enable(bool enable){
+	light_irq_on = enable;
+	light_irq_arm();
 }
+#endif
 
+#ifdef ACC_MOTION_MODE
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Interrupt Handlers
+// Accelerometer motion wakeup
+// While the board is still the MMA7455 sits in level detection mode and
+// Sensors_Read() leaves it out, x, y and z keep their last values. X or Y
+// beyond ACC_MOTION_MG raises INT1 (P0.3); EINT3_IRQHandler switches the
+// chip to measurement mode and every sensor read includes it again.
+// Once ACC_STILL_READS reads in a row move less than ACC_MOTION_MG the
+// chip goes back to level detection. Z is left out of detection, it always
+// sees 1g lying flat. Level detection compares the raw X and Y with the
+// threshold, not the calibrated ones, so a board resting tilted past it
+// stays in measurement mode rather than tripping INT1 as soon as it sleeps.
+// Mode changes are queued on the I2C2 engine and also pulse INTRST, which
+// clears a latched detection.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void EINT3_IRQHandler(void){
-	if ((LPC_GPIOINT->IO2IntStatF>>10)& 0x1){		// Determine whether SW3 is pressed n falling edge
-		if(Date_Flag){								//Trigger only in DATE Mode
-			SW3 = true;
-			// Clear GPIO Interrupt P2.10
-			LPC_GPIOINT->IO2IntClr = 1<<10;
-		}
-		else{
-			// Clear GPIO Interrupt P2.10
-			LPC_GPIOINT->IO2IntClr = 1<<10;
-		}
+#define ACC_REG_MCTL			0x16				//then INTRST, CTL1, CTL2, LDTH, auto increment
+#define ACC_REG_INTRST			0x17
+#define ACC_MCTL_MEASURE		0x05				//2g, measurement
+#define ACC_MCTL_LEVEL			0x06				//2g, level detection
+#define ACC_INTRST_CLR			0x03				//clear INT1 and INT2
+#define ACC_CTL1_NO_Z			0x20				//absolute threshold, INT1 = level detection, Z disabled
+#define ACC_LDTH				((ACC_MOTION_MG * 16) / 1000)	//level threshold is 8g scale, 16 counts per g
+#define ACC_MOTION_COUNTS		((ACC_MOTION_MG * 64) / 1000)	//x, y, z are 2g scale, 64 counts per g
+#define ACC_STILL_READS			2
+
+static uint8_t acc_sleep_buf[6] = {ACC_REG_MCTL, ACC_MCTL_LEVEL, ACC_INTRST_CLR, ACC_CTL1_NO_Z, 0x00, ACC_LDTH};
+static uint8_t acc_wake_buf[3] = {ACC_REG_MCTL, ACC_MCTL_MEASURE, ACC_INTRST_CLR};
+static uint8_t acc_intrst_buf[2] = {ACC_REG_INTRST, 0x00};
+static I2C_XFER acc_sleep_xfer = {ACC_I2C_ADDR, acc_sleep_buf, 6, NULL, 0, NULL, I2C_XFER_IDLE};
+static I2C_XFER acc_wake_xfer = {ACC_I2C_ADDR, acc_wake_buf, 3, NULL, 0, NULL, I2C_XFER_IDLE};
+static I2C_XFER acc_intrst_xfer = {ACC_I2C_ADDR, acc_intrst_buf, 2, NULL, 0, NULL, I2C_XFER_IDLE};
+
+static volatile bool acc_moving = true;				//start awake until the first still reads
+static uint8_t acc_still = 0;
+static int8_t acc_last[3];
+
+uint32_t acc_wakeups = 0;							//motion interrupts that woke the accelerometer
+uint32_t acc_reads_skipped = 0;						//sensor reads that left the accelerometer out
+
+static bool acc_awake(void){
+	if (!acc_moving){
+		acc_reads_skipped++;
 	}
+	return acc_moving;
+}
 
-	//Obtain Temperature
-	if ((LPC_GPIOINT->IO0IntStatR>>2)& 0x1){						// Determine whether P0.2 (Temperature sensor GPIO) is at rising edge
-		//Continue to add period counter if periods sampled < 151
-		if(temp_period_count < 151){								// (temp_period_count < ((NUM_HALF_PERIODS / 2) + 1);
-			temp_period_count++;
-		}
-		else{
-			//Get time interval for 151 periods
-			temp_time_period = getusTicks() - old_temp_ticks;
-			old_temp_ticks = getusTicks();
-			temp_period_count = 0;								//reset period counter
+static void acc_sleep(void){
+	acc_moving = false;
+	i2c_submit(&acc_sleep_xfer);
+	i2c_submit(&acc_intrst_xfer);
+}
 
-			//calculate temperature using formula
-			temperature = ((((2*100*temp_time_period) / (NUM_HALF_PERIODS*TEMP_SCALAR_DIV10)) - 2731) / 10.0);
-		}
-		// Clear GPIO Interrupt P0.2
-		LPC_GPIOINT->IO0IntClr = 1<<2;
+static void acc_motion_edge(void){
+	if (!acc_moving){
+		acc_wakeups++;
+		acc_moving = true;
+		acc_still = 0;
+		i2c_submit(&acc_wake_xfer);
+		i2c_submit(&acc_intrst_xfer);
 	}
 }
 
-//Count instances of 100us using interrupt handlers and usTicks
-void TIMER0_IRQHandler(void)
-{
-		usTicks++;
-		LPC_TIM0->IR|=0x01;			//Clear Timer0 Interrupt by writing '1' to Interrupt Register
-}
+//New reading in acc_buf, go back to sleep after ACC_STILL_READS quiet ones
+static void acc_motion_sample(void){
+	int i;
+	bool moved = false;
+	bool tilted = false;								//level detection would wake it straight back up
 
-// When user keys in a character, UART receives it
-// [W,A,S,D] = [UP,LEFT,DOWN,RIGHT]
-// [SPACEBAR] = EXIT
-void UART3_IRQHandler(void) {
-	uint8_t data;
-	//Receive one letter
-	UART_Receive(LPC_UART3, &data, 1, BLOCKING);
+	for (i = 0; i < 3; i++){
+		int d = (int8_t)acc_buf[i] - acc_last[i];
 
-	// Decode letter to up, down, left, right & EXIT
-	if(data == 'w'){
-		uartUp = true;
+		if ((d >= ACC_MOTION_COUNTS) || (d <= -ACC_MOTION_COUNTS)){
+			moved = true;
+		}
+		if ((i < 2) && (((int8_t)acc_buf[i] >= ACC_MOTION_COUNTS) || ((int8_t)acc_buf[i] <= -ACC_MOTION_COUNTS))){
+			tilted = true;
+		}
+		acc_last[i] = (int8_t)acc_buf[i];
 	}
-	if(data == 's'){
-		uartDown = true;
+	acc_still = (moved || tilted) ? 0 : acc_still + 1;
+	if (acc_still >= ACC_STILL_READS){
+		acc_sleep();
 	}
-	if(data == 'd'){
-		uartRight = true;
+}
+#endif
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Biofuel layout
+// Biofuels not yet harvested are set bits in biofuel_map, one bit per OLED
+// pixel (row major, 32 pixels per word, 768 bytes). A cursor move tests and
+// clears a single bit, so the cost does not grow with the number of targets.
+// biofuel_layout_load() fills the map from the layout picked by
+// BIOFUEL_LAYOUT when CHARGE mode starts.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define BIOFUEL_ROW_WORDS		((OLED_DISPLAY_WIDTH + 31) / 32)
+
+typedef struct {
+	uint8_t x;
+	uint8_t y;
+} BIOFUEL_POS;
+
+#if BIOFUEL_LAYOUT == BIOFUEL_LAYOUT_GRID
+static const BIOFUEL_POS biofuel_grid[] = {
+	{X1, Y1}, {X1, Y2}, {X1, Y3}, {X1, Y4},
+	{X2, Y1}, {X2, Y2}, {X2, Y3}, {X2, Y4},
+	{X3, Y1}, {X3, Y2}, {X3, Y3}, {X3, Y4},
+	{X4, Y1}, {X4, Y2}, {X4, Y3}, {X4, Y4},
+};
+#endif
+
+static uint32_t biofuel_map[OLED_DISPLAY_HEIGHT][BIOFUEL_ROW_WORDS];
+static int biofuel_count = 0;						//distinct targets in the layout
+
+static void biofuel_add(uint8_t x, uint8_t y){
+	uint32_t bit = 1u << (x & 31);
+
+	if ((x < OLED_DISPLAY_WIDTH) && (y < OLED_DISPLAY_HEIGHT) && !(biofuel_map[y][x >> 5] & bit)){
+		biofuel_map[y][x >> 5] |= bit;
+		biofuel_count++;
 	}
-	if(data == 'a')	{
-		uartLeft = true;
+}
+
+//Fill biofuel_map with the configured layout, all targets unharvested
+static void biofuel_layout_load(void){
+	int i;
+
+	memset(biofuel_map, 0, sizeof(biofuel_map));
+	biofuel_count = 0;
+
+#if BIOFUEL_LAYOUT == BIOFUEL_LAYOUT_GRID
+	for (i = 0; i < sizeof(biofuel_grid) / sizeof(biofuel_grid[0]); i++){
+		biofuel_add(biofuel_grid[i].x, biofuel_grid[i].y);
 	}
-	//if SPACEBAR key is pressed, exit CHARGE Mode
-	if(data == ' '){
-		EXIT = true;
+#else
+	//xorshift32, same spots on every run, clear of the screen edges
+	uint32_t r = BIOFUEL_SCATTER_SEED;
+
+	for (i = 0; i < BIOFUEL_SCATTER_COUNT; i++){
+		r ^= r << 13;
+		r ^= r >> 17;
+		r ^= r << 5;
+		biofuel_add(2 + (r & 0xFFFF) % (OLED_DISPLAY_WIDTH - 4), 2 + (r >> 16) % (OLED_DISPLAY_HEIGHT - 4));
 	}
+#endif
+}
 
-	//Triggers draw line on OLED function
-	uartGet = true;
-	//Clear Pending to complete RX request
-	NVIC_ClearPendingIRQ(UART3_IRQn);
+//Harvest the biofuel at x,y if there is one left, returns true if harvested
+static bool check_filled(uint8_t x, uint8_t y){
+	uint32_t *word = &biofuel_map[y][x >> 5];
+	uint32_t bit = 1u << (x & 31);
+
+	if (*word & bit){
+		*word &= ~bit;
+		harvested++;
+		return true;
+	}
+	return false;
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -251,7 +2552,7 @@ static void Decrease_LED_array(uint8_t steps){
 
 	ledOn = 0xffff >> steps;
 
-	pca9532_setLeds(ledOn, 0xffff);
+	led_array_write(ledOn);
 }
 
 //Turn on LED Array from LED4 to LED19
@@ -260,30 +2561,13 @@ static void Increase_LED_array(uint8_t harvested){
 
 	ledOn = 0xffff << harvested;
 
-	pca9532_setLeds((~ledOn), 0xffff);
-}
-
-void Sensors_Read(){
-
-	light = light_read();
-	acc_read(&x, &y, &z);
-	x = x+xoff;
-	y = y+yoff;
-	z = z+zoff;
+	led_array_write((uint16_t)(~ledOn));
 }
 
 //Blink correct combination of LED according to the detected scenario
 void blink_LED_PASSIVE(int detected){
-	int Red_port = 2;
-	int Red_pin = 0;
-	int Red_state;
-
-	int Blue_port = 0;
-	int Blue_pin = 26;
-	int Blue_state;
-
-	Red_state = GPIO_ReadValue(Red_port);
-	Blue_state = GPIO_ReadValue(Blue_port);
+	bool red = rgb_red;
+	bool blue = rgb_blue;
 
 	if(detected == 0){
 		//Blink none
@@ -291,182 +2575,404 @@ void blink_LED_PASSIVE(int detected){
 	}
 	else if(detected == 1){
 		//Blink Blue
-		GPIO_ClearValue(Blue_port,(Blue_state & (1 << Blue_pin)));
-		GPIO_SetValue(Blue_port,((~Blue_state) & (1 << Blue_pin)));
+		blue = !blue;
 	}
 	else if(detected == 2){
 		//Blink Red
-		GPIO_ClearValue(Red_port,(Red_state & (1 << Red_pin)));
-		GPIO_SetValue(Red_port,((~Red_state) & (1 << Red_pin)));
+		red = !red;
 	}
 	else if(detected == 3){
 		//Check if Red and Blue LED are in opposite states
-		if(((Red_state >> Red_pin) & 1) != ((Blue_state >> Blue_pin) & 1)){
+		if(red != blue){
 			//Toggle only the Blue LED once to synchronize
-			GPIO_ClearValue(Blue_port,(Blue_state & (1 << Blue_pin)));
-			GPIO_SetValue(Blue_port,((~Blue_state) & (1 << Blue_pin)));
+			blue = !blue;
 		}
 		else{
 			//Blink both Red and Blue LED
-			GPIO_ClearValue(Blue_port,(Blue_state & (1 << Blue_pin)));
-			GPIO_SetValue(Blue_port,((~Blue_state) & (1 << Blue_pin)));
-			GPIO_ClearValue(Red_port,(Red_state & (1 << Red_pin)));
-			GPIO_SetValue(Red_port,((~Red_state) & (1 << Red_pin)));
+			blue = !blue;
+			red = !red;
+		}
+	}
+	rgb_write(red, blue);
+}
+
+static uint8_t cursor_x = 48;						//CHARGE mode cursor, kept between visits
+static uint8_t cursor_y = 32;
+
+//Joystick cursor motion: holding a direction accelerates the cursor from
+//CURSOR_SPEED_MIN to CURSOR_SPEED_MAX, speeds are in 1/256 pixel per
+//JOYSTICK_TIME_UNIT poll and the fraction left over carries to the next poll
+#define CURSOR_FRAC_BITS		8
+#define CURSOR_ONE				(1 << CURSOR_FRAC_BITS)
+#define CURSOR_SPEED_MIN		(CURSOR_ONE / 2)	//25 px/s
+#define CURSOR_SPEED_MAX		(CURSOR_ONE * 3)	//150 px/s
+#define CURSOR_ACCEL			16					//per poll, top speed after 0.8s held
+
+static uint8_t cursor_dir = 0;						//joystick direction being held
+static uint16_t cursor_speed = 0;
+static uint16_t cursor_frac = 0;					//sub-pixel distance not yet drawn
+
+//Leave a trail at the cursor and harvest what it lands on
+static void cursor_plot(void){
+	fb_putPixel(cursor_x, cursor_y, OLED_COLOR_WHITE);
+	if (check_filled(cursor_x, cursor_y)){					//check for harvests
+		Increase_LED_array((harvested * 16) / biofuel_count);	//LED array shows share of biofuels harvested
+	}
+}
+
+//Move the cursor to x,y (clamped to the display) along a Bresenham line,
+//plotting and harvesting every pixel on the way
+//Returns true if it moved, caller flushes the framebuffer
+static bool cursor_line_to(int x, int y){
+	int dx, dy, sx, sy, err, e2;
+
+	x = (x < 0) ? 0 : (x > OLED_DISPLAY_WIDTH-1) ? OLED_DISPLAY_WIDTH-1 : x;
+	y = (y < 0) ? 0 : (y > OLED_DISPLAY_HEIGHT-1) ? OLED_DISPLAY_HEIGHT-1 : y;
+	if ((x == cursor_x) && (y == cursor_y)){
+		return false;
+	}
+
+	dx = (x > cursor_x) ? x - cursor_x : cursor_x - x;
+	dy = (y > cursor_y) ? cursor_y - y : y - cursor_y;		//negative
+	sx = (x > cursor_x) ? 1 : -1;
+	sy = (y > cursor_y) ? 1 : -1;
+	err = dx + dy;
+	while ((cursor_x != x) || (cursor_y != y)){
+		e2 = 2 * err;
+		if (e2 >= dy){
+			err += dy;
+			cursor_x += sx;
 		}
+		if (e2 <= dx){
+			err += dx;
+			cursor_y += sy;
+		}
+		cursor_plot();
 	}
+	return true;
 }
 
-//Draws line on OLED using the Joystick or keyboard via UART
-static void drawOled(uint8_t joyState, int arr[16])
+//Draws line on OLED using the Joystick, called every JOYSTICK_TIME_UNIT
+static void drawOled(uint8_t joyState)
 {
-    static int wait = 0;
-    static uint8_t currX = 48;
-    static uint8_t currY = 32;
-    static uint8_t lastX = 0;
-    static uint8_t lastY = 0;
+    uint8_t dir = joyState & (JOYSTICK_UP | JOYSTICK_DOWN | JOYSTICK_LEFT | JOYSTICK_RIGHT);
+    int dx = 0;
+    int dy = 0;
+    int n;
 
     if ((joyState & JOYSTICK_CENTER) != 0) {
-    	//Joystick pressed, Exiting CHARGE();
+    	//Joystick pressed, Exiting CHARGE mode
         EXIT = true;
         return;
     }
 
-    if (wait++ < 3){
+    if (dir != cursor_dir) {
+        //New direction, start slow but move a pixel straight away
+        cursor_dir = dir;
+        cursor_speed = CURSOR_SPEED_MIN;
+        cursor_frac = CURSOR_ONE - CURSOR_SPEED_MIN;
+    }
+    else if ((dir != 0) && (cursor_speed < CURSOR_SPEED_MAX)) {
+        cursor_speed += CURSOR_ACCEL;
+    }
+    if (dir == 0) {
         return;
     }
 
-    wait = 0;
+    cursor_frac += cursor_speed;
+    n = cursor_frac >> CURSOR_FRAC_BITS;
+    cursor_frac &= CURSOR_ONE - 1;
 
-    if (((joyState  & JOYSTICK_UP) != 0 && currY > 0) || ((uartUp) && currY > 0))  {
-        currY--;
-        uartUp = false;
+    if ((joyState & JOYSTICK_UP) != 0) {
+        dy -= n;
     }
-
-    if (((joyState & JOYSTICK_DOWN) != 0 && currY < OLED_DISPLAY_HEIGHT-1) || ((uartDown) && currY < OLED_DISPLAY_HEIGHT-1)) {
-        currY++;
-        uartDown = false;
+    if ((joyState & JOYSTICK_DOWN) != 0) {
+        dy += n;
     }
-
-    if (((joyState & JOYSTICK_RIGHT) != 0 && currX < OLED_DISPLAY_WIDTH-1) || ((uartRight) && currX < OLED_DISPLAY_WIDTH-1)){
-        currX++;
-        uartRight = false;
+    if ((joyState & JOYSTICK_RIGHT) != 0) {
+        dx += n;
     }
-
-    if (((joyState & JOYSTICK_LEFT) != 0 && currX > 0) || ((uartLeft) && currX > 0)) {
-        currX--;
-        uartLeft = false;
+    if ((joyState & JOYSTICK_LEFT) != 0) {
+        dx -= n;
     }
 
-    if (lastX != currX || lastY != currY) {
-        oled_putPixel(currX, currY, OLED_COLOR_WHITE);
-        check_filled(currX, currY, arr);					//check for harvests
-        Increase_LED_array(harvested);						//update LED array with number of harvests
-        lastX = currX;
-        lastY = currY;
+    if (cursor_line_to(cursor_x + dx, cursor_y + dy)) {
+        fb_flush();
     }
-    uartGet = false;
 }
 
+//Keyboard commands from SAFE in CHARGE mode, an optional repeat count then a key
+// [W,A,S,D] = [UP,LEFT,DOWN,RIGHT], eg. "10d" moves 10 pixels right
+// [SPACEBAR] = EXIT
+#define UART_CMD_REPEAT_MAX		OLED_DISPLAY_WIDTH
+
+static uint32_t uart_cmd_repeat = 0;				//digits typed so far, kept until the key arrives
+
+//Run every queued keyboard command in order
+static void charge_uart_input(void){
+	uint8_t c;
+	uint32_t n;
+	int dx, dy;
+	bool moved = false;
+
+	while (uart_rx_read(&c)){
+		TRACE_KEY(c);
+		if ((c >= '0') && (c <= '9')){
+			uart_cmd_repeat = uart_cmd_repeat*10 + (c - '0');
+			if (uart_cmd_repeat > UART_CMD_REPEAT_MAX){
+				uart_cmd_repeat = UART_CMD_REPEAT_MAX;
+			}
+			continue;
+		}
+
+		n = (uart_cmd_repeat != 0) ? uart_cmd_repeat : 1;
+		uart_cmd_repeat = 0;
+		dx = 0;
+		dy = 0;
+		switch (c){
+		case 'w':	dy = -1;	break;
+		case 's':	dy = 1;		break;
+		case 'd':	dx = 1;		break;
+		case 'a':	dx = -1;	break;
+		case ' ':	EXIT = true;	break;		//if SPACEBAR key is pressed, exit CHARGE Mode
+		default:	break;						//anything else is ignored
+		}
+		if ((dx != 0 || dy != 0) && cursor_line_to(cursor_x + dx*(int)n, cursor_y + dy*(int)n)){
+			moved = true;
+		}
+	}
+
+	if (moved){
+		fb_flush();
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Text formatting
+// Integer only stand-ins for the sprintf calls on the display and telemetry
+// paths, so the default build does not link newlib's printf (the BENCH,
+// ISR_PROFILE, FLASH_LOG and BOOT_PROFILE reports still use it). Each one
+// appends to p, NUL terminates and returns the new end so fields chain:
+//   p = fmt_str(buf, "AX"); p = fmt_int(p, ax, 0, ' ');
+// width is a minimum, like "%3d" with pad ' ' or "%03d" with pad '0'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define FMT_DIGITS_MAX			10					//4294967295
+
+static char *fmt_str(char *p, const char *s){
+	while (*s){
+		*p++ = *s++;
+	}
+	*p = '\0';
+	return p;
+}
+
+//Digits of mag with a leading '-' if neg, padded on the left to width
+static char *fmt_num(char *p, uint32_t mag, bool neg, int width, char pad){
+	char digits[FMT_DIGITS_MAX];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + (mag % 10);
+		mag /= 10;
+	} while (mag != 0);
+
+	if (neg){
+		width--;
+		if (pad == '0'){
+			*p++ = '-';						//"-007" as "%04d"
+		}
+	}
+	while (width-- > n){
+		*p++ = pad;
+	}
+	if (neg && (pad != '0')){
+		*p++ = '-';							//"  -7" as "%4d"
+	}
+	while (n > 0){
+		*p++ = digits[--n];
+	}
+	*p = '\0';
+	return p;
+}
+
+static char *fmt_uint(char *p, uint32_t value, int width, char pad){
+	return fmt_num(p, value, false, width, pad);
+}
+
+static char *fmt_int(char *p, int32_t value, int width, char pad){
+	return fmt_num(p, (value < 0) ? 0u - (uint32_t)value : (uint32_t)value, value < 0, width, pad);
+}
+
+//Fixed point value held in 10^decimals units (eg. temperature in 0.1) as "-12.3"
+static char *fmt_fixed(char *p, int32_t value, int decimals){
+	uint32_t mag = (value < 0) ? 0u - (uint32_t)value : (uint32_t)value;
+	uint32_t scale = 1;
+	int i;
+
+	for (i = 0; i < decimals; i++){
+		scale *= 10;
+	}
+	p = fmt_num(p, mag / scale, value < 0, 0, ' ');
+	if (decimals > 0){
+		*p++ = '.';
+		p = fmt_uint(p, mag % scale, decimals, '0');
+	}
+	return p;
+}
+
+#ifdef STACK_WATERMARK
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stack watermark
+// ResetISR fills the RAM from the end of .bss up to the stack pointer with
+// STACK_PAINT before main() runs. The stack grows down from _vStackTop and
+// nothing uses the heap, so the lowest word that no longer holds the
+// pattern is the deepest the stack has been, nested interrupts included.
+// STACK_REPORT_KEY on UART3 prints it, ./ram.sh reports what each function
+// and the static data take.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define STACK_PAINT				0xA5A5A5A5UL	//same as in cr_startup_lpc17.c
+
+#ifdef HOST_SIM
+//sim/host_sim.c paints this and dirties it as deep as the host stack goes
+#define STACK_SIM_BYTES			8192
+extern unsigned long sim_stack[STACK_SIM_BYTES / sizeof(unsigned long)];
+#define STACK_BOTTOM			(&sim_stack[0])
+#define STACK_TOP				(&sim_stack[STACK_SIM_BYTES / sizeof(unsigned long)])
+#else
+extern unsigned long _ebss;
+extern unsigned long _vStackTop;
+#define STACK_BOTTOM			(&_ebss)
+#define STACK_TOP				(&_vStackTop)
+#endif
+
+//Bytes at the bottom of the stack never written since reset
+static uint32_t stack_free(void){
+	const unsigned long *p = STACK_BOTTOM;
+
+	while ((p < STACK_TOP) && (*p == STACK_PAINT)){
+		p++;
+	}
+	return (p - STACK_BOTTOM) * sizeof(unsigned long);
+}
+
+//Posted by UART3_IRQHandler on the report key
+static void stack_report(void){
+	char line[64];
+	uint32_t size = (STACK_TOP - STACK_BOTTOM) * sizeof(unsigned long);
+	uint32_t unused = stack_free();
+	char *p;
+
+	p = fmt_uint(fmt_str(line, "stack size="), size, 0, ' ');
+	p = fmt_uint(fmt_str(p, " used="), size - unused, 0, ' ');
+	p = fmt_uint(fmt_str(p, " free="), unused, 0, ' ');
+	fmt_str(p, "\r\n");
+	uart_tx_print(line);
+}
+#endif
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // OLED-related Functions
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 void OLED_Update(){
 
-	sprintf(text,"%.2f        ", temperature);
-	oled_putString(37, 10, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"%d          ", light);
-	oled_putString(37, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"%d          ", x);
-	oled_putString(37, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"%d          ", y);
-	oled_putString(37, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"%d          ", z);
-	oled_putString(37, 50, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	char *line = (char *)text;
+
+	fmt_str(fmt_fixed(line, temperature, 1), "          ");	//0.1 deg C resolution, as sent to SAFE
+	fb_putString(37, 10, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str(fmt_uint(line, light, 0, ' '), "          ");
+	fb_putString(37, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str(fmt_int(line, x, 0, ' '), "          ");
+	fb_putString(37, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str(fmt_int(line, y, 0, ' '), "          ");
+	fb_putString(37, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str(fmt_int(line, z, 0, ' '), "          ");
+	fb_putString(37, 50, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fb_flush();
 }
 
 void OLED_Update_PASSIVE(){
 
-	sprintf(text, "				PASSIVE		");
-	oled_putString(1, 00, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"Temp:         ");
-	oled_putString(1, 10, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"LUX :         ");
-	oled_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"AX  :         ");
-	oled_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"AY  :         ");
-	oled_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"AZ  :         ");
-	oled_putString(1, 50, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "				PASSIVE		");
+	fb_putString(1, 00, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "Temp:         ");
+	fb_putString(1, 10, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "LUX :         ");
+	fb_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "AX  :         ");
+	fb_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "AY  :         ");
+	fb_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "AZ  :         ");
+	fb_putString(1, 50, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fb_flush();
 }
 
 void OLED_Update_DATE(){
 
-	sprintf(text, "					DATE		");
-	oled_putString(1, 00, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"Temp: DATE MODE        ");
-	oled_putString(1, 10, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"LUX : DATE MODE        ");
-	oled_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"AX  : DATE MODE        ");
-	oled_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"AY  : DATE MODE        ");
-	oled_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	sprintf(text,"AZ  : DATE MODE        ");
-	oled_putString(1, 50, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "					DATE		");
+	fb_putString(1, 00, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "Temp: DATE MODE        ");
+	fb_putString(1, 10, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "LUX : DATE MODE        ");
+	fb_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "AX  : DATE MODE        ");
+	fb_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "AY  : DATE MODE        ");
+	fb_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "AZ  : DATE MODE        ");
+	fb_putString(1, 50, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fb_flush();
 }
 
 void OLED_Update_CHARGE(){
-	int initial_time_full = getTicks();
-
-	oled_clearScreen(OLED_COLOR_BLACK);
-	while(!((check_time(FULL_TIME_UNIT, &initial_time_full)))){
-		//Show msg on OLED for 2 seconds
-		sprintf(text, "Fully Charged");
-		oled_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-		sprintf(text,"Returning to");
-		oled_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-		sprintf(text,"PASSIVE MODE");
-		oled_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	}
-	oled_clearScreen(OLED_COLOR_BLACK);
+	fb_clearScreen(OLED_COLOR_BLACK);
+	fmt_str((char *)text, "Fully Charged");
+	fb_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "Returning to");
+	fb_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "PASSIVE MODE");
+	fb_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fb_flush();
+
+	//Show msg on OLED for 2 seconds, sleeping in between
+	sched_sleep(FULL_TIME_UNIT);
+	fb_clearScreen(OLED_COLOR_BLACK);
+	fb_flush();
 }
 
 void OLED_Update_EXIT(){
-	int initial_time_full = getTicks();
-
-	oled_clearScreen(OLED_COLOR_BLACK);
-	while(!((check_time(FULL_TIME_UNIT, &initial_time_full)))){
-		//Show msg on OLED for 2 seconds
-		sprintf(text, "Fail to Charged");
-		oled_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-		sprintf(text,"Returning to");
-		oled_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-		sprintf(text,"PASSIVE MODE");
-		oled_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
-	}
-	oled_clearScreen(OLED_COLOR_BLACK);
+	fb_clearScreen(OLED_COLOR_BLACK);
+	fmt_str((char *)text, "Fail to Charged");
+	fb_putString(1, 20, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "Returning to");
+	fb_putString(1, 30, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fmt_str((char *)text, "PASSIVE MODE");
+	fb_putString(1, 40, text, OLED_COLOR_WHITE, OLED_COLOR_BLACK);
+	fb_flush();
+
+	//Show msg on OLED for 2 seconds, sleeping in between
+	sched_sleep(FULL_TIME_UNIT);
+	fb_clearScreen(OLED_COLOR_BLACK);
+	fb_flush();
 }
 
-//Place 16 pixels as biofuels on OLED
+//Draw every biofuel still to be harvested
 void place_biofuel(){
-	oled_putPixel(X1, Y1,OLED_COLOR_WHITE);
-	oled_putPixel(X1, Y2,OLED_COLOR_WHITE);
-	oled_putPixel(X1, Y3,OLED_COLOR_WHITE);
-	oled_putPixel(X1, Y4,OLED_COLOR_WHITE);
-	oled_putPixel(X2, Y1,OLED_COLOR_WHITE);
-	oled_putPixel(X2, Y2,OLED_COLOR_WHITE);
-	oled_putPixel(X2, Y3,OLED_COLOR_WHITE);
-	oled_putPixel(X2, Y4,OLED_COLOR_WHITE);
-	oled_putPixel(X3, Y1,OLED_COLOR_WHITE);
-	oled_putPixel(X3, Y2,OLED_COLOR_WHITE);
-	oled_putPixel(X3, Y3,OLED_COLOR_WHITE);
-	oled_putPixel(X3, Y4,OLED_COLOR_WHITE);
-	oled_putPixel(X4, Y1,OLED_COLOR_WHITE);
-	oled_putPixel(X4, Y2,OLED_COLOR_WHITE);
-	oled_putPixel(X4, Y3,OLED_COLOR_WHITE);
-	oled_putPixel(X4, Y4,OLED_COLOR_WHITE);
+	uint32_t bits;
+	int x, y, w;
+
+	for (y = 0; y < OLED_DISPLAY_HEIGHT; y++){
+		for (w = 0; w < BIOFUEL_ROW_WORDS; w++){
+			bits = biofuel_map[y][w];
+			while (bits != 0){
+				x = w*32 + __builtin_ctz(bits);
+				fb_putPixel(x, y, OLED_COLOR_WHITE);
+				bits &= bits - 1;
+			}
+		}
+	}
+	fb_flush();
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -474,9 +2980,8 @@ void place_biofuel(){
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 //Call function when SW3 EINT is triggered
-void GET_INFORMATION(){
-	Sensors_Read();
-	OLED_Update();
+void GET_INFORMATION(TASK_FN then){
+	Sensors_Read(then);								//then() updates OLED once values are in
 	SW3 = false;
 }
 
@@ -523,250 +3028,987 @@ int detection_case(int check_Waste, int check_Algae){
 		return 0;
 }
 
-//Check for condition from steady mode to PASSIVE mode (first time start up)
-int MODE_TOGGLE_Start(){
-	//SW4 is default pulled HIGH, check for LOW when pushed
-	if (!((GPIO_ReadValue(1) >> 31) & 0x01)){
-		Start_Flag = true;
-		return 1;
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Binary telemetry frames
+// Frame on the wire: 0x00, COBS(payload + CRC16), 0x00
+// Sensor payload (little endian, 10 bytes):
+//   [0] TLM_FRAME_SENSOR  [1..2] seq  [3..4] temp in 0.1 deg C
+//   [5..6] light in lux   [7] x  [8] y  [9] z
+// Status payload (2 bytes): [0] TLM_FRAME_STATUS  [1] bit0 algae, bit1 waste
+// Trace payload: [0] TLM_FRAME_TRACE  [1..2] offset  [3..] up to
+//   TLM_TRACE_CHUNK bytes of the trace image, an empty one ends the dump
+// Batch payload (TELEMETRY_BATCH), up to TLM_BATCH_SAMPLES records with
+// consecutive seqs, each with the status bits sent just before it:
+//   [0] TLM_FRAME_BATCH  [1..2] seq of the first  [3] number of records
+//   [4..10] first record as in the sensor payload  [11] its status bits
+//   then for each further record the change from the one before as
+//   varints (see Varints): zigzag(temp) << 1 | 1 if the status changed,
+//   zigzag(light), zigzag(x), zigzag(y), zigzag(z), and the new status
+//   bits (1 byte) if they changed
+// CRC16 is CCITT (poly 0x1021, init 0xFFFF) over the payload
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define TLM_FRAME_SENSOR		0x01
+#define TLM_FRAME_STATUS		0x02
+#define TLM_FRAME_TRACE			0x03
+#define TLM_FRAME_BATCH			0x04
+#define TLM_TRACE_CHUNK			48
+#define TLM_SENSOR_LEN			10
+#define TLM_STATUS_LEN			2
+#define TLM_BATCH_HEADER		12
+#define TLM_BATCH_SAMPLES		8
+#define TLM_BATCH_MAX_AGE		60000				//ms a record may wait in a partial batch
+#define TLM_DELTA_MAX			(3 + 3 + 2 + 2 + 2 + 1)	//temp and light 17 bits, x, y, z 9 bits, status
+#define TLM_MAX_PAYLOAD			64
+#define TLM_WIRE(len)			((len) + 2 + 3)		//CRC, COBS code byte and both delimiters
+#define TLM_STATUS_ALGAE		0x01
+#define TLM_STATUS_WASTE		0x02
+
+static int telemetry_mode = TELEMETRY_MODE;
+
+static uint16_t crc16_ccitt(const uint8_t *data, uint32_t len){
+	uint16_t crc = 0xFFFF;
+	uint32_t i;
+	int bit;
+
+	for (i = 0; i < len; i++){
+		crc ^= (uint16_t)data[i] << 8;
+		for (bit = 0; bit < 8; bit++){
+			if (crc & 0x8000){
+				crc = (crc << 1) ^ 0x1021;
+			}
+			else{
+				crc <<= 1;
+			}
+		}
 	}
-	else
-		return 0;
+	return crc;
+}
+
+//COBS encode len (< 254) bytes of src into dst followed by the 0x00 delimiter
+//dst must hold len + 2 bytes, returns number of bytes written
+static uint32_t cobs_encode(const uint8_t *src, uint32_t len, uint8_t *dst){
+	uint32_t code_idx = 0;
+	uint32_t out = 1;
+	uint32_t i;
+	uint8_t code = 1;
+
+	for (i = 0; i < len; i++){
+		if (src[i] == 0){
+			dst[code_idx] = code;
+			code_idx = out++;
+			code = 1;
+		}
+		else{
+			dst[out++] = src[i];
+			code++;
+		}
+	}
+	dst[code_idx] = code;
+	dst[out++] = 0x00;
+	return out;
+}
+
+//Append CRC16 and COBS encode one frame into frame (TLM_MAX_PAYLOAD + 5 bytes)
+//Returns the frame length
+static uint32_t tlm_frame(uint8_t *payload, uint32_t len, uint8_t *frame){
+	uint16_t crc = crc16_ccitt(payload, len);
+
+	payload[len++] = crc & 0xFF;
+	payload[len++] = crc >> 8;
+
+	frame[0] = 0x00;						//leading delimiter resyncs decoder after any text msg
+	return cobs_encode(payload, len, &frame[1]) + 1;
+}
+
+//Queue one frame for SAFE in class cls
+static void tlm_send_frame(int cls, uint8_t *payload, uint32_t len){
+	uint8_t frame[TLM_MAX_PAYLOAD + 5];
+
+	tlm_queue(cls, frame, tlm_frame(payload, len, frame));
 }
 
-//Check for condition to change to DATE Mode
-void MODE_TOGGLE(int i){
+static void tlm_send_sensor(uint16_t seq, int16_t temp_deci, uint32_t lux, int8_t ax, int8_t ay, int8_t az){
+	uint8_t payload[TLM_SENSOR_LEN + 2];
 
-	if (next_SW4 == true && i != 16) {
-		SW4 = true;
-		next_SW4 = false;
+	if (lux > 0xFFFF){
+		lux = 0xFFFF;
 	}
+	payload[0] = TLM_FRAME_SENSOR;
+	payload[1] = seq & 0xFF;
+	payload[2] = seq >> 8;
+	payload[3] = (uint16_t)temp_deci & 0xFF;
+	payload[4] = (uint16_t)temp_deci >> 8;
+	payload[5] = lux & 0xFF;
+	payload[6] = lux >> 8;
+	payload[7] = (uint8_t)ax;
+	payload[8] = (uint8_t)ay;
+	payload[9] = (uint8_t)az;
+	tlm_send_frame(TLM_CLASS_SAMPLE, payload, TLM_SENSOR_LEN);
+}
 
-	if (!((GPIO_ReadValue(1) >> 31) & 0x01)){		//Check if SW4 was pressed
-		if (i != 16) {								//If SW4 is pressed when led7seg does not shows 'F'
-			SW4 = true;
-			return;
+static void tlm_send_status(int cls, uint8_t status){
+	uint8_t payload[4];
+
+	payload[0] = TLM_FRAME_STATUS;
+	payload[1] = status;
+	tlm_send_frame(cls, payload, TLM_STATUS_LEN);
+}
+
+typedef struct {
+	uint16_t seq;
+	int16_t temp;									//0.1 deg C
+	uint16_t lux;									//saturated at 0xFFFF
+	int8_t x, y, z;
+	uint8_t status;									//TLM_STATUS_* bits
+} TLM_SAMPLE;
+
+typedef struct {
+	uint8_t payload[TLM_MAX_PAYLOAD + 2];			//room for the CRC tlm_frame() appends
+	uint32_t len;
+	uint8_t count;									//records in payload
+	TLM_SAMPLE last;								//the deltas are from this one
+	uint32_t samples;								//sent in batch frames
+	uint32_t bytes;									//batch frames on the wire
+	uint32_t unbatched;								//sensor and status frames the same records would take
+	uint32_t pending;								//unbatched bytes of the records in payload
+	uint32_t started;								//getTicks() at the first record in payload
+} TLM_BATCH;
+
+static TLM_BATCH tlm_batch;
+static uint8_t tlm_batch_status = 0;				//sent with the record that follows
+static bool tlm_batch_alert = false;				//tlm_batch_status holds a new live detection
+static uint8_t tlm_batch_live = 0;					//live detections already reported this PASSIVE visit
+
+//Append one record, false if it does not fit or does not follow the last one
+static bool tlm_batch_add(TLM_BATCH *b, const TLM_SAMPLE *s){
+	uint8_t delta[TLM_DELTA_MAX];
+	uint8_t *p = b->payload;
+	uint32_t n;
+
+	if (b->count == 0){
+		p[0] = TLM_FRAME_BATCH;
+		p[1] = s->seq & 0xFF;
+		p[2] = s->seq >> 8;
+		p[4] = (uint16_t)s->temp & 0xFF;
+		p[5] = (uint16_t)s->temp >> 8;
+		p[6] = s->lux & 0xFF;
+		p[7] = s->lux >> 8;
+		p[8] = (uint8_t)s->x;
+		p[9] = (uint8_t)s->y;
+		p[10] = (uint8_t)s->z;
+		p[11] = s->status;
+		b->len = TLM_BATCH_HEADER;
+		b->started = getTicks();
+	}
+	else{
+		if ((b->count == TLM_BATCH_SAMPLES) || (s->seq != (uint16_t)(b->last.seq + 1))){
+			return false;
 		}
-		else {										//SW4 was pressed when led7seg shows 'F'
-			next_SW4 = true;						//Update SW4 Flag in the next cycle
-			return;
+		n = varint_put(delta, (zigzag(s->temp - b->last.temp) << 1) | (s->status != b->last.status));
+		n += varint_put(&delta[n], zigzag(s->lux - b->last.lux));
+		n += varint_put(&delta[n], zigzag(s->x - b->last.x));
+		n += varint_put(&delta[n], zigzag(s->y - b->last.y));
+		n += varint_put(&delta[n], zigzag(s->z - b->last.z));
+		if (s->status != b->last.status){
+			delta[n++] = s->status;
 		}
+		if (b->len + n > TLM_MAX_PAYLOAD){
+			return false;
+		}
+		memcpy(&p[b->len], delta, n);
+		b->len += n;
 	}
-	else if (SW4 && (i == 16)){						//Check if SW4 was previously pressed and trigger when 7 Segment Display shows 'F'
-		Date_Flag = true;
-		SW4 = false;
+	b->last = *s;
+	p[3] = ++b->count;
+	b->pending += TLM_WIRE(TLM_SENSOR_LEN) + (s->status ? TLM_WIRE(TLM_STATUS_LEN) : 0);
+	return true;
+}
+
+//Frame the records held in b and pass the frame to send
+static void tlm_batch_flush(TLM_BATCH *b, uint32_t (*send)(const uint8_t *, uint32_t)){
+	uint8_t frame[TLM_MAX_PAYLOAD + 5];
+	uint32_t n;
+
+	if (b->count == 0){
 		return;
 	}
-	else
-		return;
+	n = tlm_frame(b->payload, b->len, frame);
+	send(frame, n);
+	b->samples += b->count;
+	b->bytes += n;
+	b->unbatched += b->pending;
+	b->pending = 0;
+	b->count = 0;
 }
 
-//Check for condition to change to CHARGE Mode
-int MODE_TOGGLE_Charge(int *count){
+//True once the first record held in b is TLM_BATCH_MAX_AGE old
+static bool tlm_batch_expired(const TLM_BATCH *b){
+	return (b->count != 0) && ((getTicks() - b->started) >= TLM_BATCH_MAX_AGE);
+}
 
-	if((*count) >3){
-		Charge_Flag = true;
-		(*count = 0);
-		return 2;
+//Batch one record, the frame goes out once it is full, TLM_BATCH_MAX_AGE old or right away if alert
+static void tlm_batch_sample(TLM_BATCH *b, const TLM_SAMPLE *s, bool alert, uint32_t (*send)(const uint8_t *, uint32_t)){
+	if (!tlm_batch_add(b, s)){
+		tlm_batch_flush(b, send);
+		tlm_batch_add(b, s);
 	}
+	if ((b->count == TLM_BATCH_SAMPLES) || alert || tlm_batch_expired(b)){
+		tlm_batch_flush(b, send);
+	}
+}
 
-	if (rotary_read() == 1 ){						//triggers when rotary switch is rotated
-		(*count)++;
-		return 1;
+//Bytes the records would have taken as single frames per batch byte, in 0.01
+static uint32_t tlm_batch_ratio(const TLM_BATCH *b){
+	return (b->bytes != 0) ? (uint32_t)(((uint64_t)b->unbatched * 100) / b->bytes) : 0;
+}
+
+#ifdef HOST_SIM
+//Host side decoder for SAFE ingestion tools and the simulator
+//Decodes one COBS block (without the 0x00 delimiter) into payload, which holds size bytes
+//including the CRC16, and checks the CRC
+//Returns payload length without CRC, or -1 if the frame is corrupt or does not fit
+int tlm_decode_frame(const uint8_t *src, uint32_t len, uint8_t *payload, uint32_t size){
+	uint32_t in = 0;
+	uint32_t out = 0;
+	uint8_t code;
+	uint8_t i;
+
+	while (in < len){
+		code = src[in++];
+		if (code == 0){
+			return -1;
+		}
+		for (i = 1; i < code; i++){
+			if ((in >= len) || (out >= size)){
+				return -1;
+			}
+			payload[out++] = src[in++];
+		}
+		if ((code < 0xFF) && (in < len)){
+			if (out >= size){
+				return -1;
+			}
+			payload[out++] = 0x00;
+		}
 	}
-	else
-		return 0;
+	if (out < 3){
+		return -1;
+	}
+	out -= 2;
+	if (crc16_ccitt(payload, out) != (payload[out] | (payload[out + 1] << 8))){
+		return -1;
+	}
+	return out;
 }
 
-//Check if biofuels fully harvested
-void check_harvested(){
-	if (harvested == 16){
+//Records of a TLM_FRAME_BATCH payload as tlm_decode_frame() returns it
+//samples must hold TLM_BATCH_SAMPLES, returns how many or -1 if it is malformed
+int tlm_decode_batch(const uint8_t *payload, uint32_t len, TLM_SAMPLE *samples){
+	uint32_t pos = TLM_BATCH_HEADER;
+	uint32_t d[5];
+	TLM_SAMPLE s;
+	int count, i, j;
+
+	if ((len < TLM_BATCH_HEADER) || (payload[0] != TLM_FRAME_BATCH) ||
+			(payload[3] == 0) || (payload[3] > TLM_BATCH_SAMPLES)){
+		return -1;
+	}
+	count = payload[3];
+	s.seq = payload[1] | (payload[2] << 8);
+	s.temp = (int16_t)(payload[4] | (payload[5] << 8));
+	s.lux = payload[6] | (payload[7] << 8);
+	s.x = (int8_t)payload[8];
+	s.y = (int8_t)payload[9];
+	s.z = (int8_t)payload[10];
+	s.status = payload[11];
+	samples[0] = s;
+
+	for (i = 1; i < count; i++){
+		for (j = 0; j < 5; j++){
+			if (!varint_get(payload, len, &pos, &d[j])){
+				return -1;
+			}
+		}
+		s.seq++;
+		s.temp += unzigzag(d[0] >> 1);
+		s.lux += unzigzag(d[1]);
+		s.x += unzigzag(d[2]);
+		s.y += unzigzag(d[3]);
+		s.z += unzigzag(d[4]);
+		if (d[0] & 1){
+			if (pos >= len){
+				return -1;
+			}
+			s.status = payload[pos++];
+		}
+		samples[i] = s;
+	}
+	return (pos == len) ? count : -1;
+}
+#endif
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// UART related functions
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#ifdef FLASH_LOG
+static bool flog_holding(void);
+static void flog_store(uint16_t counter, uint8_t status);
+static uint8_t flog_status = 0;						//detections held back for the next stored record
+#endif
+
+//Detections as TLM_STATUS_* bits
+static uint8_t status_bits(void){
+	return (Algae_Flag ? TLM_STATUS_ALGAE : 0) | (Waste_Flag ? TLM_STATUS_WASTE : 0);
+}
+
+//Send detections to SAFE, as alerts or with the records of the flash log (cls)
+static void send_status_bits_SAFE(int cls, uint8_t status){
+	if (telemetry_mode == TELEMETRY_BATCH){
+		tlm_batch_status = status;					//goes in the batch with the record that follows
+		if (cls == TLM_CLASS_ALERT){
+			//Held records carry old detections, only a live one SAFE has not seen yet is an alert
+			tlm_batch_alert = (status & ~tlm_batch_live) != 0;
+			tlm_batch_live = status;
+		}
+		return;
+	}
+
+	if (telemetry_mode == TELEMETRY_BINARY){
+		//Both detections go out as one status frame
+		if (status != 0){
+			tlm_send_status(cls, status);
+		}
+		return;
+	}
+
+	if(status & TLM_STATUS_ALGAE){
+		//Send following msg to SAFE if Algae is dectected
+		UART_msg = "Algae was Detected. \r\n";
+		tlm_queue_text(cls, UART_msg);
+	}
+
+	if(status & TLM_STATUS_WASTE){
+		//Send following msg to SAFE if Waste was detected
+		UART_msg = "Solid Wastes was Detected. \r\n";
+		tlm_queue_text(cls, UART_msg);
+	}
+	return;
+}
 
-		//Disable UART3 interrupt handler since it is not needed anymore
-		NVIC_ClearPendingIRQ(UART3_IRQn);
-		NVIC_DisableIRQ(UART3_IRQn);
+void send_status_SAFE(){
+#ifdef FLASH_LOG
+	if (flog_holding()){
+		flog_status = status_bits();				//kept with the sensor record that follows
+		return;
+	}
+#endif
+	send_status_bits_SAFE(TLM_CLASS_ALERT, status_bits());
+}
+
+//Text sensor record for SAFE, counter = 00x, 0xx or xxx, returns its length
+static uint32_t text_sensor(char *buf, int counter, int32_t temp_deci, uint32_t lux, int8_t ax, int8_t ay, int8_t az){
+	char *p;
+
+	p = fmt_int(buf, counter, 3, '0');
+	p = fmt_fixed(fmt_str(p, "_-_T"), temp_deci, 1);
+	p = fmt_uint(fmt_str(p, "_L"), lux, 0, ' ');
+	p = fmt_int(fmt_str(p, "_AX"), ax, 0, ' ');
+	p = fmt_int(fmt_str(p, "_AY"), ay, 0, ' ');
+	p = fmt_int(fmt_str(p, "_AZ"), az, 0, ' ');
+	p = fmt_str(p, "\r\n");
+	return p - buf;
+}
+
+//Send one sensor record, numbered counter, as text, binary or into the batch
+static void send_sensor_SAFE(int counter, int32_t temp_deci, uint32_t lux, int8_t ax, int8_t ay, int8_t az){
+
+	if (telemetry_mode == TELEMETRY_BINARY){
+		// send sensor values to SAFE as a 12 byte binary record
+		tlm_send_sensor(counter, (int16_t)temp_deci, lux, ax, ay, az);
+		return;
+	}
+
+	if (telemetry_mode == TELEMETRY_BATCH){
+		TLM_SAMPLE s = {counter, (int16_t)temp_deci, (lux > 0xFFFF) ? 0xFFFF : lux, ax, ay, az, tlm_batch_status};
+		bool alert = tlm_batch_alert;
+
+		tlm_batch_status = 0;
+		tlm_batch_alert = false;
+		//A new detection flushes the batch, it goes out ahead of queued samples
+		tlm_batch_sample(&tlm_batch, &s, alert, alert ? tlm_queue_alert : tlm_queue_sample);
+		return;
+	}
+
+	// send sensor values to SAFE as text
+	tlm_queue(TLM_CLASS_SAMPLE, text, text_sensor((char *)text, counter, temp_deci, lux, ax, ay, az));
+}
 
-		//Send msg to SAFE upon fully harvested
-		UART_msg = "Biofuels fully harvested. Leaving CHARGE mode. \r\n";
-		UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
+//Send the records batched so far, when leaving the mode that reports them or on request
+static void send_batch_SAFE(void){
+	tlm_batch_flush(&tlm_batch, tlm_queue_sample);
+}
 
-		OLED_Update_CHARGE();
-		harvested = 0;
-		pca9532_setLeds(0, 0xffff);					//turn off LED array
-		FULL = true;
+void send_to_SAFE(){
+#ifdef FLASH_LOG
+	if (flog_holding()){
+		flog_store(UART_msg_counter, flog_status);	//SAFE gets it once the link is back
+		flog_status = 0;
+		UART_msg_counter++;
+		return;
 	}
+#endif
+	send_sensor_SAFE(UART_msg_counter, temperature, light, x, y, z);
+
+	UART_msg_counter++;						//Increment UART msg count
+
 	return;
 }
 
-//Check if exit is triggered while in CHARGE();
-void check_exit(){
-	if(EXIT){
+#ifdef FLASH_LOG
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Flash telemetry log
+// While SAFE has not sent a byte for FLOG_LINK_TIMEOUT ms (or since reset),
+// and until everything held back has been sent, send_to_SAFE() appends its
+// record to a page buffer in RAM instead of queueing it on UART3. A full
+// page is programmed into the reserved sectors with the IAP ROM calls.
+// The sectors form one circular log, each page taking the next slot, so
+// every sector is erased once per lap. A sector is erased just before its
+// first page is written, unsent pages still in it are lost.
+// Page (FLOG_PAGE_SIZE bytes):
+//   [0..1] CRC16 of bytes 2..255  [2..5] page sequence  [6] type  [7] records
+//   [8..] FLOG_PAGE_RECORDS records of FLOG_REC_SIZE bytes, rest left 0xFF
+// Record: [0..1] msg counter  [2..3] temperature in 0.1 deg C  [4..5] lux
+//   (saturated)  [6..8] x, y, z  [9] TLM_STATUS_* bits  [10..11] uptime in s
+// Once SAFE is back flog_drain() sends the flash pages, then what is still in
+// RAM, as normal text or binary msgs whenever the TX ring has room. A MARK
+// page after the last drained page tells the boot scan where to resume, a
+// page that was half sent before a reset is sent again (same msg counter).
+// Sectors FLOG_FIRST_SECTOR.. must be left out of the linker script flash
+// region, and IAP uses the top 32 bytes of local RAM.
+// Interrupts are off while IAP runs (the vector table is in flash), that
+// is about 1ms per page and 100ms per sector erase.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define FLOG_FIRST_SECTOR		26
+#define FLOG_SECTORS			4
+#define FLOG_BASE				0x00060000			//start of sector 26
+#define FLOG_SECTOR_SIZE		0x8000				//sectors 16..29 are 32kB
+#define FLOG_PAGE_SIZE			256
+#define FLOG_SECTOR_PAGES		(FLOG_SECTOR_SIZE / FLOG_PAGE_SIZE)
+#define FLOG_PAGES				(FLOG_SECTORS * FLOG_SECTOR_PAGES)
+#define FLOG_HEADER				8
+#define FLOG_REC_SIZE			12
+#define FLOG_PAGE_RECORDS		((FLOG_PAGE_SIZE - FLOG_HEADER) / FLOG_REC_SIZE)
+#define FLOG_PAGE_DATA			0x01
+#define FLOG_PAGE_MARK			0x02
+#define FLOG_BLANK				0xFFFFFFFF
+#define FLOG_LINK_TIMEOUT		3000				//ms without a byte from SAFE before records are held
+#define FLOG_DRAIN_SLOTS		3					//sample queue slots one record can take, two detections and the record
+
+#define IAP_LOCATION			0x1FFF1FF1
+#define IAP_PREPARE				50
+#define IAP_COPY_RAM_TO_FLASH	51
+#define IAP_ERASE				52
+#define IAP_BLANK_CHECK			53
+#define IAP_CMD_SUCCESS			0
+#define IAP_SECTOR_NOT_BLANK	8
+
+#ifdef HOST_SIM
+//sim/host_sim.c keeps the sectors in a file
+extern uint8_t sim_flash[FLOG_SECTORS * FLOG_SECTOR_SIZE];
+void sim_iap(uintptr_t *cmd, uintptr_t *result);
+#define FLOG_MEM				((const uint8_t *)sim_flash)
+#define IAP_CALL(cmd, result)	sim_iap(cmd, result)
+#else
+#define FLOG_MEM				((const uint8_t *)FLOG_BASE)
+#define IAP_CALL(cmd, result)	((void (*)(uintptr_t *, uintptr_t *))IAP_LOCATION)(cmd, result)
+#endif
+
+static uint32_t flog_page[FLOG_PAGE_SIZE / 4];		//records waiting for a page, word aligned for IAP
+static uint32_t flog_batch = 0;						//records in flog_page
+static uint32_t flog_batch_sent = 0;				//of which already sent to SAFE
+static uint32_t flog_head = 0;						//next page to program
+static uint32_t flog_tail = 0;						//oldest page not sent yet
+static uint32_t flog_tail_sent = 0;					//records of it already sent
+static uint32_t flog_seq = 0;						//sequence of the next page
+static bool flog_unmarked = false;					//pages were drained since the last MARK
+static volatile uint32_t flog_rx_last = 0;			//ms of the last byte from SAFE
+static volatile bool flog_rx_seen = false;
+
+uint32_t flog_records = 0;							//records held back
+uint32_t flog_flash_records = 0;					//of which were programmed into flash
+uint32_t flog_sent = 0;								//records drained to SAFE
+uint32_t flog_lost = 0;								//unsent records erased or in a failed page
+uint32_t flog_pages = 0;							//DATA pages programmed
+uint32_t flog_marks = 0;							//MARK pages programmed
+uint32_t flog_iap_errors = 0;
+uint32_t flog_erases[FLOG_SECTORS];
+uint32_t flog_prog_cycles = 0;						//DWT cycles in IAP program calls
+uint32_t flog_prog_max = 0;
+uint32_t flog_erase_cycles = 0;						//DWT cycles in IAP erase calls
+uint32_t flog_erase_max = 0;
+
+static const uint8_t *flog_page_at(uint32_t page){
+	return FLOG_MEM + page * FLOG_PAGE_SIZE;
+}
+
+static uint32_t flog_page_seq(const uint8_t *p){
+	return p[2] | (p[3] << 8) | (p[4] << 16) | ((uint32_t)p[5] << 24);
+}
+
+static bool flog_page_valid(const uint8_t *p){
+	return (flog_page_seq(p) != FLOG_BLANK) && (p[7] <= FLOG_PAGE_RECORDS) &&
+			(crc16_ccitt(&p[2], FLOG_PAGE_SIZE - 2) == (p[0] | (p[1] << 8)));
+}
+
+//Run one IAP command with interrupts off, returns the DWT cycles it took
+static uint32_t flog_iap(uintptr_t *cmd, uintptr_t *result){
+	uint32_t primask = __get_PRIMASK();
+	uint32_t start;
+
+	__disable_irq();
+	start = DWT->CYCCNT;
+	IAP_CALL(cmd, result);
+	start = DWT->CYCCNT - start;
+	__set_PRIMASK(primask);
+	if (result[0] != IAP_CMD_SUCCESS){
+		flog_iap_errors++;
+	}
+	return start;
+}
 
-		//Disable UART3 interrupt handler since it is not needed anymore
-		NVIC_ClearPendingIRQ(UART3_IRQn);
-		NVIC_DisableIRQ(UART3_IRQn);
+static bool flog_prepare(uint32_t sector){
+	uintptr_t cmd[5] = {IAP_PREPARE, sector, sector, 0, 0};
+	uintptr_t result[5];
 
-		//Send msg to SAFE upon CHARGE mode exit trigger
-		UART_msg = "Giving up on harvesting. Leaving CHARGE Mode. \r\n";
-		UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
+	flog_iap(cmd, result);
+	return result[0] == IAP_CMD_SUCCESS;
+}
 
-		OLED_Update_EXIT();
-		harvested = 0;
-		pca9532_setLeds(0, 0xffff);					//turn off LED array
-		FULL = true;
+//Erase sector s of the log unless it is blank
+static bool flog_erase(uint32_t s){
+	uint32_t sector = FLOG_FIRST_SECTOR + s;
+	uintptr_t cmd[5] = {IAP_BLANK_CHECK, sector, sector, 0, 0};
+	uintptr_t result[5];
+	uint32_t cycles;
 
+	IAP_CALL(cmd, result);
+	if (result[0] == IAP_CMD_SUCCESS){
+		return true;
 	}
-	return;
+	if (!flog_prepare(sector)){
+		return false;
+	}
+	cmd[0] = IAP_ERASE;
+	cmd[3] = SystemCoreClock / 1000;
+	cycles = flog_iap(cmd, result);
+	flog_erase_cycles += cycles;
+	if (cycles > flog_erase_max){
+		flog_erase_max = cycles;
+	}
+	flog_erases[s]++;
+	return result[0] == IAP_CMD_SUCCESS;
 }
 
-//check for number of harvests
-int check_filled(int currX, int currY, int arr[16]){
-	if (currX == X1 && currY == Y1){
-		if(arr[0] == 0){
-			harvested++;
-			arr[0] = 1;
+//Program buf as the page at flog_head, erasing the sector first if the page opens it
+static bool flog_program(uint32_t *buf, uint8_t type, uint8_t count){
+	const uint8_t *old;
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t s = flog_head / FLOG_SECTOR_PAGES;
+	uintptr_t cmd[5] = {IAP_COPY_RAM_TO_FLASH, (uintptr_t)flog_page_at(flog_head), (uintptr_t)buf, FLOG_PAGE_SIZE, SystemCoreClock / 1000};
+	uintptr_t result[5];
+	uint32_t cycles;
+	uint16_t crc;
+	bool ok = false;
+
+	memset(&p[FLOG_HEADER + count * FLOG_REC_SIZE], 0xFF, FLOG_PAGE_SIZE - FLOG_HEADER - count * FLOG_REC_SIZE);
+	p[2] = flog_seq & 0xFF;
+	p[3] = (flog_seq >> 8) & 0xFF;
+	p[4] = (flog_seq >> 16) & 0xFF;
+	p[5] = flog_seq >> 24;
+	p[6] = type;
+	p[7] = count;
+	crc = crc16_ccitt(&p[2], FLOG_PAGE_SIZE - 2);
+	p[0] = crc & 0xFF;
+	p[1] = crc >> 8;
+
+	//A page that failed still takes its slot, it cannot be programmed again without an erase
+	if ((((flog_head % FLOG_SECTOR_PAGES) != 0) || flog_erase(s)) && flog_prepare(FLOG_FIRST_SECTOR + s)){
+		cycles = flog_iap(cmd, result);
+		flog_prog_cycles += cycles;
+		if (cycles > flog_prog_max){
+			flog_prog_max = cycles;
 		}
+		ok = (result[0] == IAP_CMD_SUCCESS);
 	}
-	if (currX == X1 && currY == Y2){
-		if(arr[1] == 0){
-			harvested++;
-			arr[1] = 1;
-		}
+	flog_head = (flog_head + 1) % FLOG_PAGES;
+	flog_seq++;
+
+	//Head moved into the sector the oldest unsent page is in (tail == head if the log
+	//is full), that sector is erased by the next page so its records are lost
+	if (((flog_head % FLOG_SECTOR_PAGES) == 0) && ((flog_tail / FLOG_SECTOR_PAGES) == (flog_head / FLOG_SECTOR_PAGES))){
+		do{
+			old = flog_page_at(flog_tail);
+			if (flog_page_valid(old) && (old[6] == FLOG_PAGE_DATA)){
+				flog_lost += old[7] - flog_tail_sent;
+			}
+			flog_tail = (flog_tail + 1) % FLOG_PAGES;
+			flog_tail_sent = 0;
+		} while ((flog_tail % FLOG_SECTOR_PAGES) != 0);
 	}
-	if (currX == X1 && currY == Y3){
-		if(arr[2] == 0){
-			harvested++;
-			arr[2] = 1;
+	return ok;
+}
+
+//Find the newest page and the unsent pages in front of it
+//Called once at boot
+static void flog_init(void){
+	const uint8_t *p;
+	uint32_t newest = FLOG_PAGES;
+	uint32_t i, seq;
+
+	for (i = 0; i < FLOG_PAGES; i++){
+		p = flog_page_at(i);
+		if (flog_page_valid(p) && ((newest == FLOG_PAGES) || (flog_page_seq(p) >= flog_seq))){
+			newest = i;
+			flog_seq = flog_page_seq(p) + 1;
 		}
 	}
-	if (currX == X1 && currY == Y4){
-		if(arr[3] == 0){
-			harvested++;
-			arr[3] = 1;
-		};
+	if (newest == FLOG_PAGES){
+		return;										//empty log
 	}
-	if (currX == X2 && currY == Y1){
-		if(arr[4] == 0){
-			harvested++;
-			arr[4] = 1;
-		}
-	}
-	if (currX == X2 && currY == Y2){
-		if(arr[5] == 0){
-			harvested++;
-			arr[5] = 1;
+
+	//Unsent pages run back from the newest one to a MARK, a gap or a blank page
+	flog_head = (newest + 1) % FLOG_PAGES;
+	flog_tail = flog_head;
+	seq = flog_seq;
+	for (i = 1; i < FLOG_PAGES; i++){
+		p = flog_page_at((flog_head + FLOG_PAGES - i) % FLOG_PAGES);
+		if (!flog_page_valid(p) || (p[6] != FLOG_PAGE_DATA) || (flog_page_seq(p) != --seq)){
+			break;
 		}
+		flog_tail = (flog_head + FLOG_PAGES - i) % FLOG_PAGES;
 	}
-	if (currX == X2 && currY == Y3){
-		if(arr[6] == 0){
-			harvested++;
-			arr[6] = 1;
-		}
+}
+
+static bool flog_link_up(void){
+	return flog_rx_seen && ((getTicks() - flog_rx_last) < FLOG_LINK_TIMEOUT);
+}
+
+static bool flog_backlog(void){
+	return (flog_tail != flog_head) || (flog_batch_sent < flog_batch);
+}
+
+//Records are held while SAFE is away, and after it is back until the older ones are out
+static bool flog_holding(void){
+	return !flog_link_up() || flog_backlog();
+}
+
+static void flog_start_drain(void){
+	flog_draining = true;
+	sched_post(flog_drain);
+}
+
+//Called by uart_rx_drain for every byte from SAFE
+static void flog_rx(void){
+	flog_rx_last = getTicks();
+	flog_rx_seen = true;
+	//A drain left without a pending THRE (post dropped by sched_clear) is restarted here
+	if (flog_backlog() && (!flog_draining || !uart_tx_busy)){
+		flog_start_drain();
 	}
-	if (currX == X2 && currY == Y4){
-		if(arr[7] == 0){
-			harvested++;
-			arr[7] = 1;
-		}
+}
+
+//Add the current readings to the page buffer, a full page goes to flash
+static void flog_store(uint16_t counter, uint8_t status){
+	uint8_t *r;
+	uint32_t lux = (light > 0xFFFF) ? 0xFFFF : light;
+	uint32_t uptime = getTicks() / 1000;
+
+	if (flog_batch == FLOG_PAGE_RECORDS){
+		//Page is full but partly sent, keep only what SAFE has not had
+		memmove((uint8_t *)flog_page + FLOG_HEADER, (uint8_t *)flog_page + FLOG_HEADER + flog_batch_sent * FLOG_REC_SIZE,
+				(flog_batch - flog_batch_sent) * FLOG_REC_SIZE);
+		flog_batch -= flog_batch_sent;
+		flog_batch_sent = 0;
 	}
-	if (currX == X3 && currY == Y1){
-		if(arr[8] == 0){
-			harvested++;
-			arr[8] = 1;
+
+	r = (uint8_t *)flog_page + FLOG_HEADER + flog_batch * FLOG_REC_SIZE;
+	r[0] = counter & 0xFF;
+	r[1] = counter >> 8;
+	r[2] = (uint16_t)temperature & 0xFF;
+	r[3] = (uint16_t)temperature >> 8;
+	r[4] = lux & 0xFF;
+	r[5] = lux >> 8;
+	r[6] = (uint8_t)x;
+	r[7] = (uint8_t)y;
+	r[8] = (uint8_t)z;
+	r[9] = status;
+	r[10] = uptime & 0xFF;
+	r[11] = (uptime >> 8) & 0xFF;
+	flog_batch++;
+	flog_records++;
+
+	if ((flog_batch == FLOG_PAGE_RECORDS) && (flog_batch_sent == 0)){
+		if (flog_program(flog_page, FLOG_PAGE_DATA, flog_batch)){
+			flog_pages++;
+			flog_flash_records += flog_batch;
 		}
-	}
-	if (currX == X3 && currY == Y2){
-		if(arr[9] == 0){
-			harvested++;
-			arr[9] = 1;
+		else{
+			flog_lost += flog_batch;
 		}
+		flog_batch = 0;
 	}
-	if (currX == X3 && currY == Y3){
-		if(arr[10] == 0){
-			harvested++;
-			arr[10] = 1;
-		}
+
+	if (flog_link_up()){
+		flog_start_drain();
 	}
-	if (currX == X3 && currY == Y4){
-		if(arr[11] == 0){
-			harvested++;
-			arr[11] = 1;
+}
+
+//Copy the oldest unsent record into rec, returns false once there are none
+static bool flog_take(uint8_t *rec){
+	uint32_t mark[FLOG_PAGE_SIZE / 4];
+	const uint8_t *p;
+
+	while (flog_tail != flog_head){
+		p = flog_page_at(flog_tail);
+		if (flog_page_valid(p) && (p[6] == FLOG_PAGE_DATA) && (flog_tail_sent < p[7])){
+			memcpy(rec, &p[FLOG_HEADER + flog_tail_sent * FLOG_REC_SIZE], FLOG_REC_SIZE);
+			flog_tail_sent++;
+			return true;
 		}
+		flog_tail = (flog_tail + 1) % FLOG_PAGES;
+		flog_tail_sent = 0;
+		flog_unmarked = true;
 	}
-	if (currX == X4 && currY == Y1){
-		if(arr[12] == 0){
-			harvested++;
-			arr[12] = 1;
+
+	if (flog_unmarked){
+		flog_unmarked = false;
+		if (flog_program(mark, FLOG_PAGE_MARK, 0)){
+			flog_marks++;
 		}
+		flog_tail = flog_head;
 	}
-	if (currX == X4 && currY == Y2){
-		if(arr[13] == 0){
-			harvested++;
-			arr[13] = 1;
+
+	if (flog_batch_sent < flog_batch){
+		memcpy(rec, (uint8_t *)flog_page + FLOG_HEADER + flog_batch_sent * FLOG_REC_SIZE, FLOG_REC_SIZE);
+		if (++flog_batch_sent == flog_batch){
+			flog_batch = 0;
+			flog_batch_sent = 0;
 		}
+		return true;
 	}
-	if (currX == X4 && currY == Y3){
-		if(arr[14] == 0){
-			harvested++;
-			arr[14] = 1;
+	return false;
+}
+
+//Send held records while the sample queue has room, uart_tx_fill posts it again once the ring is empty
+//Held records are queued only into free slots, so none of them is dropped as stale
+static void flog_drain(void){
+	uint8_t r[FLOG_REC_SIZE];
+
+	while (flog_link_up() && (tlm_queue_free(TLM_CLASS_SAMPLE) >= FLOG_DRAIN_SLOTS)){
+		if (!flog_take(r)){
+			flog_draining = false;
+			tlm_batch_flush(&tlm_batch, tlm_queue_sample);	//the last held records, if batched
+			return;
 		}
+		send_status_bits_SAFE(TLM_CLASS_SAMPLE, r[9]);
+		send_sensor_SAFE(r[0] | (r[1] << 8), (int16_t)(r[2] | (r[3] << 8)), r[4] | (r[5] << 8),
+				(int8_t)r[6], (int8_t)r[7], (int8_t)r[8]);
+		flog_sent++;
 	}
-	if (currX == X4 && currY == Y4){
-		if(arr[15] == 0){
-			harvested++;
-			arr[15] = 1;
-		}
+	if (!flog_link_up()){
+		flog_draining = false;						//flog_rx starts it again
 	}
-	else
-		return 0;
 }
 
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// UART related functions
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
-void send_status_SAFE(){
-	if(Algae_Flag){
-		//Send following msg to SAFE if Algae is dectected
-		UART_msg = "Algae was Detected. \r\n";
-		UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
+//Posted by UART3_IRQHandler on the report key
+//Write amplification is flash bytes programmed per record byte kept in flash
+static void flog_report(void){
+	char line[128];
+	uint32_t us = SystemCoreClock / 1000000;
+	uint32_t programmed = (flog_pages + flog_marks) * FLOG_PAGE_SIZE;
+	uint32_t wa = flog_flash_records ? (programmed * 100) / (flog_flash_records * FLOG_REC_SIZE) : 0;
+	uint32_t erases = 0;
+	uint32_t i;
+	int len;
+
+	for (i = 0; i < FLOG_SECTORS; i++){
+		erases += flog_erases[i];
 	}
 
-	if(Waste_Flag){
-		//Send following msg to SAFE if Waste was detected
-		UART_msg = "Solid Wastes was Detected. \r\n";
-		UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
+	sprintf(line, "flog records=%lu flash=%lu sent=%lu lost=%lu pages=%lu marks=%lu wa=%lu.%02lu\r\n",
+			(unsigned long)flog_records, (unsigned long)flog_flash_records, (unsigned long)flog_sent,
+			(unsigned long)flog_lost, (unsigned long)flog_pages, (unsigned long)flog_marks,
+			(unsigned long)(wa / 100), (unsigned long)(wa % 100));
+	uart_tx_print(line);
+	sprintf(line, "flog prog_us mean=%lu max=%lu erase_us mean=%lu max=%lu iap_errors=%lu\r\n",
+			(unsigned long)((flog_pages + flog_marks) ? flog_prog_cycles / (flog_pages + flog_marks) / us : 0),
+			(unsigned long)(flog_prog_max / us), (unsigned long)(erases ? flog_erase_cycles / erases / us : 0),
+			(unsigned long)(flog_erase_max / us), (unsigned long)flog_iap_errors);
+	uart_tx_print(line);
+	len = sprintf(line, "flog head=%lu tail=%lu erases=", (unsigned long)flog_head, (unsigned long)flog_tail);
+	for (i = 0; i < FLOG_SECTORS; i++){
+		len += sprintf(line + len, (i == 0) ? "%lu" : ",%lu", (unsigned long)flog_erases[i]);
 	}
-	return;
+	sprintf(line + len, "\r\n");
+	uart_tx_print(line);
 }
+#endif
 
-void send_to_SAFE(){
-	const char* Sensor_UART_one = "00%d_-_T%.1f_L%u_AX%d_AY%d_AZ%d\r\n";
-	const char* Sensor_UART_ten = "0%d_-_T%.1f_L%u_AX%d_AY%d_AZ%d\r\n";
-	const char* Sensor_UART_hundred = "%d_-_T%.1f_L%u_AX%d_AY%d_AZ%d\r\n";
+#ifdef BENCH
+static const char *bench_isr_names[BENCH_ISR_COUNT] = {"SysTick", "TIMER0", "EINT3", "UART3"};
+static const char *bench_span_names[BENCH_SPAN_COUNT] = {"f_report"};
 
-	if (UART_msg_counter < 10){
-		// send sensor values to SAFE, counter = 00x
-		sprintf(text,Sensor_UART_one, UART_msg_counter, temperature, light, x, y, z);
-		UART_Send(LPC_UART3, text, strlen(text), BLOCKING);
-	}
+void mode_stats_reset(void);
+static void mode_bench_report(const char *mode);
+
+static void bench_print_stat(const char *mode, const char *kind, const char *name, BENCH_STAT *stat){
+	char line[128];
+
+	sprintf(line, "bench mode=%s %s=%s count=%lu mean=%lu max=%lu total=%llu\r\n", mode, kind, name,
+			(unsigned long)stat->count, (unsigned long)(stat->count ? stat->total / stat->count : 0),
+			(unsigned long)stat->max, (unsigned long long)stat->total);
+	uart_tx_print(line);
+}
 
-	else if (UART_msg_counter > 99){
-		// send sensor values to SAFE, counter = xxx
-		sprintf(text,Sensor_UART_hundred, UART_msg_counter, temperature, light, x, y, z);
-		UART_Send(LPC_UART3, text, strlen(text), BLOCKING);
+void bench_reset(void){
+	memset(&bench_loop, 0, sizeof(bench_loop));
+	memset(bench_isr, 0, sizeof(bench_isr));
+	memset(bench_span, 0, sizeof(bench_span));
+	sched_stats_reset();
+	ssp_stats_reset();
+	tlm_stats_reset();
+	mode_stats_reset();
+	bench_start_ms = getTicks();
+}
+
+//One key=value record per line for each mode visit, counters restart afterwards
+//Cycle counts are DWT CYCCNT, latency is the worst scheduler dispatch delay
+void bench_report(const char *mode){
+	char line[128];
+	uint32_t late_max = 0;
+	int i;
+
+	for (i = 0; i < SCHED_MAX_STATS; i++){
+		if (sched_stats[i].late_max > late_max){
+			late_max = sched_stats[i].late_max;
+		}
 	}
 
-	else{
-		// send sensor values to SAFE, counter = 0xx
-		sprintf(text,Sensor_UART_ten, UART_msg_counter, temperature, light, x, y, z);
-		UART_Send(LPC_UART3, text, strlen(text), BLOCKING);
+	sprintf(line, "bench mode=%s ms=%lu cpu=%lu late_max=%lu\r\n", mode,
+			(unsigned long)(getTicks() - bench_start_ms), (unsigned long)sched_cpu_load(), (unsigned long)late_max);
+	uart_tx_print(line);
+	bench_print_stat(mode, "loop", "iter", &bench_loop);
+	for (i = 0; i < BENCH_ISR_COUNT; i++){
+		bench_print_stat(mode, "isr", bench_isr_names[i], &bench_isr[i]);
+	}
+	for (i = 0; i < BENCH_SPAN_COUNT; i++){
+		bench_print_stat(mode, "span", bench_span_names[i], &bench_span[i]);
+	}
+	for (i = 0; i < SSP_DEV_COUNT; i++){
+		sprintf(line, "bench mode=%s ssp=%s xfers=%lu bytes=%lu load=%lu wait_max=%lu done_max=%lu full=%lu\r\n", mode,
+				(i == SSP_DEV_OLED) ? "OLED" : "LED7SEG", (unsigned long)ssp_stats[i].xfers, (unsigned long)ssp_stats[i].bytes,
+				(unsigned long)ssp_bus_load(i), (unsigned long)ssp_stats[i].wait_max, (unsigned long)ssp_stats[i].done_max,
+				(unsigned long)ssp_stats[i].queue_full);
+		uart_tx_print(line);
+	}
+	for (i = 0; i < TLM_CLASSES; i++){
+		sprintf(line, "bench mode=%s tlm=%s queued=%lu sent=%lu dropped=%lu depth_max=%lu latency_mean=%lu latency_max=%lu\r\n", mode,
+				tlm_class_names[i], (unsigned long)tlm_stats[i].queued, (unsigned long)tlm_stats[i].sent,
+				(unsigned long)tlm_stats[i].dropped, (unsigned long)tlm_stats[i].depth_max,
+				(unsigned long)(tlm_stats[i].sent ? tlm_stats[i].latency_sum / tlm_stats[i].sent : 0),
+				(unsigned long)tlm_stats[i].latency_max);
+		uart_tx_print(line);
 	}
+	mode_bench_report(mode);
+	bench_reset();
+}
+#define BENCH_REPORT(mode)		bench_report(mode)
+#else
+#define BENCH_REPORT(mode)
+#endif
+
+#if ISR_PROFILE
+static const char *isr_prof_names[ISR_PROF_COUNT] = {"EINT3", "TIMER0", "UART3"};
+
+static void isr_prof_print(const char *name, const char *kind, const ISR_PROF_HIST *h){
+	char line[256];
+	int len;
+	int i;
+
+	len = sprintf(line, "isr=%s %s count=%lu min=%lu mean=%lu max=%lu log2=", name, kind,
+			(unsigned long)h->count, (unsigned long)h->min,
+			(unsigned long)(h->count ? h->total / h->count : 0), (unsigned long)h->max);
+	for (i = 0; i < ISR_PROF_BUCKETS; i++){
+		len += sprintf(line + len, (i == 0) ? "%lu" : ",%lu", (unsigned long)h->hist[i]);
+	}
+	sprintf(line + len, "\r\n");
+	uart_tx_print(line);
+}
 
-	UART_msg_counter++;						//Increment UART msg count
+//Posted by UART3_IRQHandler on the dump key, counting carries on afterwards
+static void isr_prof_dump(void){
+	ISR_PROF snap;
+	int i;
+
+	for (i = 0; i < ISR_PROF_COUNT; i++){
+		__disable_irq();
+		snap = isr_prof[i];
+		__enable_irq();
+		isr_prof_print(isr_prof_names[i], "latency", &snap.latency);
+		isr_prof_print(isr_prof_names[i], "exec", &snap.exec);
+	}
+}
+#endif
+
+#ifdef SENSOR_TRACE
+//Trace image: 8 byte header then the records
+//  [0..1] "TR"  [2] TRACE_IMAGE_VERSION  [3] TRACE_TICK_US
+//  [4..5] record bytes  [6..7] records dropped (saturated)
+#define TRACE_IMAGE_HEADER		8
+#define TRACE_IMAGE_VERSION		1
+
+//Queue one trace chunk, sleeping until the ring has room for it
+static void trace_send_chunk(uint16_t offset, const uint8_t *data, uint32_t len){
+	uint8_t payload[TLM_MAX_PAYLOAD + 2];
+	uint8_t frame[TLM_MAX_PAYLOAD + 5];
+	uint32_t n;
+
+	payload[0] = TLM_FRAME_TRACE;
+	payload[1] = offset & 0xFF;
+	payload[2] = offset >> 8;
+	memcpy(&payload[3], data, len);
+	n = tlm_frame(payload, 3 + len, frame);
+	while (uart_tx_write(frame, n) == 0){
+		sched_idle();
+	}
+}
 
-	return;
+//Posted by UART3_IRQHandler on the dump key, recording carries on afterwards
+static void trace_dump(void){
+	uint8_t header[TRACE_IMAGE_HEADER];
+	uint32_t len, off, n;
+	uint32_t dropped = (trace_dropped > 0xFFFF) ? 0xFFFF : trace_dropped;
+
+	trace_joy_flush();
+	len = trace_len;								//records are only ever appended
+	header[0] = 'T';
+	header[1] = 'R';
+	header[2] = TRACE_IMAGE_VERSION;
+	header[3] = TRACE_TICK_US;
+	header[4] = len & 0xFF;
+	header[5] = len >> 8;
+	header[6] = dropped & 0xFF;
+	header[7] = dropped >> 8;
+	trace_send_chunk(0, header, TRACE_IMAGE_HEADER);
+
+	for (off = 0; off < len; off += n){
+		n = ((len - off) < TLM_TRACE_CHUNK) ? len - off : TLM_TRACE_CHUNK;
+		trace_send_chunk(TRACE_IMAGE_HEADER + off, &trace_buf[off], n);
+	}
+	trace_send_chunk(TRACE_IMAGE_HEADER + len, trace_buf, 0);
 }
+#endif
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Mode Initialization Functions
@@ -777,9 +4019,16 @@ void priority_init(){
     uint32_t PG=5, PP=0b00, SP=0b011;
     uint32_t ans = NVIC_EncodePriority(PG,PP,SP);
 
+#ifdef TEMP_CAPTURE_MODE
+    //Timer0 is a free running timestamp, Timer3 interrupts once per temperature window instead
+    NVIC_SetPriority(TIMER3_IRQn, ans);
+	NVIC_ClearPendingIRQ(TIMER3_IRQn);
+	NVIC_EnableIRQ(TIMER3_IRQn);
+#else
     NVIC_SetPriority(TIMER0_IRQn, ans);
 	NVIC_ClearPendingIRQ(TIMER0_IRQn);
 	NVIC_EnableIRQ(TIMER0_IRQn);
+#endif
 
     //Next highest priority given to EINT3 interrupt handler
 	PG=5, PP=0b10, SP=0b011;
@@ -788,6 +4037,20 @@ void priority_init(){
 	NVIC_ClearPendingIRQ(EINT3_IRQn);
 	NVIC_EnableIRQ(EINT3_IRQn);
 
+	//I2C2 engine shares the lowest priority group, ahead of UART3
+	PG=5, PP=0b11, SP=0b010;
+	ans = NVIC_EncodePriority(PG,PP,SP);
+	NVIC_SetPriority(I2C2_IRQn,ans);
+	NVIC_ClearPendingIRQ(I2C2_IRQn);
+	NVIC_EnableIRQ(I2C2_IRQn);
+
+	//SSP1 DMA engine at the same level, it only moves chip selects between transfers
+	PG=5, PP=0b11, SP=0b010;
+	ans = NVIC_EncodePriority(PG,PP,SP);
+	NVIC_SetPriority(DMA_IRQn,ans);
+	NVIC_ClearPendingIRQ(DMA_IRQn);
+	NVIC_EnableIRQ(DMA_IRQn);
+
 	//Lowest priority given to UART3 interrupt handler
 	PG=5, PP=0b11, SP=0b011;
 	ans = NVIC_EncodePriority(PG,PP,SP);
@@ -796,172 +4059,561 @@ void priority_init(){
 	NVIC_EnableIRQ(UART3_IRQn);
 	// Configure UART3 to enable RBR (Receiver Buffer Register) Interrupt
 	UART_IntConfig(LPC_UART3, UART_INTCFG_RBR, ENABLE);
+	// Configure UART3 to enable THRE (TX FIFO empty) Interrupt to drain uart_tx_buf
+	UART_IntConfig(LPC_UART3, UART_INTCFG_THRE, ENABLE);
 }
 
 void passive_init(){
-	Sensors_Read();
+	Sensors_Read(OLED_Update);
 	OLED_Update_PASSIVE();
-	OLED_Update();
-	Date_Flag = false;
+	BOOT_MARK(BOOT_MARK_PASSIVE);
 	Waste_Flag = false;
 	Algae_Flag = false;
-	SW4 = false;
+	tlm_batch_live = 0;								//detections start over, the next one is new to SAFE
+	TRACE_MODE('P');
+#ifdef LIGHT_IRQ_MODE
+	light_irq_enable(true);
+#endif
 
 	//Send msg to SAFE upon entering PASSIVE Mode
 	UART_msg = "Entering PASSIVE Mode. \r\n";
-	UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
+	tlm_queue_text(TLM_CLASS_MODE, UART_msg);
 
 	return;
 }
 
 void charge_init(){
 	//initialize CHARGE mode
-	GPIO_ClearValue( 2, 1);			//turn off red led
-	GPIO_ClearValue( 0, (1<<26) );	//turn off blue led
-	led7seg_setChar('C', TRUE); 	//Show a 'C' on 7 segment display
-	oled_clearScreen(OLED_COLOR_BLACK);
+	rgb_write(false, false);		//turn off red and blue led
+	led7seg_write('C', TRUE); 	//Show a 'C' on 7 segment display
+	fb_clearScreen(OLED_COLOR_BLACK);
+	biofuel_layout_load();
 	place_biofuel();
+	TRACE_MODE('C');
 
 	//Send msg to SAFE upon entering CHARGE Mode
 	UART_msg = "Leaving PASSIVE Mode. Entering CHARGE Mode. \r\n";
-	UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
+	tlm_queue_text(TLM_CLASS_MODE, UART_msg);
 
 	return;
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // 3 Main Modes loop
+// Each mode registers its periodic work as scheduler tasks and sleeps
+// in sched_run() until something is due. Tasks and mode loops only post
+// MODE_EV_* events, the mode state machine below changes mode.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define MODE_EV_SW4				0				//start, or DATE mode from PASSIVE
+#define MODE_EV_ROTARY			1				//rotary switch turned 4 times in PASSIVE mode
+#define MODE_EV_HARVESTED		2				//every biofuel harvested
+#define MODE_EV_GIVE_UP			3				//EXIT raised in CHARGE mode
+#define MODE_EV_DATE_DONE		4				//LED array counted down
+#define MODE_EVENTS				5
+
+static void mode_post(uint8_t ev, uint32_t at);
+
+static int ssd_index = 0;							//next char to show on 7 segment display
+static int rotary_count = 0;						//rotations seen towards CHARGE mode
+static uint32_t rotary_at = 0;						//sched_cycles() of the 4th rotation
+static int date_steps = 0;
+
+#ifdef SW4_IMMEDIATE
+static bool sw4_down = true;						//a press held from before PASSIVE mode does not count
+#else
+static bool sw4_pressed = false;					//DATE mode once 'F' has been shown
+static bool sw4_next = false;						//pressed while 'F' was showing, counts for the next round
+static bool date_due = false;						//passive_ssd_task posts MODE_EV_SW4 at the end of 'F'
+static uint32_t sw4_at = 0;							//sched_cycles() of the press that asked for DATE mode
+#endif
+
+static const char ssd_chars[16] = {'0','1','2','3','4','5','6','7','8','9','A','8','C','0','E','F'};
+
+//SW4 is default pulled HIGH, LOW when pushed
+static bool sw4_read(void){
+	return !((GPIO_ReadValue(1) >> 31) & 0x01);
+}
 
-void CHARGE(){
-	uint8_t state = 0;
-	int initial_time_Joystick = getTicks();
-	int arr[16] ={0};
+//Wait for the first SW4 press
+static void idle_run(void){
+	led7seg_write(' ', FALSE);
+	if (sw4_read()){
+		mode_post(MODE_EV_SW4, sched_cycles());
+	}
+	sched_idle();									//Sleep until next SysTick
+}
 
-	FULL = false;
-	EXIT = false;
-	charge_init();
+#ifdef SW4_IMMEDIATE
+//Every SW4 press asks for DATE mode right away
+static void passive_sw4_poll(void){
+	bool down = sw4_read();
 
-	while(!FULL){
-		state = joystick_read();
+	if (down && !sw4_down){
+		mode_post(MODE_EV_SW4, sched_cycles());
+	}
+	sw4_down = down;
+}
+#else
+//A SW4 press asks for DATE mode once the 7 segment display has shown 'F'
+static void passive_sw4_poll(void){
+	if (sw4_next && (ssd_index != 16)){
+		sw4_pressed = true;
+		sw4_next = false;
+	}
 
-		//Draw line if joystick is used
-		if(check_time(JOYSTICK_TIME_UNIT, &initial_time_Joystick)){
-			if ((state != 0)){
-				drawOled(state, arr);
-			}
+	if (sw4_read()){
+		if (!sw4_pressed && !sw4_next){
+			sw4_at = sched_cycles();				//the wait is counted from the first press
 		}
-		//Draw line if keyboard is used
-		if (uartGet){
-			drawOled(0, arr);
+		if (ssd_index != 16){						//If SW4 is pressed when led7seg does not shows 'F'
+			sw4_pressed = true;
 		}
+		else {										//SW4 was pressed when led7seg shows 'F'
+			sw4_next = true;						//Update SW4 Flag in the next cycle
+		}
+	}
+	else if (sw4_pressed && (ssd_index == 16)){		//SW4 was pressed before and 7 Segment Display shows 'F'
+		date_due = true;
+		sw4_pressed = false;
+	}
+}
+#endif
+
+//Draw line while the joystick is held, releasing it stops the cursor
+static void charge_joystick_task(void){
+	uint8_t joy = joystick_read();
+
+	TRACE_JOY(joy);
+	drawOled(joy);
+}
 
-		//check if finish harvesting
-		check_harvested();
-		//check if exit is pressed
-		check_exit();
+static void charge_run(void){
+	BENCH_LOOP_BEGIN();
+	sched_run();
+
+	//Draw line for every command typed on the keyboard
+	charge_uart_input();
+
+	//check if finish harvesting, or if exit is pressed
+	if (harvested == biofuel_count){
+		mode_post(MODE_EV_HARVESTED, sched_cycles());
 	}
+	else if (EXIT){
+		mode_post(MODE_EV_GIVE_UP, sched_cycles());
+	}
+	BENCH_LOOP_END();
 }
 
-void PASSIVE(){
-	int i = 0;
-	int detected = 0;
-	int initial_time_SSD = getTicks();
-	int initial_time_RGB = getTicks();
-	int count = 0;
+static void charge_enter(void){
+	//Enable UART3 keyboard input to be used in CHARGE Mode
+	uart_rx_enable(true);
+	EXIT = false;
+	uart_cmd_repeat = 0;
+	cursor_dir = 0;
+	charge_init();
 
-	char array[16] = {'0','1','2','3','4','5','6','7','8','9','A','8','C','0','E','F'};
+	sched_clear();
+	sched_add(charge_joystick_task, JOYSTICK_TIME_UNIT, JOYSTICK_TIME_UNIT);
+}
 
-	Date_Flag = false;
-	Waste_Flag = false;
-	Algae_Flag = false;
-	SW4 = false;
+static void charge_exit(void){
+	//Disable UART3 keyboard input since it is not needed anymore
+	uart_rx_enable(false);
+	harvested = 0;
+	led_array_write(0);								//turn off LED array
+	BENCH_REPORT("CHARGE");
+}
 
-	//Disable UART3 interrupt handler since it is not used yet
-	NVIC_ClearPendingIRQ(UART3_IRQn);
-	NVIC_DisableIRQ(UART3_IRQn);
+//CHARGE mode ends with every biofuel harvested
+static void charge_harvested(void){
+	//Send msg to SAFE upon fully harvested
+	UART_msg = "Biofuels fully harvested. Leaving CHARGE mode. \r\n";
+	tlm_queue_text(TLM_CLASS_MODE, UART_msg);
+	OLED_Update_CHARGE();
+}
 
-	while (!Date_Flag){
-		passive_init();
-
-		while(1){
-			MODE_TOGGLE(i);										//checks if need to go to DATE mode
-			MODE_TOGGLE_Charge(&count);							//checks if need to go to CHARGE mode
-
-			//in CHARGE Mode
-			while(Charge_Flag){
-				//Enable UART3 interrupt handler to be used in CHARGE Mode
-				NVIC_ClearPendingIRQ(UART3_IRQn);
-				NVIC_EnableIRQ(UART3_IRQn);
-
-				CHARGE();
-				//Exited CHARGE Mode
-				Charge_Flag = false;
-				passive_init();
-				i = 0;
-				break;											//Go out of the loop and restart PASSIVE mode
-			}
+//CHARGE mode ends on EXIT
+static void charge_give_up(void){
+	//Send msg to SAFE upon CHARGE mode exit trigger
+	UART_msg = "Giving up on harvesting. Leaving CHARGE Mode. \r\n";
+	tlm_queue_text(TLM_CLASS_MODE, UART_msg);
+	OLED_Update_EXIT();
+}
 
-			if (check_time(SSD_TIME_UNIT, &initial_time_SSD)){	//Wait 1 second before updating 7 segment display
-
-				if ((i == 5)||(i == 10)||(i == 15)){			//7 Segment Display showing '5', 'A', or 'F'
-					Sensors_Read();
-					OLED_Update();
-					if(i == 15){								//7 Segment Display showing 'F'
-						send_status_SAFE();						//Send msg to SAFE via UART
-						send_to_SAFE();
-					}
-				}
-				if(i == 16){									//restart 7 Segment Display from '0'
-					i = 0;
-				}
-				if (Date_Flag){									//Go out of loop and exit PASSIVE mode, go to DATE();
-					break;
-				}
-				led7seg_setChar(array[i], TRUE);				//Update 7 Segment Display
-				i++;
-			}
+//Checks if need to go to DATE mode or CHARGE mode
+static void passive_input_task(void){
+	passive_sw4_poll();
 
-			if (check_time(RGB_BLINK_TIME, &initial_time_RGB)){						//Wait 333ms before blinking any RGB LED
-				detected = detection_case(check_Waste(light), check_Algae(light));
-				blink_LED_PASSIVE(detected);
-			}
+	if (rotary_count > 3){
+		rotary_count = 0;
+		mode_post(MODE_EV_ROTARY, rotary_at);
+	}
+	else if (rotary_read() == 1){					//triggers when rotary switch is rotated
+		if (++rotary_count > 3){
+			rotary_at = sched_cycles();
 		}
 	}
 }
 
-void DATE(){
-	int steps = 0;
-	int initial_time_LED = getTicks();
+//Sensor values for '5' and 'A' are in
+static void passive_sensors_show(void){
+	OLED_Update();
+}
+
+//Sensor values for 'F' are in
+static void passive_sensors_report(void){
+	BENCH_SPAN_BEGIN();
+	OLED_Update();
+	send_status_SAFE();												//Send msg to SAFE via UART
+	send_to_SAFE();
+	BENCH_SPAN_END(BENCH_SPAN_F_REPORT);
+}
+
+//Update 7 segment display every second
+static void passive_ssd_task(void){
+	if (tlm_batch_expired(&tlm_batch)){								//no record came to fill it, eg. while the flash log holds
+		send_batch_SAFE();
+	}
+	if ((ssd_index == 5)||(ssd_index == 10)){						//7 Segment Display showing '5' or 'A'
+		Sensors_Read(passive_sensors_show);
+	}
+	if (ssd_index == 15){											//7 Segment Display showing 'F'
+		Sensors_Read(passive_sensors_report);
+	}
+	if(ssd_index == 16){											//restart 7 Segment Display from '0'
+		ssd_index = 0;
+	}
+#ifndef SW4_IMMEDIATE
+	if (date_due){													//'F' is over, go to DATE mode
+		date_due = false;
+		mode_post(MODE_EV_SW4, sw4_at);
+		return;
+	}
+#endif
+	led7seg_write(ssd_chars[ssd_index], TRUE);					//Update 7 Segment Display
+	ssd_index++;
+}
+
+//Blink RGB LED every 333ms
+static void passive_rgb_task(void){
+#ifdef LIGHT_IRQ_MODE
+	int detected = detection_case(Waste_Flag, Algae_Flag);		//raised by the light sensor interrupt
+#else
+	int detected = detection_case(check_Waste(light), check_Algae(light));
+#endif
 
-	Passive_Flag = false;
-	GPIO_ClearValue( 2, 1);			//turn off red led
-	GPIO_ClearValue( 0, (1<<26) );	//turn off blue led
+	blink_LED_PASSIVE(detected);
+}
+
+static void passive_run(void){
+	BENCH_LOOP_BEGIN();
+	sched_run();
+	BENCH_LOOP_END();
+}
+
+static void passive_enter(void){
+	ssd_index = 0;
+	rotary_count = 0;
+#ifdef SW4_IMMEDIATE
+	sw4_down = true;
+#else
+	sw4_pressed = false;
+	sw4_next = false;
+	date_due = false;
+#endif
+
+	//Disable UART3 keyboard input since it is not used yet
+	uart_rx_enable(false);
+
+	sched_clear();
+	sched_add(passive_input_task, 0, INPUT_POLL_TIME_UNIT);
+	sched_add(passive_ssd_task, SSD_TIME_UNIT, SSD_TIME_UNIT);
+	sched_add(passive_rgb_task, RGB_BLINK_TIME, RGB_BLINK_TIME);
+	passive_init();
+}
+
+static void passive_exit(void){
+#ifdef LIGHT_IRQ_MODE
+	light_irq_enable(false);
+#endif
+	send_batch_SAFE();
+	BENCH_REPORT("PASSIVE");
+}
+
+//Sensor values asked for by SW3 are in
+static void date_sensors_ready(void){
+	OLED_Update();
+	send_to_SAFE();													//Send sensor values to SAFE via UART
+	send_batch_SAFE();												//asked for now, not with the next batch
+}
+
+//Turn off next LED in the LED array every 208ms
+static void date_led_task(void){
+	date_steps++;
+	if (date_steps == 17){							//All LED off in LED Array, exit DATE mode, go to PASSIVE
+		mode_post(MODE_EV_DATE_DONE, sched_cycles());
+		return;
+	}
+	Decrease_LED_array(date_steps);
+}
+
+static void date_run(void){
+	BENCH_LOOP_BEGIN();
+	sched_run();
+
+	if(SW3){															//Checks if SW3 EINT is triggered
+		GET_INFORMATION(date_sensors_ready);							//Read sensors, update OLED and SAFE
+	}
+	BENCH_LOOP_END();
+}
+
+static void date_enter(void){
+	TRACE_MODE('D');
+	rgb_write(false, false);		//turn off red and blue led
 
 	//Send msg to SAFE upon entering DATE Mode
 	UART_msg = "Leaving PASSIVE Mode. Entering DATE Mode. \r\n";
-	UART_Send(LPC_UART3, (uint8_t *)UART_msg, strlen(UART_msg), BLOCKING);
-
-	while(!Passive_Flag){
-		steps = 0;
-		led7seg_setChar(' ', FALSE); 	//turn of 7 segment display
-		OLED_Update_DATE();
-
-		while(1){
-			Decrease_LED_array(steps);
-			if(check_time(INDICATOR_TIME_UNIT, &initial_time_LED)){				//Wait for 208ms to turn off need LED in the LED array
-				steps++;
-				if(steps == 17){												//All LED off in LED Array
-					Passive_Flag = true;
-					break;														//Break out of loop and exit DATE mode, go to PASSIVE();
-				}
-			}
-			if(SW3){															//Checks if SW3 EINT is triggered
-				GET_INFORMATION();												//Read sensors and update OLED
-				send_to_SAFE();													//Send sensor values to SAFE via UART
+	tlm_queue_text(TLM_CLASS_MODE, UART_msg);
+
+	date_steps = 0;
+	led7seg_write(' ', FALSE); 	//turn of 7 segment display
+	OLED_Update_DATE();
+	Decrease_LED_array(date_steps);
+
+	sched_clear();
+	sched_add(date_led_task, INDICATOR_TIME_UNIT, INDICATOR_TIME_UNIT);
+}
+
+static void date_exit(void){
+	send_batch_SAFE();
+	BENCH_REPORT("DATE");
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Mode state machine
+// mode_states[] is a tree: a state with children is entered through its
+// initial child and the current state is always a leaf. An event is looked
+// up in mode_transitions[] for the current state first, then for the states
+// it is in, unmatched events are counted and dropped. A transition exits
+// from the current state up to the state it shares with the target, runs
+// the action, then enters down to the target and its initial children.
+// Events queue up in mode_queue[] and main() dispatches them after each
+// pass of the mode loop, never from inside a task.
+// Every transition records the time from the input that caused it (the SW4
+// press, the 4th rotation, the last LED...) to the end of the entry actions
+// in mode_stats[]. Without SW4_IMMEDIATE the SW4 press waits for 'F' to be
+// over, up to 17 s, and that wait shows up in PASSIVE>DATE.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define MODE_QUEUE_SIZE			4					//must be a power of 2
+
+typedef struct {
+	const char *name;
+	uint8_t parent;					//MODE_NONE at the top
+	uint8_t initial;				//child entered with it, MODE_NONE for a leaf
+	void (*enter)(void);			//may be NULL
+	void (*exit)(void);				//may be NULL
+	void (*run)(void);				//one pass of the mode loop, leaves only
+} MODE_STATE;
+
+typedef struct {
+	uint8_t state;					//the current state or one it is in
+	uint8_t event;
+	uint8_t target;
+	void (*action)(void);			//after the exits, before the entries, may be NULL
+} MODE_TRANSITION;
+
+typedef struct {
+	uint8_t event;
+	uint32_t at;					//sched_cycles() of the input
+} MODE_EVENT;
+
+typedef struct {
+	uint32_t count;
+	uint32_t latency_max;			//input to the end of the entry actions, cycles
+	uint64_t latency_sum;
+} MODE_STATS;
+
+static const MODE_STATE mode_states[MODE_STATES] = {
+	[MODE_IDLE]		= {"IDLE",		MODE_NONE,	MODE_NONE,		NULL,			NULL,			idle_run},
+	[MODE_RUN]		= {"RUN",		MODE_NONE,	MODE_PASSIVE,	NULL,			NULL,			NULL},
+	[MODE_PASSIVE]	= {"PASSIVE",	MODE_RUN,	MODE_NONE,		passive_enter,	passive_exit,	passive_run},
+	[MODE_DATE]		= {"DATE",		MODE_RUN,	MODE_NONE,		date_enter,		date_exit,		date_run},
+	[MODE_CHARGE]	= {"CHARGE",	MODE_RUN,	MODE_NONE,		charge_enter,	charge_exit,	charge_run},
+};
+
+static const char *mode_event_names[MODE_EVENTS] = {
+	[MODE_EV_SW4]		= "SW4",
+	[MODE_EV_ROTARY]	= "ROTARY",
+	[MODE_EV_HARVESTED]	= "HARVESTED",
+	[MODE_EV_GIVE_UP]	= "GIVE_UP",
+	[MODE_EV_DATE_DONE]	= "DATE_DONE",
+};
+
+static const MODE_TRANSITION mode_transitions[] = {
+	{MODE_IDLE,		MODE_EV_SW4,		MODE_RUN,		NULL},
+	{MODE_PASSIVE,	MODE_EV_SW4,		MODE_DATE,		NULL},
+	{MODE_PASSIVE,	MODE_EV_ROTARY,		MODE_CHARGE,	NULL},
+	{MODE_CHARGE,	MODE_EV_HARVESTED,	MODE_PASSIVE,	charge_harvested},
+	{MODE_CHARGE,	MODE_EV_GIVE_UP,	MODE_PASSIVE,	charge_give_up},
+	{MODE_DATE,		MODE_EV_DATE_DONE,	MODE_PASSIVE,	NULL},
+};
+
+#define MODE_TRANSITIONS		(sizeof(mode_transitions) / sizeof(mode_transitions[0]))
+
+static MODE_EVENT mode_queue[MODE_QUEUE_SIZE];
+static uint32_t mode_queue_head = 0;				//only main loop and tasks touch the queue
+static uint32_t mode_queue_tail = 0;
+
+MODE_STATS mode_stats[MODE_TRANSITIONS];
+uint32_t mode_ignored = 0;							//events with no transition from the current state
+uint32_t mode_dropped = 0;							//events lost because the queue was full
+
+void mode_stats_reset(void){
+	memset(mode_stats, 0, sizeof(mode_stats));
+	mode_ignored = 0;
+	mode_dropped = 0;
+}
+
+//Queue ev for mode_dispatch(), at is sched_cycles() of the input behind it
+static void mode_post(uint8_t ev, uint32_t at){
+	MODE_EVENT *e;
+
+	if ((mode_queue_head - mode_queue_tail) == MODE_QUEUE_SIZE){
+		mode_dropped++;
+		return;
+	}
+	e = &mode_queue[mode_queue_head & (MODE_QUEUE_SIZE - 1)];
+	e->event = ev;
+	e->at = at;
+	mode_queue_head++;
+}
+
+//Levels of states above s
+static int mode_depth(uint8_t s){
+	int depth = 0;
+
+	while (mode_states[s].parent != MODE_NONE){
+		s = mode_states[s].parent;
+		depth++;
+	}
+	return depth;
+}
+
+//Transition for ev from the current state, NULL if there is none
+static const MODE_TRANSITION *mode_find(uint8_t ev){
+	uint8_t s;
+	uint32_t i;
+
+	for (s = mode_state; s != MODE_NONE; s = mode_states[s].parent){
+		for (i = 0; i < MODE_TRANSITIONS; i++){
+			if ((mode_transitions[i].state == s) && (mode_transitions[i].event == ev)){
+				return &mode_transitions[i];
 			}
 		}
 	}
+	return NULL;
+}
+
+static void mode_exit(uint8_t s){
+	if (mode_states[s].exit != NULL){
+		mode_states[s].exit();
+	}
+}
+
+static void mode_enter(uint8_t s){
+	mode_state = s;
+	if (mode_states[s].enter != NULL){
+		mode_states[s].enter();
+	}
+}
+
+//Take transition t for an input at sched_cycles() at
+static void mode_transition(const MODE_TRANSITION *t, uint32_t at){
+	MODE_STATS *stat = &mode_stats[t - mode_transitions];
+	uint8_t path[MODE_STATES];						//states to enter, innermost first
+	uint8_t from = mode_state;
+	uint8_t to = t->target;
+	int from_depth = mode_depth(from);
+	int to_depth = mode_depth(to);
+	int n = 0;
+	uint32_t latency;
+
+	//Exit up to the state both sides are in
+	while (from_depth > to_depth){
+		mode_exit(from);
+		from = mode_states[from].parent;
+		from_depth--;
+	}
+	while (to_depth > from_depth){
+		path[n++] = to;
+		to = mode_states[to].parent;
+		to_depth--;
+	}
+	while (from != to){
+		mode_exit(from);
+		from = mode_states[from].parent;
+		path[n++] = to;
+		to = mode_states[to].parent;
+	}
+
+	if (t->action != NULL){
+		t->action();
+	}
+
+	while (n > 0){
+		to = path[--n];
+		mode_enter(to);
+	}
+	while (mode_states[to].initial != MODE_NONE){
+		to = mode_states[to].initial;
+		mode_enter(to);
+	}
+
+	latency = sched_cycles() - at;
+	stat->count++;
+	stat->latency_sum += latency;
+	if (latency > stat->latency_max){
+		stat->latency_max = latency;
+	}
+}
+
+#ifdef BENCH
+//Part of bench_report(), the transitions since the last report
+static void mode_bench_report(const char *mode){
+	char line[160];
+	const MODE_TRANSITION *t;
+	uint32_t i;
+
+	for (i = 0; i < MODE_TRANSITIONS; i++){
+		t = &mode_transitions[i];
+		sprintf(line, "bench mode=%s transition=%s>%s event=%s count=%lu latency_mean=%lu latency_max=%lu\r\n", mode,
+				mode_states[t->state].name, mode_states[t->target].name, mode_event_names[t->event],
+				(unsigned long)mode_stats[i].count,
+				(unsigned long)(mode_stats[i].count ? mode_stats[i].latency_sum / mode_stats[i].count : 0),
+				(unsigned long)mode_stats[i].latency_max);
+		uart_tx_print(line);
+	}
+	sprintf(line, "bench mode=%s mode_events ignored=%lu dropped=%lu\r\n", mode,
+			(unsigned long)mode_ignored, (unsigned long)mode_dropped);
+	uart_tx_print(line);
+}
+#endif
+
+//Handle the queued events in order
+static void mode_dispatch(void){
+	const MODE_TRANSITION *t;
+	MODE_EVENT e;
+
+	while (mode_queue_tail != mode_queue_head){
+		e = mode_queue[mode_queue_tail & (MODE_QUEUE_SIZE - 1)];
+		mode_queue_tail++;
+		t = mode_find(e.event);
+		if (t == NULL){
+			mode_ignored++;
+			continue;
+		}
+		mode_transition(t, e.at);
+	}
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -1002,6 +4654,30 @@ static void init_GPIO(void)
 	PINSEL_ConfigPin(&PinCfg);
 	GPIO_SetDir(2, 1<<10, 0);				//Set as Input
 
+#ifdef ACC_MOTION_MODE
+	//Accelerometer INT1
+	//Wired to P0.3
+	PinCfg.Portnum = 0;
+	PinCfg.Pinnum = 3;
+	PinCfg.Funcnum = 0;
+	PinCfg.OpenDrain = 0;
+	PinCfg.Pinmode = 0;
+	PINSEL_ConfigPin(&PinCfg);
+	GPIO_SetDir(0, 1<<3, 0);				//Set as Input
+#endif
+
+#ifdef LIGHT_IRQ_MODE
+	//Light Sensor INT, pulled up
+	//Use PIO2_5 -> P2.5
+	PinCfg.Portnum = 2;
+	PinCfg.Pinnum = 5;
+	PinCfg.Funcnum = 0;
+	PinCfg.OpenDrain = 0;
+	PinCfg.Pinmode = 0;
+	PINSEL_ConfigPin(&PinCfg);
+	GPIO_SetDir(2, 1<<5, 0);				//Set as Input
+#endif
+
 	//RED LED
 	//Use PIO1_9 -> P2.0
 	PinCfg.Portnum = 2;
@@ -1087,7 +4763,7 @@ static void init_i2c(void)
 	PinCfg.Pinnum = 11;
 	PINSEL_ConfigPin(&PinCfg);
 
-	I2C_Init(LPC_I2C2, 100000);
+	I2C_Init(LPC_I2C2, I2C_CLOCK_RATE);
 	I2C_Cmd(LPC_I2C2, ENABLE);
 }
 
@@ -1103,6 +4779,7 @@ void pinsel_uart3 (void) {
 
 void init_uart (void) {
 	UART_CFG_Type uartCfg;
+	UART_FIFO_CFG_Type fifoCfg;
 	uartCfg.Baud_rate = 115200;
 	uartCfg.Databits = UART_DATABIT_8;
 	uartCfg.Parity = UART_PARITY_NONE;
@@ -1111,65 +4788,275 @@ void init_uart (void) {
 	pinsel_uart3();
 	//supply power & setup working par.s for uart3
 	UART_Init(LPC_UART3, &uartCfg);
+	//RX interrupt every 8 chars, character timeout picks up the rest
+	UART_FIFOConfigStructInit(&fifoCfg);
+	fifoCfg.FIFO_Level = UART_FIFO_TRGLEV2;
+	UART_FIFOConfig(LPC_UART3, &fifoCfg);
 	//enable transmit for uart3
 	UART_TxCmd(LPC_UART3, ENABLE);
 }
 
-//=============================================================================
-// Main Function
-//=============================================================================
-int main (void) {
+//Average of ACC_CAL_SAMPLES readings, rounded to nearest
+static int8_t acc_cal_avg(int32_t sum){
+	return (sum >= 0) ? (sum + ACC_CAL_SAMPLES/2) / ACC_CAL_SAMPLES : (sum - ACC_CAL_SAMPLES/2) / ACC_CAL_SAMPLES;
+}
+
+static int32_t acc_cal_sum[3];
+static int acc_cal_count = 0;
+
+//Take one calibration reading, then run again ACC_CAL_INTERVAL later until all are in
+static void acc_cal_task(void){
+	i2c_suspend();					//acc_read polls I2C2 itself
+	acc_read(&x, &y, &z);
+	i2c_resume();
+	acc_cal_sum[0] += x;
+	acc_cal_sum[1] += y;
+	acc_cal_sum[2] += z;
+	if (++acc_cal_count < ACC_CAL_SAMPLES){
+		sched_add(acc_cal_task, ACC_CAL_INTERVAL, 0);
+		return;
+	}
+	xoff = 0-acc_cal_avg(acc_cal_sum[0]);
+	yoff = 0-acc_cal_avg(acc_cal_sum[1]);
+	zoff = 0-acc_cal_avg(acc_cal_sum[2]);
+}
+
+//Zero-g offsets from several readings so one noisy sample does not skew every later one
+//Readings are taken in the background, acc_calibrated() tells when the offsets are set
+static void acc_calibrate(void){
+	acc_cal_sum[0] = acc_cal_sum[1] = acc_cal_sum[2] = 0;
+	acc_cal_count = 0;
+	sched_add(acc_cal_task, 0, 0);
+}
+
+static bool acc_calibrated(void){
+	return acc_cal_count == ACC_CAL_SAMPLES;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Boot sequence
+// Peripherals are brought up from boot_stages[]. A stage starts as soon as
+// the stages it needs are done, in table order. One that has to wait for
+// its device (accelerometer calibration readings, the light sensor's first
+// conversion) reports done through ready() later; meanwhile the stages that
+// do not need it run, and the scheduler runs due tasks or sleeps when no
+// stage can start. Slow stages come first in the table so their waits
+// overlap everything else, and TIMER0 and EINT3 are up early so the first
+// temperature window starts right away.
+// Stages that call the polled baseboard I2C drivers need "irq" and hold the
+// bus with i2c_suspend()/i2c_resume(), as the I2C2 engine requires.
+// With BOOT_SEQUENTIAL a stage also waits for every stage before it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define BOOT_TIMER				0
+#define BOOT_GPIO				1
+#define BOOT_SYSTICK			2
+#define BOOT_UART				3
+#define BOOT_IRQ				4
+#define BOOT_I2C				5
+#define BOOT_LIGHT				6
+#define BOOT_ACC				7
+#define BOOT_ACC_CAL			8
+#define BOOT_SSP				9
+#define BOOT_DMA				10
+#define BOOT_OLED				11
+#define BOOT_LED7SEG			12
+#define BOOT_SCREEN				13
+#define BOOT_NEEDS(stage)		(1u << (stage))
+
+typedef struct {
+	const char *name;
+	void (*start)(void);
+	bool (*ready)(void);			//NULL if the stage is done when start() returns
+	uint32_t needs;					//BOOT_NEEDS() of stages that must be done first
+} BOOT_STAGE;
+
+static void boot_timer(void){
+	init_timer();
+#ifdef TEMP_CAPTURE_MODE
+	init_temp_capture();
+#endif
+}
+
+static void boot_systick(void){
+	SysTick_Config(SystemCoreClock/1000);
 
-    init_i2c();
-    init_ssp();
-    init_GPIO();
-    init_uart();
-
-    pca9532_init();
-    joystick_init();
-    acc_init();
-    oled_init();
-    led7seg_init();
-    light_init();
-    light_enable();
-    rotary_init();
-    init_timer();
-    SysTick_Config(SystemCoreClock/1000);
-    priority_init();
+#if defined(TEMP_ISR_BENCH) || defined(BENCH) || ISR_PROFILE || defined(FLASH_LOG)
+	//Start the DWT cycle counter used to time the temperature calculation, benchmarks, ISR profile and flash writes
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+static void boot_irq(void){
+	priority_init();
 
 	// Enable GPIO Interrupt P2.10 (Falling edge)
 	LPC_GPIOINT->IO2IntEnF |= 1<<10;
+#ifdef ACC_MOTION_MODE
+	// Enable GPIO Interrupt P0.3 (Rising edge), accelerometer INT1 is active high
+	LPC_GPIOINT->IO0IntEnR |= 1<<3;
+	LPC_GPIOINT->IO0IntClr = 1<<3;
+#endif
+#ifdef LIGHT_IRQ_MODE
+	// Enable GPIO Interrupt P2.5 (Falling edge), light sensor INT is open drain, active low
+	LPC_GPIOINT->IO2IntEnF |= 1<<5;
+	LPC_GPIOINT->IO2IntClr = 1<<5;
+#endif
+#ifndef TEMP_CAPTURE_MODE
 	// Enable GPIO Interrupt P0.2  (Rising edge)
 	LPC_GPIOINT->IO0IntEnR |= 1<<2;
+#endif
 
 	// Clear GPIO Interrupt P2.10
 	LPC_GPIOINT->IO2IntClr = 1<<10;
 	// Clear GPIO Interrupt P0.2
 	LPC_GPIOINT->IO0IntClr = 1<<2;
+}
 
-    /*
-	* Assume base board in zero-g position when reading first value.
-	* Setup board for clean slate
-	*/
-	acc_read(&x, &y, &z);
-	xoff = 0-x;
-	yoff = 0-y;
-	zoff = 0-z;
+static uint32_t boot_light_on = 0;					//ms light_enable() was called
 
-    oled_clearScreen(OLED_COLOR_BLACK);
-	GPIO_ClearValue( 2, 1);			//turn off red led
-	GPIO_ClearValue( 0, (1<<26) );	//turn off blue led
+//The baseboard drivers poll I2C2, priority_init() has already enabled I2C2_IRQn
+static void boot_light(void){
+	i2c_suspend();
+	light_init();
+	light_enable();
+	i2c_resume();
+	boot_light_on = getTicks();
+}
 
-    while (1){
+//First conversion is in, Sensors_Read() would get 0 lux before that
+static bool boot_light_ready(void){
+	return (getTicks() - boot_light_on) >= LIGHT_CONVERSION_MS;
+}
+
+static void boot_acc(void){
+	i2c_suspend();
+	acc_init();
+	i2c_resume();
+}
+
+static void boot_pca9532(void){
+	i2c_suspend();
+	pca9532_init();
+	i2c_resume();
+}
+
+static void boot_screen(void){
+	fb_invalidate();				//panel RAM is undefined after oled_init()
+	fb_clearScreen(OLED_COLOR_BLACK);
+	fb_flush();
+	rgb_write(false, false);		//turn off red and blue led
+}
+
+static const BOOT_STAGE boot_stages[] = {
+	{"timer",	boot_timer,		NULL,				0},
+	{"gpio",	init_GPIO,		NULL,				0},
+	{"systick",	boot_systick,	NULL,				0},
+	{"uart",	init_uart,		NULL,				0},
+	{"irq",		boot_irq,		NULL,				BOOT_NEEDS(BOOT_TIMER) | BOOT_NEEDS(BOOT_GPIO) | BOOT_NEEDS(BOOT_SYSTICK) | BOOT_NEEDS(BOOT_UART)},
+	{"i2c",		init_i2c,		NULL,				0},
+	{"light",	boot_light,		boot_light_ready,	BOOT_NEEDS(BOOT_I2C) | BOOT_NEEDS(BOOT_IRQ)},
+	{"acc",		boot_acc,		NULL,				BOOT_NEEDS(BOOT_I2C) | BOOT_NEEDS(BOOT_IRQ)},
+	{"acc_cal",	acc_calibrate,	acc_calibrated,		BOOT_NEEDS(BOOT_ACC) | BOOT_NEEDS(BOOT_IRQ)},
+	{"ssp",		init_ssp,		NULL,				0},
+	{"dma",		ssp_dma_init,	NULL,				BOOT_NEEDS(BOOT_SSP)},
+	{"oled",	oled_init,		NULL,				BOOT_NEEDS(BOOT_SSP) | BOOT_NEEDS(BOOT_GPIO)},
+	{"led7seg",	led7seg_init,	NULL,				BOOT_NEEDS(BOOT_SSP)},
+	{"screen",	boot_screen,	NULL,				BOOT_NEEDS(BOOT_OLED) | BOOT_NEEDS(BOOT_DMA) | BOOT_NEEDS(BOOT_IRQ)},
+	{"pca9532",	boot_pca9532,	NULL,				BOOT_NEEDS(BOOT_I2C) | BOOT_NEEDS(BOOT_IRQ)},
+	{"joystick",joystick_init,	NULL,				0},
+	{"rotary",	rotary_init,	NULL,				0},
+#ifdef FLASH_LOG
+	{"flog",	flog_init,		NULL,				0},	//pick up records a previous run could not send
+#endif
+};
+
+#define BOOT_STAGES				(sizeof(boot_stages) / sizeof(boot_stages[0]))
+
+//Run every stage, returns once all are done
+static void boot_run(void){
+	uint32_t all = (1u << BOOT_STAGES) - 1;
+	uint32_t started = 0;
+	uint32_t done = 0;
+	uint32_t i, bit;
+	bool ran;
+
+	while (done != all){
+		for (i = 0; i < BOOT_STAGES; i++){
+			bit = 1u << i;
+			if ((started & bit) && !(done & bit) && ((boot_stages[i].ready == NULL) || boot_stages[i].ready())){
+				done |= bit;
+#ifdef BOOT_PROFILE
+				boot_stage_done[i] = boot_prof_now();
+#endif
+			}
+		}
 
-		led7seg_setChar(' ', FALSE);
-		MODE_TOGGLE_Start();			//Checks when SW4 is first pressed to start program
+		//Start the first stage that can, then look at the waiting ones again
+		ran = false;
+		for (i = 0; (i < BOOT_STAGES) && !ran; i++){
+			bit = 1u << i;
+#ifdef BOOT_SEQUENTIAL
+			if (!(started & bit) && (done == bit - 1)){
+#else
+			if (!(started & bit) && ((boot_stages[i].needs & ~done) == 0)){
+#endif
+				started |= bit;
+#ifdef BOOT_PROFILE
+				boot_stage_start[i] = boot_prof_now();
+#endif
+				boot_stages[i].start();
+				ran = true;
+			}
+		}
+		if (!ran && (done != all)){
+			sched_run();						//waiting stages need SysTick, so this wakes up again
+		}
+	}
+}
+
+#ifdef BOOT_PROFILE
+//Posted by UART3_IRQHandler on the dump key
+static void boot_prof_dump(void){
+	char line[96];
+	uint32_t i;
+
+	sprintf(line, "boot reset runtime_cycles=%lu sysinit_cycles=%lu\r\n",
+			(unsigned long)boot_reset_cycles[0], (unsigned long)boot_reset_cycles[1]);
+	uart_tx_print(line);
+	for (i = 0; i < BOOT_STAGES; i++){
+		sprintf(line, "boot stage=%s start_us=%lu done_us=%lu\r\n", boot_stages[i].name,
+				(unsigned long)boot_stage_start[i], (unsigned long)boot_stage_done[i]);
+		uart_tx_print(line);
+	}
+	sprintf(line, "boot ready_us=%lu temp_us=%lu passive_us=%lu reading_us=%lu\r\n",
+			(unsigned long)boot_marks[BOOT_MARK_READY], (unsigned long)boot_marks[BOOT_MARK_TEMP],
+			(unsigned long)boot_marks[BOOT_MARK_PASSIVE], (unsigned long)boot_marks[BOOT_MARK_READING]);
+	uart_tx_print(line);
+}
+#endif
 
-		while(Start_Flag){
-			//Toggle between PASSIVE mode and DATE mode
-			PASSIVE();
-			DATE();
-    	}
+//=============================================================================
+// Main Function
+//=============================================================================
+int main (void) {
+
+#ifdef BOOT_PROFILE
+    boot_prof_start();
+#endif
+    boot_run();
+
+    sched_stats_reset();
+#ifdef BENCH
+    bench_reset();
+#endif
+    BOOT_MARK(BOOT_MARK_READY);
+
+    //IDLE until SW4 is first pressed, then between PASSIVE, DATE and CHARGE mode
+    while (1){
+		mode_states[mode_state].run();
+		mode_dispatch();
 	}
 }
 
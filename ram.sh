@@ -0,0 +1,52 @@
+#!/bin/sh
+# Where the RAM of a board build goes, to size new buffers against.
+#   ./ram.sh Debug/CARE.axf            .data/.bss symbols and the stack left
+#   ./ram.sh Debug/CARE.axf Debug      and the stack frame of each function
+# The second form reads the .su files the compiler writes with
+# -fstack-usage (add it to the MCU C Compiler miscellaneous flags).
+# A frame marked dynamic grows at run time, bounded means it has a limit.
+# The frames of a call chain add up, interrupts nest on top of the deepest
+# one: compare with what STACK_WATERMARK measures on the board.
+# TOP sets how many lines each list shows, CROSS overrides the toolchain
+# prefix (CROSS= for the host tools).
+set -e
+
+CROSS=${CROSS-arm-none-eabi-}
+TOP=${TOP:-15}
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+	echo "usage: $0 build.axf [objdir]" >&2
+	exit 1
+fi
+
+SYMS=$(mktemp)
+trap 'rm -f "$SYMS"' EXIT
+"${CROSS}nm" -S -t d --size-sort "$1" > "$SYMS"
+
+# symbols of the given nm types, largest first
+largest() {
+	awk -v types="$1" 'NF == 4 && index(types, $3) { print $2, $4 }' "$SYMS" |
+		sort -rn | head -n "$TOP" | awk -v sect="$2" '{ printf "%s %6d %s\n", sect, $1, $2 }'
+}
+
+# address of a linker symbol, empty if the image has none
+address() {
+	"${CROSS}nm" -t d "$1" | awk -v sym="$2" '$3 == sym { print $1 + 0 }'
+}
+
+largest dD .data
+largest bB .bss
+
+"${CROSS}size" -A -d "$1" | awk '$1 == ".data" || $1 == ".bss" { printf "total %s=%d\n", substr($1, 2), $2 }'
+EBSS=$(address "$1" _ebss)
+TOPOFSTACK=$(address "$1" _vStackTop)
+if [ -n "$EBSS" ] && [ -n "$TOPOFSTACK" ]; then
+	echo "total stack=$((TOPOFSTACK - EBSS)) (_ebss to _vStackTop)"
+fi
+
+if [ $# -eq 2 ]; then
+	# file:line:col:function  bytes  static|dynamic|dynamic,bounded
+	find "$2" -name '*.su' -exec cat {} + |
+		awk -F '\t' '{ n = split($1, f, ":"); printf "%d %s %s\n", $2, f[n], $3 }' |
+		sort -rn | head -n "$TOP" | awk '{ printf "stack %6d %s %s\n", $1, $2, $3 }'
+fi
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Build the host simulator with BENCH counters and run the scenarios in
+# sim/bench, printing the bench lines each one reports over UART3.
+#   sim/bench.sh > bench_output.txt
+# Cycle counts come from the simulator's cycle model, compare them between
+# builds rather than with numbers measured on the board.
+set -e
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+BIN=./host_sim_bench
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+$CC -std=gnu99 -Wall -O2 -DHOST_SIM -DBENCH -finstrument-functions \
+	-finstrument-functions-exclude-file-list=host_sim.c \
+	-Isim/include -o "$BIN" sim/host_sim.c
+
+for script in sim/bench/*.txt; do
+	name=$(basename "$script" .txt)
+	"$BIN" -t 60000 -s "$script" -o "$OUT" 2>/dev/null
+	tr -d '\r' < "$OUT" | grep '^bench ' | sed "s/^/scenario=$name /"
+done
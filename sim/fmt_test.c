@@ -0,0 +1,150 @@
+/*****************************************************************************
+ *   Parity check of the fmt_* text formatters against snprintf
+ *
+ *   Build and run from the repository root like the simulator:
+ *     cc -std=gnu99 -O2 -DHOST_SIM -Isim/include -o fmt_test sim/fmt_test.c
+ *     ./fmt_test
+ *
+ *   main.c comes in through host_sim.c with the simulator's main() renamed,
+ *   so the formatters under test are the ones the firmware builds. Every
+ *   call is compared with the printf conversion it stands in for:
+ *     fmt_uint(p, v, w, ' ') "%*u"      fmt_uint(p, v, w, '0') "%0*u"
+ *     fmt_int(p, v, w, ' ')  "%*d"      fmt_int(p, v, w, '0')  "%0*d"
+ *     fmt_fixed(p, v, d)     "%.*f" of v / 10^d
+ *   over edge values (0, +-1, powers of ten, INT32_MIN, UINT32_MAX) at
+ *   widths 0 to 12, then random values. The returned end, the NUL and the
+ *   bytes after it are checked too. Exits with 1 on any mismatch.
+ *
+ ******************************************************************************/
+
+#define SIM_MAIN				sim_main
+#include "host_sim.c"
+
+#define FMT_TEST_RANDOM			1000000				//random values per formatter
+#define FMT_TEST_WIDTH_MAX		12
+#define FMT_TEST_BUF			32
+#define FMT_TEST_GUARD			0x5A				//fills the buffer past the NUL
+
+static unsigned long fmt_checks = 0;
+static unsigned long fmt_failures = 0;
+static uint32_t fmt_rand_state = 0x2545F491;
+
+//xorshift32, fixed seed so every run checks the same values
+static uint32_t fmt_rand(void){
+	fmt_rand_state ^= fmt_rand_state << 13;
+	fmt_rand_state ^= fmt_rand_state >> 17;
+	fmt_rand_state ^= fmt_rand_state << 5;
+	return fmt_rand_state;
+}
+
+//Compare what a formatter wrote into buf (ending at end) with the expected text
+static void fmt_check(const char *buf, const char *end, const char *expect, const char *call){
+	size_t len = strlen(expect);
+	size_t i;
+	bool ok = ((size_t)(end - buf) == len) && (memcmp(buf, expect, len + 1) == 0);
+
+	for (i = len + 1; ok && (i < FMT_TEST_BUF); i++){
+		ok = ((uint8_t)buf[i] == FMT_TEST_GUARD);
+	}
+	fmt_checks++;
+	if (!ok){
+		if (fmt_failures++ < 20){
+			printf("fmt: FAIL %s gave \"%s\" expected \"%s\"\n", call, buf, expect);
+		}
+	}
+}
+
+static void fmt_test_uint(uint32_t value, int width, char pad){
+	char buf[FMT_TEST_BUF], expect[FMT_TEST_BUF], call[64];
+	char *end;
+
+	memset(buf, FMT_TEST_GUARD, sizeof(buf));
+	end = fmt_uint(buf, value, width, pad);
+	snprintf(expect, sizeof(expect), (pad == '0') ? "%0*u" : "%*u", width, (unsigned)value);
+	snprintf(call, sizeof(call), "fmt_uint(%u, %d, '%c')", (unsigned)value, width, pad);
+	fmt_check(buf, end, expect, call);
+}
+
+static void fmt_test_int(int32_t value, int width, char pad){
+	char buf[FMT_TEST_BUF], expect[FMT_TEST_BUF], call[64];
+	char *end;
+
+	memset(buf, FMT_TEST_GUARD, sizeof(buf));
+	end = fmt_int(buf, value, width, pad);
+	snprintf(expect, sizeof(expect), (pad == '0') ? "%0*d" : "%*d", width, (int)value);
+	snprintf(call, sizeof(call), "fmt_int(%d, %d, '%c')", (int)value, width, pad);
+	fmt_check(buf, end, expect, call);
+}
+
+//The value is exact in 10^decimals units, so "%.*f" of the nearest double
+//rounds back to the same digits, "-0.5" for -5 and "0.0" for 0 included
+static void fmt_test_fixed(int32_t value, int decimals){
+	static const double scale[] = { 1.0, 10.0, 100.0, 1000.0 };
+	char buf[FMT_TEST_BUF], expect[FMT_TEST_BUF], call[64];
+	char *end;
+
+	memset(buf, FMT_TEST_GUARD, sizeof(buf));
+	end = fmt_fixed(buf, value, decimals);
+	snprintf(expect, sizeof(expect), "%.*f", decimals, value / scale[decimals]);
+	snprintf(call, sizeof(call), "fmt_fixed(%d, %d)", (int)value, decimals);
+	fmt_check(buf, end, expect, call);
+}
+
+//fmt_str chains fields the way OLED_Update does
+static void fmt_test_str(void){
+	char buf[FMT_TEST_BUF];
+	char *end;
+
+	memset(buf, FMT_TEST_GUARD, sizeof(buf));
+	end = fmt_str(buf, "");
+	fmt_check(buf, end, "", "fmt_str(\"\")");
+
+	memset(buf, FMT_TEST_GUARD, sizeof(buf));
+	end = fmt_str(fmt_int(fmt_str(buf, "AX"), -42, 4, ' '), "  ");
+	fmt_check(buf, end, "AX -42  ", "fmt_str(fmt_int(fmt_str(\"AX\"), -42, 4, ' '), \"  \")");
+}
+
+int main(void){
+	static const int32_t edges[] = {
+		0, 1, -1, 5, -5, 9, -9, 10, -10, 99, -99, 100, -100, 999, -999,
+		1000, -1000, 12345, -12345, 99999, -99999, 100000, 999999999,
+		-999999999, 1000000000, -1000000000, INT32_MAX, INT32_MAX - 1,
+		INT32_MIN, INT32_MIN + 1
+	};
+	static const uint32_t uedges[] = {
+		0, 1, 9, 10, 99, 100, 65535, 65536, 999999999, 1000000000,
+		(uint32_t)INT32_MAX + 1, UINT32_MAX - 1, UINT32_MAX
+	};
+	unsigned i;
+	int width, decimals;
+	uint32_t r;
+
+	for (i = 0; i < sizeof(edges) / sizeof(edges[0]); i++){
+		for (width = 0; width <= FMT_TEST_WIDTH_MAX; width++){
+			fmt_test_int(edges[i], width, ' ');
+			fmt_test_int(edges[i], width, '0');
+		}
+		for (decimals = 0; decimals <= 3; decimals++){
+			fmt_test_fixed(edges[i], decimals);
+		}
+	}
+	for (i = 0; i < sizeof(uedges) / sizeof(uedges[0]); i++){
+		for (width = 0; width <= FMT_TEST_WIDTH_MAX; width++){
+			fmt_test_uint(uedges[i], width, ' ');
+			fmt_test_uint(uedges[i], width, '0');
+		}
+	}
+	fmt_test_str();
+
+	//Random values, shifted so short numbers come up as often as long ones
+	for (i = 0; i < FMT_TEST_RANDOM; i++){
+		r = fmt_rand() >> (fmt_rand() % 32);
+		width = fmt_rand() % (FMT_TEST_WIDTH_MAX + 1);
+		fmt_test_uint(r, width, (i & 1) ? '0' : ' ');
+		fmt_test_int((fmt_rand() & 1) ? -(int32_t)(r >> 1) : (int32_t)(r >> 1), width, (i & 2) ? '0' : ' ');
+		fmt_test_fixed((int32_t)fmt_rand() >> (fmt_rand() % 32), fmt_rand() % 4);
+	}
+
+	printf("fmt: checks=%lu failures=%lu\n", fmt_checks, fmt_failures);
+	return (fmt_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,2500 @@
+/*****************************************************************************
+ *   Host simulation of the CARE firmware
+ *
+ *   Build and run from the repository root on any Linux box:
+ *     cc -std=gnu99 -O2 -DHOST_SIM -Isim/include -o host_sim sim/host_sim.c
+ *     ./host_sim -t 30000 -s sim/demo.txt
+ *
+ *   main.c is compiled into this file with its main() renamed to
+ *   firmware_main(). The headers in sim/include stand in for the CMSIS and
+ *   baseboard libraries, their functions are implemented below on top of a
+ *   model of the peripherals main.c uses.
+ *
+ *   Virtual time is counted in CPU cycles (100MHz). Each __WFI() jumps to
+ *   the next hardware event (SysTick, timer match, temperature sensor edge,
+ *   UART character, I2C transaction, scripted input) and runs the interrupt
+ *   handlers it raises, so a run is deterministic and goes as fast as the
+ *   host can execute it.
+ *
+ *   Firmware code is charged cycles by a simple model (see Cycle model) that
+ *   also drives DWT->CYCCNT. For the benchmark scenarios in sim/bench build
+ *   with the function call part of the model enabled, sim/bench.sh does:
+ *     cc -std=gnu99 -O2 -DHOST_SIM -DBENCH -finstrument-functions \
+ *        -finstrument-functions-exclude-file-list=host_sim.c \
+ *        -Isim/include -o host_sim_bench sim/host_sim.c
+ *
+ *   Compile-time modes in main.c can be switched on the same way, eg.
+ *   -DLIGHT_IRQ_MODE, the run then prints how long after each scripted
+ *   light change the algae and waste flags go up. With -DACC_MOTION_MODE
+ *   it prints the accelerometer wakeups, try sim/acc_motion.txt.
+ *   -DSENSOR_TRACE records a trace that -T saves and -R replays, see
+ *   sim/trace_record.txt. -DFLASH_LOG keeps records in flash while SAFE is
+ *   silent, -F saves the flash between runs, see sim/flash_log.txt.
+ *   -DBOOT_PROFILE times the boot stages, see sim/boot.txt.
+ *   -DTEMP_CAPTURE_MODE reads the sensor with TIMER3, sim/temp_capture.txt
+ *   checks the temperatures it reports.
+ *   -DSTACK_WATERMARK reports how deep the firmware stack went.
+ *
+ *   sim/fmt_test.c checks the fmt_* text formatters against snprintf.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdarg.h>
+
+//sprintf is costly on the target, route main.c through the cycle model
+int sim_sprintf(char *str, const char *format, ...);
+#define sprintf sim_sprintf
+
+//Handlers the simulator may raise, only those main.c defines are called
+void TIMER0_IRQHandler(void) __attribute__((weak));
+void TIMER1_IRQHandler(void) __attribute__((weak));
+void TIMER2_IRQHandler(void) __attribute__((weak));
+void TIMER3_IRQHandler(void) __attribute__((weak));
+void EINT3_IRQHandler(void) __attribute__((weak));
+void UART3_IRQHandler(void) __attribute__((weak));
+void DMA_IRQHandler(void) __attribute__((weak));
+
+#define main firmware_main
+#include "../main.c"
+#undef main
+#undef sprintf
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Simulated hardware state
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_CPU_HZ				100000000ULL
+#define SIM_CYCLES_PER_US		(SIM_CPU_HZ / 1000000)
+#define SIM_CYCLES_PER_MS		(SIM_CPU_HZ / 1000)
+#define SIM_PCLK_DIV			4						//timers run from CCLK/4
+#define SIM_UART_CHAR			(SIM_CPU_HZ * 10 / 115200)	//start + 8 data + stop bits
+#define SIM_UART_RX_FIFO		16
+#define SIM_SSP_BYTE			(SIM_CPU_HZ * 8 / 20000000)	//SSP1 at 20MHz
+#define SIM_I2C_XFER			(100 * SIM_CYCLES_PER_US)	//one short transaction at 400kHz
+#define SIM_BUTTON_HOLD			50						//ms a scripted button stays pressed
+#define SIM_NEVER				UINT64_MAX
+
+#define SIM_SW4_PORT			1
+#define SIM_SW4_PIN				31
+#define SIM_SW3_PORT			2
+#define SIM_SW3_PIN				10
+#define SIM_TEMP_PIN			2						//P0.2
+
+LPC_GPIO_TypeDef sim_gpio[5];
+LPC_GPIOINT_TypeDef sim_gpioint;
+LPC_TIM_TypeDef sim_tim[4];
+LPC_UART_TypeDef sim_uart3;
+LPC_I2C_TypeDef sim_i2c2;
+LPC_SSP_TypeDef sim_ssp1;
+SysTick_Type sim_systick;
+DWT_Type sim_dwt;
+CoreDebug_Type sim_coredebug;
+uint32_t SystemCoreClock = 100000000;
+
+uint64_t sim_now = 0;									//virtual CPU cycles since reset
+static uint64_t sim_limit;
+static bool sim_nvic_enabled[SIM_IRQ_COUNT];
+static uint32_t sim_primask = 0;
+static bool sim_verbose = false;
+static bool sim_replaying = false;						//-R, no firmware main() to track
+static struct timespec sim_wall_start;
+static FILE *sim_uart_file;
+
+static uint32_t sim_gpio_in[5];							//levels driven onto input pins
+static uint64_t sim_systick_last = 0;
+static uint64_t sim_tim_last[4];						//cycle of the last whole timer tick
+static bool sim_tim_matched[4];							//interrupt for TC == MR0 already raised
+static bool sim_uart_rbr_int = false;
+static bool sim_uart_thre_int = false;
+static bool sim_uart_thre_pending = false;
+static uint8_t sim_rx_fifo[SIM_UART_RX_FIFO];
+static uint8_t sim_rx_count = 0;
+static uint8_t sim_rx_trigger = 1;						//RX FIFO trigger level in chars
+static bool sim_rx_overrun = false;						//OE in LSR until read
+static char sim_rx_line[256];							//scripted keystrokes, sent in a loop
+static uint32_t sim_rx_line_len = 0;
+static uint32_t sim_rx_sent = 0;
+static uint32_t sim_rx_left = 0;						//keystrokes still to arrive
+static uint64_t sim_rx_timeout = SIM_NEVER;				//character timeout interrupt due
+
+static uint64_t sim_temp_next;
+static uint64_t sim_uart_next = SIM_NEVER;
+static uint64_t sim_rx_next = SIM_NEVER;
+static uint64_t sim_heartbeat_next = SIM_NEVER;
+static uint64_t sim_heartbeat_period = 0;				//SAFE sends '\r' this often, 0 for never
+static uint64_t sim_i2c_next = SIM_NEVER;
+static uint64_t sim_dma_next = SIM_NEVER;
+static uint64_t sim_light_next = SIM_NEVER;
+static uint64_t sim_sw4_release = SIM_NEVER;
+static uint64_t sim_sw3_release = SIM_NEVER;
+static uint64_t sim_joy_release = SIM_NEVER;
+
+//Sensor and input model
+static int32_t sim_temp = 250;							//0.1 deg C
+static uint8_t sim_joystick = 0;
+static uint64_t sim_joy_pressed = SIM_NEVER;			//direction press being timed
+static int sim_joy_from_x, sim_joy_from_y;
+static bool sim_joy_moved;
+static int32_t sim_rotary_steps = 0;					//>0 right, <0 left
+static uint8_t sim_7seg = ' ';
+static uint16_t sim_led_array = 0;
+
+//Counters for the run summary
+static uint32_t sim_irq_count[SIM_IRQ_COUNT];
+static uint32_t sim_systick_count = 0;
+static uint32_t sim_uart_tx_bytes = 0;
+static uint32_t sim_uart_rx_bytes = 0;
+static uint32_t sim_uart_rx_overruns = 0;				//chars lost to a full RX FIFO
+static uint32_t sim_ssp_dma_bytes = 0;
+static uint32_t sim_ssp_cs_errors = 0;					//DMA transfers with no or both chip selects low
+static uint32_t sim_i2c_polled_irq_on = 0;				//polled driver transfers while I2C2_IRQn was enabled
+static bool sim_failed = false;							//a check failed, the run exits with 1
+static uint32_t sim_expects = 0;						//script expect checks
+static uint32_t sim_expects_failed = 0;
+
+static double sim_ms(void){
+	return (double)sim_now / SIM_CYCLES_PER_MS;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Cycle model
+// Firmware code is charged what the equivalent target operation roughly
+// costs: exception entry/exit, each firmware function call when built with
+// -finstrument-functions, driver calls and the bus time of blocking
+// transfers. Numbers are deterministic and meant for comparing builds, not
+// for matching DWT readings on the board cycle for cycle.
+// Charged cycles advance virtual time and DWT->CYCCNT, interrupts due in
+// the meantime preempt main context code as they would on the target.
+// CYCCNT does not advance while asleep in __WFI(), as on the Cortex-M3.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_COST_EXC_ENTRY		12						//stacking and vector fetch
+#define SIM_COST_EXC_EXIT		12						//unstacking
+#define SIM_COST_CALL			8						//call, prologue, epilogue and return
+#define SIM_COST_DRIVER			20						//CMSIS driver call with parameter checks
+#define SIM_COST_GPIO			15
+#define SIM_COST_NVIC			6
+#define SIM_COST_SSP_BYTE		40						//8 bits at 20MHz
+#define SIM_COST_I2C_BYTE		2250					//9 bits at 400kHz
+#define SIM_COST_PRINTF			300						//newlib format parsing
+#define SIM_COST_PRINTF_CHAR	40
+
+//Blocking I2C transfer: address, register and data bytes plus a restart
+#define SIM_COST_I2C(tx, rx)	((1 + (tx) + (rx) + ((rx) ? 1 : 0)) * SIM_COST_I2C_BYTE)
+
+//Baseboard oled_init(): busy wait for the panel supply, then its init commands
+#define SIM_COST_OLED_POWER		(0x80000 * 4)
+#define SIM_OLED_INIT_BYTES		30
+
+static int sim_irq_depth = 0;
+static uint64_t sim_debt = 0;							//cycles charged while interrupts could not run
+
+static void sim_advance_to(uint64_t target);
+
+#ifdef STACK_WATERMARK
+//Stand-in for the RAM ResetISR paints. Firmware runs on the host stack, so
+//each charge dirties sim_stack from the top as far as the host stack is
+//below firmware_main(). Host frames are bigger than Thumb-2 ones, take the
+//result as an upper bound.
+#define SIM_STACK_WORDS			(STACK_SIM_BYTES / sizeof(unsigned long))
+unsigned long sim_stack[SIM_STACK_WORDS];
+static uintptr_t sim_stack_base = 0;					//host stack pointer when firmware_main() is called
+static uintptr_t sim_stack_low = UINTPTR_MAX;
+
+static void sim_stack_touch(void){
+	uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+	size_t words;
+
+	if ((sim_stack_base == 0) || (sp >= sim_stack_low)){
+		return;
+	}
+	sim_stack_low = sp;
+	words = (sim_stack_base - sp) / sizeof(unsigned long);
+	if (words > SIM_STACK_WORDS){
+		words = SIM_STACK_WORDS;
+	}
+	memset(&sim_stack[SIM_STACK_WORDS - words], 0, words * sizeof(unsigned long));
+}
+#endif
+
+static void sim_charge(uint32_t cycles){
+#ifdef STACK_WATERMARK
+	sim_stack_touch();
+#endif
+	if (DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk){
+		DWT->CYCCNT += cycles;
+	}
+	sim_debt += cycles;
+	if ((sim_irq_depth == 0) && (sim_primask == 0)){
+		uint64_t debt = sim_debt;
+
+		sim_debt = 0;
+		sim_advance_to(sim_now + debt);
+	}
+}
+
+void __cyg_profile_func_enter(void *this_fn, void *call_site){
+	sim_charge(SIM_COST_CALL);
+}
+
+void __cyg_profile_func_exit(void *this_fn, void *call_site){
+}
+
+int sim_sprintf(char *str, const char *format, ...){
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsprintf(str, format, args);
+	va_end(args);
+	sim_charge(SIM_COST_PRINTF + SIM_COST_PRINTF_CHAR * len);
+	return len;
+}
+
+//Run an exception handler, interrupts do not nest in the simulator
+static void sim_exception(void (*handler)(void)){
+	uint64_t debt;
+
+	sim_irq_depth++;
+	sim_charge(SIM_COST_EXC_ENTRY);
+	handler();
+	sim_charge(SIM_COST_EXC_EXIT);
+	sim_irq_depth--;
+
+	//Time the handler took passes before main context resumes
+	if ((sim_irq_depth == 0) && (sim_primask == 0)){
+		debt = sim_debt;
+		sim_debt = 0;
+		sim_advance_to(sim_now + debt);
+	}
+}
+
+//Raise an interrupt if it is enabled in the NVIC
+static void sim_irq(IRQn_Type irq, void (*handler)(void)){
+	if (sim_nvic_enabled[irq] && handler){
+		sim_irq_count[irq]++;
+		sim_exception(handler);
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Core: SysTick, NVIC, DWT
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+uint32_t SysTick_Config(uint32_t ticks){
+	if ((ticks - 1) > 0xFFFFFF){
+		return 1;
+	}
+	SysTick->LOAD = ticks - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+	sim_systick_last = sim_now;
+	return 0;
+}
+
+void NVIC_EnableIRQ(IRQn_Type IRQn){
+	sim_nvic_enabled[IRQn] = true;
+	sim_charge(SIM_COST_NVIC);
+}
+
+void NVIC_DisableIRQ(IRQn_Type IRQn){
+	sim_charge(SIM_COST_NVIC);
+	sim_nvic_enabled[IRQn] = false;
+}
+
+void NVIC_ClearPendingIRQ(IRQn_Type IRQn){
+	sim_charge(SIM_COST_NVIC);
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type IRQn){
+	sim_charge(SIM_COST_NVIC);
+}
+
+void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority){
+	sim_charge(SIM_COST_NVIC);
+}
+
+uint32_t NVIC_EncodePriority(uint32_t PriorityGroup, uint32_t PreemptPriority, uint32_t SubPriority){
+	uint32_t sub_bits = (PriorityGroup > 2) ? PriorityGroup - 2 : 0;
+
+	return (PreemptPriority << sub_bits) | (SubPriority & ((1 << sub_bits) - 1));
+}
+
+void __disable_irq(void){
+	sim_primask = 1;
+}
+
+void __enable_irq(void){
+	sim_primask = 0;
+	sim_charge(0);
+}
+
+uint32_t __get_PRIMASK(void){
+	return sim_primask;
+}
+
+void __set_PRIMASK(uint32_t priMask){
+	sim_primask = priMask;
+	sim_charge(0);										//pay for what ran with interrupts masked
+}
+
+uint32_t __get_MSP(void){
+	return 0;
+}
+
+static void sim_tim_sync(int n);
+
+//Bring the free running counters up to sim_now
+static void sim_sync_core(void){
+	int n;
+
+	for (n = 0; n < 4; n++){
+		sim_tim_sync(n);
+	}
+	if (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk){
+		SysTick->VAL = SysTick->LOAD - (uint32_t)(sim_now - sim_systick_last);
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Timers
+// Timer mode counts PCLK/(PR+1), counter mode counts temperature sensor
+// edges. Only MR0 is modelled, which is all main.c uses.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_TIM_MR0_INT			(1 << 0)
+#define SIM_TIM_MR0_RESET		(1 << 1)
+#define SIM_TIM_MR0_STOP		(1 << 2)
+
+static uint64_t sim_tim_tick(int n){
+	return (uint64_t)SIM_PCLK_DIV * (sim_tim[n].PR + 1);
+}
+
+static bool sim_tim_timer_mode(int n){
+	return (sim_tim[n].TCR & 1) && ((sim_tim[n].CTCR & 3) == 0);
+}
+
+static bool sim_tim_mr0_acts(int n){
+	return (sim_tim[n].MCR & (SIM_TIM_MR0_INT | SIM_TIM_MR0_RESET | SIM_TIM_MR0_STOP)) != 0;
+}
+
+//Count whole ticks up to sim_now, stopping at a match that has not been raised yet
+static void sim_tim_sync(int n){
+	uint64_t ticks;
+	uint64_t step;
+
+	if (!sim_tim_timer_mode(n)){
+		sim_tim_last[n] = sim_now;
+		return;
+	}
+	ticks = (sim_now - sim_tim_last[n]) / sim_tim_tick(n);
+	while (ticks > 0){
+		if ((sim_tim[n].TC == sim_tim[n].MR0) && sim_tim_mr0_acts(n)){
+			if ((sim_tim[n].MCR & SIM_TIM_MR0_INT) && !sim_tim_matched[n]){
+				break;									//sim_events raises it first
+			}
+			//Match holds for one tick, then resets or keeps counting
+			sim_tim_matched[n] = false;
+			sim_tim[n].TC = (sim_tim[n].MCR & SIM_TIM_MR0_RESET) ? 0 : sim_tim[n].TC + 1;
+			step = 1;
+		}
+		else if (sim_tim_mr0_acts(n) && (sim_tim[n].TC < sim_tim[n].MR0)){
+			step = (ticks < sim_tim[n].MR0 - sim_tim[n].TC) ? ticks : sim_tim[n].MR0 - sim_tim[n].TC;
+			sim_tim[n].TC += (uint32_t)step;
+		}
+		else{
+			step = ticks;
+			sim_tim[n].TC += (uint32_t)step;
+		}
+		ticks -= step;
+		sim_tim_last[n] += step * sim_tim_tick(n);
+	}
+}
+
+static uint64_t sim_tim_next(int n){
+	if (!sim_tim_timer_mode(n) || !(sim_tim[n].MCR & SIM_TIM_MR0_INT) || sim_tim_matched[n] || (sim_tim[n].TC > sim_tim[n].MR0)){
+		return SIM_NEVER;
+	}
+	return sim_tim_last[n] + (uint64_t)(sim_tim[n].MR0 - sim_tim[n].TC) * sim_tim_tick(n);
+}
+
+static void sim_tim_raise(int n){
+	static void (*const handlers[4])(void) = {TIMER0_IRQHandler, TIMER1_IRQHandler, TIMER2_IRQHandler, TIMER3_IRQHandler};
+
+	sim_tim[n].IR |= 0x01;
+	sim_irq(TIMER0_IRQn + n, handlers[n]);
+	sim_tim[n].IR = 0;
+}
+
+//TC reached MR0, the handler sees TC == MR0 like on the target
+static void sim_tim_match(int n){
+	sim_tim_sync(n);
+	sim_tim_matched[n] = true;
+	if (sim_tim[n].MCR & SIM_TIM_MR0_STOP){
+		sim_tim[n].TCR &= ~1;
+	}
+	sim_tim_raise(n);
+}
+
+//Rising edge on a timer capture input
+static void sim_tim_count(int n){
+	if (!(sim_tim[n].TCR & 1) || ((sim_tim[n].CTCR & 3) == 0)){
+		return;
+	}
+	if ((sim_tim[n].TC == sim_tim[n].MR0) && (sim_tim[n].MCR & SIM_TIM_MR0_RESET)){
+		sim_tim[n].TC = 0;
+	}
+	else{
+		sim_tim[n].TC++;
+	}
+	if ((sim_tim[n].TC == sim_tim[n].MR0) && (sim_tim[n].MCR & SIM_TIM_MR0_INT)){
+		sim_tim_sync(0);								//handler may timestamp with TIMER0
+		sim_tim_raise(n);
+	}
+}
+
+void TIM_Init(LPC_TIM_TypeDef *TIMx, TIM_MODE_OPT TimerCounterMode, void *TIM_ConfigStruct){
+	memset((void *)TIMx, 0, sizeof(*TIMx));
+	sim_tim_matched[TIMx - sim_tim] = false;
+	if (TimerCounterMode == TIM_TIMER_MODE){
+		TIM_TIMERCFG_Type *cfg = TIM_ConfigStruct;
+
+		if (cfg->PrescaleOption == TIM_PRESCALE_TICKVAL){
+			TIMx->PR = cfg->PrescaleValue - 1;
+		}
+		else{
+			TIMx->PR = (SystemCoreClock / SIM_PCLK_DIV / 1000000) * cfg->PrescaleValue - 1;
+		}
+	}
+	else{
+		TIM_COUNTERCFG_Type *cfg = TIM_ConfigStruct;
+
+		TIMx->CTCR = TimerCounterMode | (cfg->CountInputSelect << 2);
+	}
+}
+
+void TIM_DeInit(LPC_TIM_TypeDef *TIMx){
+	TIMx->TCR = 0;
+}
+
+void TIM_ConfigMatch(LPC_TIM_TypeDef *TIMx, TIM_MATCHCFG_Type *cfg){
+	uint32_t shift = cfg->MatchChannel * 3;
+
+	(&TIMx->MR0)[cfg->MatchChannel] = cfg->MatchValue;
+	TIMx->MCR &= ~(7 << shift);
+	TIMx->MCR |= ((cfg->IntOnMatch ? SIM_TIM_MR0_INT : 0) | (cfg->ResetOnMatch ? SIM_TIM_MR0_RESET : 0) | (cfg->StopOnMatch ? SIM_TIM_MR0_STOP : 0)) << shift;
+}
+
+void TIM_Cmd(LPC_TIM_TypeDef *TIMx, FunctionalState NewState){
+	int n = TIMx - sim_tim;
+
+	sim_tim_sync(n);
+	if (NewState == ENABLE){
+		TIMx->TCR |= 1;
+	}
+	else{
+		TIMx->TCR &= ~1;
+	}
+	sim_tim_last[n] = sim_now;
+}
+
+void TIM_ResetCounter(LPC_TIM_TypeDef *TIMx){
+	TIMx->TC = 0;
+	TIMx->PC = 0;
+	sim_tim_last[TIMx - sim_tim] = sim_now;
+	sim_tim_matched[TIMx - sim_tim] = false;
+}
+
+void TIM_ClearIntPending(LPC_TIM_TypeDef *TIMx, TIM_INT_TYPE IntFlag){
+	TIMx->IR = 1 << IntFlag;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// GPIO and GPIO interrupts
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void PINSEL_ConfigPin(PINSEL_CFG_Type *PinCfg){
+	sim_charge(SIM_COST_DRIVER);
+}
+
+void GPIO_SetDir(uint8_t portNum, uint32_t bitValue, uint8_t dir){
+	sim_charge(SIM_COST_GPIO);
+	if (dir){
+		sim_gpio[portNum].FIODIR |= bitValue;
+	}
+	else{
+		sim_gpio[portNum].FIODIR &= ~bitValue;
+	}
+}
+
+static void sim_trace_rgb(void){
+	if (sim_verbose){
+		fprintf(stderr, "%10.3f ms  rgb red=%u blue=%u\n", sim_ms(), (sim_gpio[2].FIOPIN >> 0) & 1, (sim_gpio[0].FIOPIN >> 26) & 1);
+	}
+}
+
+void GPIO_SetValue(uint8_t portNum, uint32_t bitValue){
+	sim_charge(SIM_COST_GPIO);
+	sim_gpio[portNum].FIOPIN |= bitValue;
+	if ((portNum == 2 && (bitValue & (1 << 0))) || (portNum == 0 && (bitValue & (1 << 26)))){
+		sim_trace_rgb();
+	}
+}
+
+void GPIO_ClearValue(uint8_t portNum, uint32_t bitValue){
+	sim_charge(SIM_COST_GPIO);
+	sim_gpio[portNum].FIOPIN &= ~bitValue;
+	if ((portNum == 2 && (bitValue & (1 << 0))) || (portNum == 0 && (bitValue & (1 << 26)))){
+		sim_trace_rgb();
+	}
+}
+
+uint32_t GPIO_ReadValue(uint8_t portNum){
+	uint32_t dir = sim_gpio[portNum].FIODIR;
+
+	sim_charge(SIM_COST_GPIO);
+	return (sim_gpio[portNum].FIOPIN & dir) | (sim_gpio_in[portNum] & ~dir);
+}
+
+//Drive an input pin, raising EINT3 for enabled port 0/2 edges
+static void sim_gpio_drive(uint8_t port, uint8_t pin, bool level){
+	uint32_t bit = 1u << pin;
+	bool old = (sim_gpio_in[port] & bit) != 0;
+	bool raise = false;
+
+	if (level){
+		sim_gpio_in[port] |= bit;
+	}
+	else{
+		sim_gpio_in[port] &= ~bit;
+	}
+	if (old == level){
+		return;
+	}
+
+	if (port == 0){
+		if (level && (sim_gpioint.IO0IntEnR & bit)){
+			sim_gpioint.IO0IntStatR |= bit;
+			raise = true;
+		}
+		if (!level && (sim_gpioint.IO0IntEnF & bit)){
+			sim_gpioint.IO0IntStatF |= bit;
+			raise = true;
+		}
+	}
+	else if (port == 2){
+		if (level && (sim_gpioint.IO2IntEnR & bit)){
+			sim_gpioint.IO2IntStatR |= bit;
+			raise = true;
+		}
+		if (!level && (sim_gpioint.IO2IntEnF & bit)){
+			sim_gpioint.IO2IntStatF |= bit;
+			raise = true;
+		}
+	}
+	if (raise){
+		sim_gpioint.IntStatus = (port == 0) ? 0x1 : 0x4;
+		sim_irq(EINT3_IRQn, EINT3_IRQHandler);
+		//IntClr writes land in a plain register here, clear what the handler acknowledged
+		sim_gpioint.IO0IntStatR = sim_gpioint.IO0IntStatF = 0;
+		sim_gpioint.IO2IntStatR = sim_gpioint.IO2IntStatF = 0;
+		sim_gpioint.IntStatus = 0;
+	}
+}
+
+//MAX6576 output period is 10us per Kelvin, one rising edge per period
+static uint64_t sim_temp_period(void){
+	return (uint64_t)(sim_temp + 2731) * SIM_CYCLES_PER_US;
+}
+
+static void sim_temp_edge(void){
+	sim_temp_next += sim_temp_period();
+	sim_gpio_drive(0, SIM_TEMP_PIN, false);
+	sim_gpio_drive(0, SIM_TEMP_PIN, true);
+	sim_tim_count(3);									//CAP3.0 when wired for TEMP_CAPTURE_MODE
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// UART3
+// TX takes what main.c loads through sim_uart3_out, one character time per
+// byte, and raises THRE when the FIFO is empty. RX delivers scripted
+// keystrokes into a 16 byte FIFO, with RDA at the trigger level and a
+// character timeout (CTI) 4 char times after the last char in or out.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void UART_Init(LPC_UART_TypeDef *UARTx, UART_CFG_Type *UART_ConfigStruct){
+	UARTx->IIR = UART_IIR_INTSTAT_PEND;
+}
+
+void UART_TxCmd(LPC_UART_TypeDef *UARTx, FunctionalState NewState){
+}
+
+void UART_FIFOConfigStructInit(UART_FIFO_CFG_Type *UART_FIFOInitStruct){
+	UART_FIFOInitStruct->FIFO_DMAMode = DISABLE;
+	UART_FIFOInitStruct->FIFO_Level = UART_FIFO_TRGLEV0;
+	UART_FIFOInitStruct->FIFO_ResetRxBuf = ENABLE;
+	UART_FIFOInitStruct->FIFO_ResetTxBuf = ENABLE;
+}
+
+void UART_FIFOConfig(LPC_UART_TypeDef *UARTx, UART_FIFO_CFG_Type *FIFOCfg){
+	static const uint8_t levels[4] = {1, 4, 8, 14};
+
+	sim_rx_trigger = levels[FIFOCfg->FIFO_Level & 3];
+	if (FIFOCfg->FIFO_ResetRxBuf){
+		sim_rx_count = 0;
+	}
+}
+
+void UART_IntConfig(LPC_UART_TypeDef *UARTx, UART_INT_Type UARTIntCfg, FunctionalState NewState){
+	if (UARTIntCfg == UART_INTCFG_RBR){
+		sim_uart_rbr_int = (NewState == ENABLE);
+	}
+	else if (UARTIntCfg == UART_INTCFG_THRE){
+		sim_uart_thre_int = (NewState == ENABLE);
+	}
+}
+
+static void sim_tlm_monitor(const uint8_t *data, uint32_t len);
+
+uint32_t UART_Send(LPC_UART_TypeDef *UARTx, uint8_t *txbuf, uint32_t buflen, TRANSFER_BLOCK_Type flag){
+	sim_tlm_monitor(txbuf, buflen);
+	fwrite(txbuf, 1, buflen, sim_uart_file);
+	sim_uart_tx_bytes += buflen;
+	return buflen;
+}
+
+uint8_t UART_GetLineStatus(LPC_UART_TypeDef *UARTx){
+	uint8_t lsr = UART_LSR_THRE | UART_LSR_TEMT;
+
+	sim_charge(SIM_COST_DRIVER);
+	if (sim_rx_count > 0){
+		lsr |= UART_LSR_RDR;
+	}
+	if (sim_rx_overrun){
+		lsr |= UART_LSR_OE;
+		sim_rx_overrun = false;
+	}
+	return lsr;
+}
+
+uint8_t UART_ReceiveByte(LPC_UART_TypeDef *UARTx){
+	uint8_t c = 0;
+
+	sim_charge(SIM_COST_DRIVER);
+	if (sim_rx_count > 0){
+		c = sim_rx_fifo[0];
+		memmove(sim_rx_fifo, sim_rx_fifo + 1, --sim_rx_count);
+		sim_rx_timeout = sim_now + 4 * SIM_UART_CHAR;
+	}
+	return c;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Telemetry monitor
+// Decodes every binary frame on UART3 the way SAFE would. A frame is 0x00,
+// COBS block, 0x00; bytes between frames are text lines (mode msgs, reports).
+// A frame that fails COBS or CRC16, has an unknown type or a payload of the
+// wrong size for its type is an error, and sim_finish() fails the run.
+// Text builds send no 0x00 so nothing is checked.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_TLM_FRAME_MAX		TLM_WIRE(TLM_MAX_PAYLOAD)		//COBS block of the largest payload, longer ones are errors
+
+static uint8_t sim_tlm_frame[SIM_TLM_FRAME_MAX];
+static uint32_t sim_tlm_frame_len = 0;
+static bool sim_tlm_in_frame = false;
+static bool sim_tlm_overlong = false;
+static uint32_t sim_tlm_frames = 0;
+static uint32_t sim_tlm_sensor = 0;
+static uint32_t sim_tlm_status = 0;
+static uint32_t sim_tlm_batch = 0;
+static uint32_t sim_tlm_records = 0;					//sensor records, single or batched
+static uint32_t sim_tlm_changes = 0;					//records whose status differs from the one before
+static uint8_t sim_tlm_last_status = 0;
+static uint32_t sim_tlm_trace = 0;
+static uint32_t sim_tlm_text = 0;						//bytes outside frames
+static uint32_t sim_tlm_errors = 0;
+
+static void sim_tlm_error(const char *what){
+	sim_tlm_errors++;
+	if (sim_verbose){
+		fprintf(stderr, "%10.3f ms  telemetry frame %u: %s\n", sim_ms(), sim_tlm_frames, what);
+	}
+}
+
+//Status of one record, in a status frame or a batched sample
+static void sim_tlm_record_status(uint8_t status){
+	if (status != sim_tlm_last_status){
+		sim_tlm_changes++;
+		sim_tlm_last_status = status;
+	}
+}
+
+static void sim_tlm_frame_done(void){
+	uint8_t payload[TLM_MAX_PAYLOAD + 2];				//and the CRC16
+	TLM_SAMPLE samples[TLM_BATCH_SAMPLES];
+	int len, n, i;
+
+	sim_tlm_frames++;
+	if (sim_tlm_overlong){
+		sim_tlm_error("too long");
+		return;
+	}
+	len = tlm_decode_frame(sim_tlm_frame, sim_tlm_frame_len, payload, sizeof(payload));
+	if (len < 1){
+		sim_tlm_error("COBS or CRC16");
+		return;
+	}
+	switch (payload[0]){
+	case TLM_FRAME_SENSOR:
+		if (len != TLM_SENSOR_LEN){
+			sim_tlm_error("sensor size");
+			return;
+		}
+		sim_tlm_sensor++;
+		sim_tlm_records++;
+		break;
+	case TLM_FRAME_STATUS:
+		if ((len != TLM_STATUS_LEN) || (payload[1] & ~(TLM_STATUS_ALGAE | TLM_STATUS_WASTE))){
+			sim_tlm_error("status");
+			return;
+		}
+		sim_tlm_status++;
+		sim_tlm_record_status(payload[1]);
+		break;
+	case TLM_FRAME_BATCH:
+		n = tlm_decode_batch(payload, len, samples);
+		if (n < 0){
+			sim_tlm_error("batch");
+			return;
+		}
+		sim_tlm_batch++;
+		sim_tlm_records += n;
+		for (i = 0; i < n; i++){
+			sim_tlm_record_status(samples[i].status);
+		}
+		break;
+	case TLM_FRAME_TRACE:
+		if (len < 3){
+			sim_tlm_error("trace");
+			return;
+		}
+		sim_tlm_trace++;
+		break;
+	default:
+		sim_tlm_error("frame type");
+	}
+}
+
+static void sim_tlm_monitor(const uint8_t *data, uint32_t len){
+	uint32_t i;
+
+	for (i = 0; i < len; i++){
+		if (data[i] == 0x00){
+			if (sim_tlm_in_frame){
+				sim_tlm_frame_done();
+			}
+			sim_tlm_in_frame = !sim_tlm_in_frame;
+			sim_tlm_frame_len = 0;
+			sim_tlm_overlong = false;
+		}
+		else if (!sim_tlm_in_frame){
+			sim_tlm_text++;
+		}
+		else if (sim_tlm_frame_len < SIM_TLM_FRAME_MAX){
+			sim_tlm_frame[sim_tlm_frame_len++] = data[i];
+		}
+		else{
+			sim_tlm_overlong = true;
+		}
+	}
+}
+
+#ifdef SENSOR_TRACE
+static void sim_trace_capture(const uint8_t *data, uint32_t len);
+#endif
+
+//Pass what the firmware loaded into the TX FIFO to the SAFE side
+static void sim_uart_drain(void){
+	if (sim_uart3_out_len > 0){
+		sim_tlm_monitor(sim_uart3_out, sim_uart3_out_len);
+#ifdef SENSOR_TRACE
+		sim_trace_capture(sim_uart3_out, sim_uart3_out_len);
+#endif
+		fwrite(sim_uart3_out, 1, sim_uart3_out_len, sim_uart_file);
+		sim_uart_tx_bytes += sim_uart3_out_len;
+		sim_uart3_out_len = 0;
+	}
+}
+
+static void sim_uart_thre_irq(void){
+	sim_uart_thre_pending = false;
+	sim_uart3.IIR = UART_IIR_INTID_THRE;
+	sim_irq(UART3_IRQn, UART3_IRQHandler);
+	sim_uart3.IIR = UART_IIR_INTSTAT_PEND;
+}
+
+//One character left the TX FIFO, THRE interrupt once it is empty
+static void sim_uart_shift(void){
+	sim_uart_drain();
+	sim_uart3_fifo--;
+	sim_uart_next = (sim_uart3_fifo > 0) ? sim_uart_next + SIM_UART_CHAR : SIM_NEVER;
+	if ((sim_uart3_fifo == 0) && sim_uart_thre_int){
+		//Stays pending while UART3 is disabled in the NVIC
+		sim_uart_thre_pending = true;
+		if (sim_nvic_enabled[UART3_IRQn]){
+			sim_uart_thre_irq();
+		}
+	}
+}
+
+static bool sim_uart_rx_ready(void){
+	return (sim_rx_count > 0) && sim_uart_rbr_int && sim_nvic_enabled[UART3_IRQn] &&
+			((sim_rx_count >= sim_rx_trigger) || (sim_now >= sim_rx_timeout));
+}
+
+//RDA at the trigger level, CTI for chars left below it
+//Interrupt stays asserted until the handler has read the FIFO below the trigger level
+static void sim_uart_rx_irq(void){
+	sim_uart3.IIR = (sim_rx_count >= sim_rx_trigger) ? UART_IIR_INTID_RDA : UART_IIR_INTID_CTI;
+	sim_irq(UART3_IRQn, UART3_IRQHandler);
+	sim_uart3.IIR = UART_IIR_INTSTAT_PEND;
+	if (sim_now >= sim_rx_timeout){
+		sim_rx_timeout = sim_now + 4 * SIM_UART_CHAR;	//CTI again only if the handler left chars behind
+	}
+}
+
+//A char from SAFE reaches the RX FIFO
+static void sim_uart_rx_put(char c){
+	sim_uart_rx_bytes++;
+	if (sim_rx_count < SIM_UART_RX_FIFO){
+		sim_rx_fifo[sim_rx_count++] = c;
+	}
+	else{
+		sim_rx_overrun = true;
+		sim_uart_rx_overruns++;
+	}
+	sim_rx_timeout = sim_now + 4 * SIM_UART_CHAR;
+}
+
+//Next scripted keystroke reaches the RX FIFO
+static void sim_uart_rx_arrive(void){
+	sim_uart_rx_put(sim_rx_line[sim_rx_sent++ % sim_rx_line_len]);
+	sim_rx_next = (--sim_rx_left > 0) ? sim_now + SIM_UART_CHAR : SIM_NEVER;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// I2C devices
+// Registers live in sim_i2c_regs in main.c, shared by the interrupt engine
+// mock and the polled baseboard drivers below
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void I2C_Init(LPC_I2C_TypeDef *I2Cx, uint32_t clockrate){
+}
+
+void I2C_Cmd(LPC_I2C_TypeDef *I2Cx, FunctionalState NewState){
+}
+
+//Polled drivers own the bus only while I2C2_IRQn is off (i2c_suspend()), on
+//the board I2C2_IRQHandler would take SI in the middle of their transfer.
+//Such a transfer fails here and is counted, sim_finish() then fails the run
+static bool sim_i2c_polled(void){
+	if (sim_nvic_enabled[I2C2_IRQn]){
+		sim_i2c_polled_irq_on++;
+		if (sim_verbose){
+			fprintf(stderr, "%10.3f ms  polled I2C transfer with I2C2_IRQn enabled\n", sim_ms());
+		}
+		return false;
+	}
+	return true;
+}
+
+Status I2C_MasterTransferData(LPC_I2C_TypeDef *I2Cx, I2C_M_SETUP_Type *TransferCfg, I2C_TRANSFER_OPT_Type Opt){
+	uint8_t addr = TransferCfg->sl_addr7bit & 0x7F;
+	uint8_t reg = 0;
+	uint32_t i;
+
+	sim_charge(SIM_COST_DRIVER + SIM_COST_I2C(TransferCfg->tx_length, TransferCfg->rx_length));
+	if (!sim_i2c_polled()){
+		TransferCfg->tx_count = 0;
+		TransferCfg->rx_count = 0;
+		return ERROR;
+	}
+	for (i = 0; i < TransferCfg->tx_length; i++){
+		if (i == 0){
+			reg = TransferCfg->tx_data[0];
+		}
+		else{
+			sim_i2c_regs[addr][reg++] = TransferCfg->tx_data[i];
+		}
+	}
+	for (i = 0; i < TransferCfg->rx_length; i++){
+		TransferCfg->rx_data[i] = sim_i2c_regs[addr][reg++];
+	}
+	TransferCfg->tx_count = TransferCfg->tx_length;
+	TransferCfg->rx_count = TransferCfg->rx_length;
+	return SUCCESS;
+}
+
+//ISL29003 interrupt: at the end of every integration cycle the top byte
+//of the reading is compared with INT_LT/INT_HT, enough readings in a row
+//outside the window set the CONTROL interrupt flag, which holds INT (P2.5)
+//low until firmware writes it back to 0
+#define SIM_LIGHT_CYCLE			(100 * SIM_CYCLES_PER_MS)	//16 bit integration time
+#define SIM_LIGHT_INT_PORT		2
+#define SIM_LIGHT_INT_PIN		5
+#define SIM_LIGHT_CONTROL		0x01
+#define SIM_LIGHT_INT_HT		0x02
+#define SIM_LIGHT_INT_LT		0x03
+#define SIM_LIGHT_INT_FLAG		0x20
+
+static uint32_t sim_light_outside = 0;					//readings in a row outside the window
+static uint64_t sim_light_changed = SIM_NEVER;			//scripted light change not yet detected
+static bool sim_algae_seen, sim_waste_seen;
+
+static void sim_light_cycle(void){
+	uint8_t *regs = sim_i2c_regs[LIGHT_I2C_ADDR];
+	uint8_t msb = regs[LIGHT_REG_DATA_LSB + 1];
+	static const uint32_t persist[4] = {1, 4, 8, 16};
+
+	sim_light_next += SIM_LIGHT_CYCLE;
+	if ((msb < regs[SIM_LIGHT_INT_LT]) || (msb > regs[SIM_LIGHT_INT_HT])){
+		sim_light_outside++;
+	}
+	else{
+		sim_light_outside = 0;
+	}
+	if (sim_light_outside >= persist[regs[SIM_LIGHT_CONTROL] & 3]){
+		regs[SIM_LIGHT_CONTROL] |= SIM_LIGHT_INT_FLAG;
+	}
+}
+
+//Time from the last scripted light change to PASSIVE mode raising a detection flag
+static void sim_light_report(const char *what){
+	if (sim_light_changed == SIM_NEVER){
+		fprintf(stderr, "%10.3f ms  %s detected\n", sim_ms(), what);
+	}
+	else{
+		fprintf(stderr, "%10.3f ms  %s detected %.1f ms after the light change\n", sim_ms(), what,
+				(double)(sim_now - sim_light_changed) / SIM_CYCLES_PER_MS);
+	}
+}
+
+static void sim_light_track(void){
+	if (Algae_Flag && !sim_algae_seen){
+		sim_light_report("algae");
+	}
+	if (Waste_Flag && !sim_waste_seen){
+		sim_light_report("waste");
+	}
+	sim_algae_seen = Algae_Flag;
+	sim_waste_seen = Waste_Flag;
+}
+
+static void sim_set_light(uint32_t lux){
+	uint32_t raw = ((lux << 16) + LIGHT_RANGE_K - 1) / LIGHT_RANGE_K;
+
+	if (raw > 0xFFFF){
+		raw = 0xFFFF;
+	}
+	sim_i2c_regs[LIGHT_I2C_ADDR][LIGHT_REG_DATA_LSB] = raw & 0xFF;
+	sim_i2c_regs[LIGHT_I2C_ADDR][LIGHT_REG_DATA_LSB + 1] = raw >> 8;
+}
+
+//MMA7455 level detection: in level mode a reading on an enabled axis at
+//or beyond LDTH (8g scale) latches INT1 in DETSRC, the INT1 pin (P0.3)
+//follows it until INTRST clears it
+#define SIM_ACC_INT_PORT		0
+#define SIM_ACC_INT_PIN			3
+#define SIM_ACC_DETSRC			0x0A
+#define SIM_ACC_MCTL			0x16
+#define SIM_ACC_INTRST			0x17
+#define SIM_ACC_CTL1			0x18
+#define SIM_ACC_LDTH			0x1A
+
+static uint64_t sim_acc_changed = SIM_NEVER;			//scripted acc change
+
+static void sim_acc_update(void){
+	uint8_t *regs = sim_i2c_regs[ACC_I2C_ADDR];
+	uint8_t ldth = regs[SIM_ACC_LDTH] & 0x7F;
+	int i;
+
+	if (regs[SIM_ACC_INTRST] & 0x01){
+		regs[SIM_ACC_DETSRC] &= ~0x01;
+	}
+	else if (((regs[SIM_ACC_MCTL] & 0x03) == 0x02) && (ldth > 0)){
+		for (i = 0; i < 3; i++){
+			int v = (int8_t)regs[ACC_REG_XOUT8 + i] / 4;			//2g counts to 8g counts
+
+			if (!(regs[SIM_ACC_CTL1] & (0x08 << i)) && ((v >= ldth) || (v <= -ldth))){
+				regs[SIM_ACC_DETSRC] |= 0x01;
+			}
+		}
+	}
+	sim_gpio_drive(SIM_ACC_INT_PORT, SIM_ACC_INT_PIN, regs[SIM_ACC_DETSRC] & 0x01);
+}
+
+//Time from a scripted acc change to ACC_MOTION_MODE waking the accelerometer up
+static void sim_acc_track(void){
+#ifdef ACC_MOTION_MODE
+	static bool sim_acc_was_moving = true;
+
+	if (acc_moving && !sim_acc_was_moving){
+		fprintf(stderr, "%10.3f ms  acc woke up %.1f ms after the acc change\n", sim_ms(),
+				(double)(sim_now - sim_acc_changed) / SIM_CYCLES_PER_MS);
+	}
+	if (!acc_moving && sim_acc_was_moving){
+		fprintf(stderr, "%10.3f ms  acc still, level detection\n", sim_ms());
+	}
+	sim_acc_was_moving = acc_moving;
+#endif
+}
+
+static void sim_set_acc(int8_t ax, int8_t ay, int8_t az){
+	sim_i2c_regs[ACC_I2C_ADDR][ACC_REG_XOUT8] = (uint8_t)ax;
+	sim_i2c_regs[ACC_I2C_ADDR][ACC_REG_XOUT8 + 1] = (uint8_t)ay;
+	sim_i2c_regs[ACC_I2C_ADDR][ACC_REG_XOUT8 + 2] = (uint8_t)az;
+}
+
+//LED n+4 is on when its 2 bit selector in LS0..LS3 is 01
+static uint16_t sim_pca9532_leds(void){
+	uint16_t leds = 0;
+	int i;
+
+	for (i = 0; i < 16; i++){
+		if (((sim_i2c_regs[PCA9532_I2C_ADDR][PCA9532_LS0_AUTO_INC + i/4] >> ((i % 4) * 2)) & 3) == PCA9532_LED_ON){
+			leds |= 1 << i;
+		}
+	}
+	return leds;
+}
+
+static void sim_i2c_event(void){
+	uint16_t leds;
+
+	sim_i2c_next = SIM_NEVER;
+	sim_irq(I2C2_IRQn, sim_i2c_step);
+
+	leds = sim_pca9532_leds();
+	if (leds != sim_led_array){
+		sim_led_array = leds;
+		if (sim_verbose){
+			fprintf(stderr, "%10.3f ms  led array %04x\n", sim_ms(), leds);
+		}
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// SSP1 and baseboard drivers
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void SSP_ConfigStructInit(SSP_CFG_Type *SSP_InitStruct){
+	SSP_InitStruct->CPHA = SSP_CPHA_FIRST;
+	SSP_InitStruct->CPOL = SSP_CPOL_HI;
+	SSP_InitStruct->ClockRate = 1000000;
+	SSP_InitStruct->Databit = SSP_DATABIT_8;
+	SSP_InitStruct->Mode = SSP_MASTER_MODE;
+	SSP_InitStruct->FrameFormat = SSP_FRAME_SPI;
+}
+
+void SSP_Init(LPC_SSP_TypeDef *SSPx, SSP_CFG_Type *SSP_ConfigStruct){
+}
+
+void SSP_Cmd(LPC_SSP_TypeDef *SSPx, FunctionalState NewState){
+	SSPx->SR = SSP_SR_TFE | SSP_SR_TNF;
+}
+
+int32_t SSP_ReadWrite(LPC_SSP_TypeDef *SSPx, SSP_DATA_SETUP_Type *dataCfg, SSP_TRANSFER_Type xfType){
+	sim_charge(SIM_COST_DRIVER + SIM_COST_SSP_BYTE * dataCfg->length);
+	dataCfg->tx_cnt = dataCfg->length;
+	dataCfg->rx_cnt = dataCfg->length;
+	return dataCfg->length;
+}
+
+void SSP_SendData(LPC_SSP_TypeDef *SSPx, uint16_t Data){
+}
+
+uint16_t SSP_ReceiveData(LPC_SSP_TypeDef *SSPx){
+	return 0;
+}
+
+void SSP_DMACmd(LPC_SSP_TypeDef *SSPx, uint32_t DMAMode, FunctionalState NewState){
+	if (NewState == ENABLE){
+		SSPx->DMACR |= DMAMode;
+	}
+	else{
+		SSPx->DMACR &= ~DMAMode;
+	}
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// GPDMA and the SSP1 devices
+// Only the SSP1 pairing main.c uses is modelled: a memory to SSP1 TX
+// channel runs once enabled with TX DMA on in SSP1, and completes
+// TransferSize bytes at the SSP1 bit rate later. The bytes go to whichever
+// chip select is low: the OLED decodes the SSD1305 page and column address
+// commands and stores pixels in sim_oled_gram, the 7 segment display keeps
+// the last pattern. An enabled SSP1 RX channel fills its destination and
+// reaches terminal count with it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_OLED_CS_PORT		0
+#define SIM_OLED_CS_PIN			6
+#define SIM_OLED_DC_PORT		2
+#define SIM_OLED_DC_PIN			7
+#define SIM_7SEG_CS_PORT		2
+#define SIM_7SEG_CS_PIN			2
+
+#define SIM_OLED_POWER_UP		0x55					//display RAM before the first write
+
+uint8_t sim_oled_gram[OLED_DISPLAY_HEIGHT / 8][OLED_DISPLAY_WIDTH];		//what the panel shows
+static uint8_t sim_oled_page = 0;
+static uint8_t sim_oled_col = 0;						//SSD1305 column, first visible is OLED_X_OFFSET
+
+static GPDMA_Channel_CFG_Type sim_dma_cfg[GPDMA_NUMBER_CHANNELS];
+static bool sim_dma_on[GPDMA_NUMBER_CHANNELS];
+static uint8_t sim_dma_tc = 0;							//terminal count status, one bit per channel
+static int sim_dma_active = -1;							//TX channel in flight
+
+static bool sim_pin_low(int port, int pin){
+	return (sim_gpio[port].FIOPIN & (1u << pin)) == 0;
+}
+
+static void sim_oled_write(uint8_t b, bool data){
+	if (data){
+		if ((sim_oled_col >= OLED_X_OFFSET) && (sim_oled_col < OLED_X_OFFSET + OLED_DISPLAY_WIDTH)){
+			sim_oled_gram[sim_oled_page][sim_oled_col - OLED_X_OFFSET] = b;
+		}
+		sim_oled_col++;
+	}
+	else if ((b & 0xF8) == 0xB0){
+		sim_oled_page = b & 0x07;
+	}
+	else if ((b & 0xF0) == 0x00){
+		sim_oled_col = (sim_oled_col & 0xF0) | (b & 0x0F);
+	}
+	else if ((b & 0xF0) == 0x10){
+		sim_oled_col = (sim_oled_col & 0x0F) | ((b & 0x0F) << 4);
+	}
+}
+
+//Bytes of the pages the firmware has sent that the panel shows differently
+static uint32_t sim_oled_stale(void){
+	uint32_t stale = 0;
+	int page, col;
+
+	for (page = 0; page < OLED_PAGES; page++){
+		if ((oled_dirty_min[page] != OLED_CLEAN) || (oled_data_xfer[page].status == SSP_XFER_PENDING)){
+			continue;									//not sent yet or still going out
+		}
+		for (col = 0; col < OLED_DISPLAY_WIDTH; col++){
+			stale += (sim_oled_gram[page][col] != oled_fb[page][col]);
+		}
+	}
+	return stale;
+}
+
+//Print what the panel shows, one char per pixel
+static void sim_oled_dump(FILE *out){
+	int row, col;
+
+	for (row = 0; row < OLED_DISPLAY_HEIGHT; row++){
+		for (col = 0; col < OLED_DISPLAY_WIDTH; col++){
+			fputc((sim_oled_gram[row >> 3][col] >> (row & 7)) & 1 ? '#' : '.', out);
+		}
+		fputc('\n', out);
+	}
+}
+
+void GPDMA_Init(void){
+	memset(sim_dma_on, 0, sizeof(sim_dma_on));
+	sim_dma_tc = 0;
+	sim_dma_active = -1;
+	sim_dma_next = SIM_NEVER;
+}
+
+Status GPDMA_Setup(GPDMA_Channel_CFG_Type *GPDMAChannelConfig){
+	sim_charge(SIM_COST_DRIVER);
+	if (sim_dma_on[GPDMAChannelConfig->ChannelNum]){
+		return ERROR;
+	}
+	sim_dma_cfg[GPDMAChannelConfig->ChannelNum] = *GPDMAChannelConfig;
+	return SUCCESS;
+}
+
+IntStatus GPDMA_IntGetStatus(GPDMA_Status_Type type, uint8_t channel){
+	sim_charge(SIM_COST_DRIVER);
+	if ((type == GPDMA_STAT_INTTC) || (type == GPDMA_STAT_RAWINTTC) || (type == GPDMA_STAT_INT)){
+		return (sim_dma_tc & (1 << channel)) ? SET : RESET;
+	}
+	if (type == GPDMA_STAT_ENABLED_CH){
+		return sim_dma_on[channel] ? SET : RESET;
+	}
+	return RESET;
+}
+
+void GPDMA_ClearIntPending(GPDMA_StateClear_Type type, uint8_t channel){
+	sim_charge(SIM_COST_DRIVER);
+	if (type == GPDMA_STATCLR_INTTC){
+		sim_dma_tc &= ~(1 << channel);
+	}
+}
+
+void GPDMA_ChannelCmd(uint8_t channelNum, FunctionalState NewState){
+	GPDMA_Channel_CFG_Type *cfg = &sim_dma_cfg[channelNum];
+
+	sim_charge(SIM_COST_DRIVER);
+	sim_dma_on[channelNum] = (NewState == ENABLE);
+	if ((NewState == ENABLE) && (cfg->TransferType == GPDMA_TRANSFERTYPE_M2P) &&
+			(cfg->DstConn == GPDMA_CONN_SSP1_Tx) && (sim_ssp1.DMACR & SSP_DMA_TX)){
+		sim_dma_active = channelNum;
+		sim_dma_next = sim_now + SIM_SSP_BYTE * cfg->TransferSize;
+	}
+}
+
+//Last bit of the TX channel's transfer is out, deliver it and raise terminal count
+static void sim_dma_event(void){
+	GPDMA_Channel_CFG_Type *tx = &sim_dma_cfg[sim_dma_active];
+	const uint8_t *src = (const uint8_t *)tx->SrcMemAddr;
+	bool oled = sim_pin_low(SIM_OLED_CS_PORT, SIM_OLED_CS_PIN);
+	bool seg = sim_pin_low(SIM_7SEG_CS_PORT, SIM_7SEG_CS_PIN);
+	uint32_t i;
+	int n;
+
+	if (oled == seg){
+		sim_ssp_cs_errors++;
+	}
+	for (i = 0; i < tx->TransferSize; i++){
+		if (oled && !seg){
+			sim_oled_write(src[i], !sim_pin_low(SIM_OLED_DC_PORT, SIM_OLED_DC_PIN));
+		}
+		else if (seg && !oled){
+			sim_7seg = (src[i] == 0xFF) ? ' ' : src[i];
+			if (sim_verbose){
+				fprintf(stderr, "%10.3f ms  7seg '%c'\n", sim_ms(), sim_7seg);
+			}
+		}
+	}
+	sim_ssp_dma_bytes += tx->TransferSize;
+
+	for (n = 0; n < GPDMA_NUMBER_CHANNELS; n++){
+		GPDMA_Channel_CFG_Type *rx = &sim_dma_cfg[n];
+
+		if (sim_dma_on[n] && (rx->TransferType == GPDMA_TRANSFERTYPE_P2M) && (rx->SrcConn == GPDMA_CONN_SSP1_Rx) &&
+				(sim_ssp1.DMACR & SSP_DMA_RX)){
+			memset((void *)rx->DstMemAddr, 0xFF, rx->TransferSize);	//MISO idles high
+			sim_dma_on[n] = false;
+			sim_dma_tc |= 1 << n;
+		}
+	}
+	sim_dma_on[sim_dma_active] = false;
+	sim_dma_tc |= 1 << sim_dma_active;
+	sim_dma_active = -1;
+	sim_dma_next = SIM_NEVER;
+}
+
+void joystick_init(void){
+}
+
+uint8_t joystick_read(void){
+	return sim_joystick;
+}
+
+void rotary_init(void){
+}
+
+uint8_t rotary_read(void){
+	if (sim_rotary_steps > 0){
+		sim_rotary_steps--;
+		return ROTARY_RIGHT;
+	}
+	if (sim_rotary_steps < 0){
+		sim_rotary_steps++;
+		return ROTARY_LEFT;
+	}
+	return ROTARY_WAIT;
+}
+
+void led7seg_init(void){
+}
+
+void led7seg_setChar(uint8_t ch, uint32_t rawMode){
+	sim_charge(SIM_COST_DRIVER + SIM_COST_SSP_BYTE);
+	sim_7seg = ch;
+	if (sim_verbose){
+		fprintf(stderr, "%10.3f ms  7seg '%c'\n", sim_ms(), ch);
+	}
+}
+
+void pca9532_init(void){
+	sim_charge(SIM_COST_I2C(9, 0));					//auto increment write of PSC0..LS3
+	sim_i2c_polled();
+}
+
+void pca9532_setLeds(uint16_t ledOnMask, uint16_t ledOffMask){
+	uint16_t leds = (sim_pca9532_leds() | ledOnMask) & ~ledOffMask;
+	int i;
+
+	sim_charge(SIM_COST_I2C(1, 4) + SIM_COST_I2C(5, 0));	//read modify write of LS0..LS3
+	if (!sim_i2c_polled()){
+		return;
+	}
+	for (i = 0; i < 4; i++){
+		sim_i2c_regs[PCA9532_I2C_ADDR][PCA9532_LS0_AUTO_INC + i] = 0;
+	}
+	for (i = 0; i < 16; i++){
+		if (leds & (1 << i)){
+			sim_i2c_regs[PCA9532_I2C_ADDR][PCA9532_LS0_AUTO_INC + i/4] |= PCA9532_LED_ON << ((i % 4) * 2);
+		}
+	}
+}
+
+void acc_init(void){
+	sim_charge(SIM_COST_I2C(1, 1) + SIM_COST_I2C(2, 0));	//read modify write of the mode register
+	sim_i2c_polled();
+}
+
+void acc_read(int8_t *x, int8_t *y, int8_t *z){
+	sim_charge(SIM_COST_I2C(1, 3));
+	if (!sim_i2c_polled()){
+		return;
+	}
+	*x = (int8_t)sim_i2c_regs[ACC_I2C_ADDR][ACC_REG_XOUT8];
+	*y = (int8_t)sim_i2c_regs[ACC_I2C_ADDR][ACC_REG_XOUT8 + 1];
+	*z = (int8_t)sim_i2c_regs[ACC_I2C_ADDR][ACC_REG_XOUT8 + 2];
+}
+
+void acc_setRange(acc_range_t range){
+}
+
+void acc_setMode(acc_mode_t mode){
+}
+
+//SSD1305 display RAM is not cleared at power up, start from a pattern
+//that any page the firmware never sends leaves on the panel
+void oled_init(void){
+	sim_charge(SIM_COST_OLED_POWER + (SIM_COST_DRIVER + SIM_COST_SSP_BYTE) * SIM_OLED_INIT_BYTES);
+	memset(sim_oled_gram, SIM_OLED_POWER_UP, sizeof(sim_oled_gram));
+}
+
+void oled_putPixel(uint8_t x, uint8_t y, oled_color_t color){
+	fb_putPixel(x, y, color);
+	fb_flush();
+}
+
+void oled_clearScreen(oled_color_t color){
+	fb_clearScreen(color);
+	fb_flush();
+}
+
+uint8_t oled_putChar(uint8_t x, uint8_t y, uint8_t ch, oled_color_t fb, oled_color_t bg){
+	uint8_t ok = fb_putChar(x, y, ch, fb, bg);
+
+	fb_flush();
+	return ok;
+}
+
+void oled_putString(uint8_t x, uint8_t y, uint8_t *pStr, oled_color_t fb, oled_color_t bg){
+	fb_putString(x, y, pStr, fb, bg);
+	fb_flush();
+}
+
+void rgb_init(void){
+}
+
+void rgb_setLeds(uint8_t ledMask){
+	if (ledMask & RGB_RED){
+		GPIO_SetValue(2, 1 << 0);
+	}
+	else{
+		GPIO_ClearValue(2, 1 << 0);
+	}
+	if (ledMask & RGB_BLUE){
+		GPIO_SetValue(0, 1 << 26);
+	}
+	else{
+		GPIO_ClearValue(0, 1 << 26);
+	}
+}
+
+void temp_init(uint32_t (*getMsTicks)(void)){
+}
+
+int32_t temp_read(void){
+	return sim_temp;
+}
+
+void light_init(void){
+	sim_charge(SIM_COST_DRIVER);
+}
+
+void light_enable(void){
+	sim_charge(SIM_COST_I2C(2, 0) * 2);				//command and range registers
+	sim_i2c_polled();
+}
+
+uint32_t light_read(void){
+	uint32_t raw;
+
+	sim_charge(SIM_COST_I2C(1, 1) * 2);
+	if (!sim_i2c_polled()){
+		return 0;
+	}
+	raw = sim_i2c_regs[LIGHT_I2C_ADDR][LIGHT_REG_DATA_LSB] | (sim_i2c_regs[LIGHT_I2C_ADDR][LIGHT_REG_DATA_LSB + 1] << 8);
+	return (LIGHT_RANGE_K * raw) >> 16;
+}
+
+void light_setMode(light_mode_t mode){
+}
+
+void light_setWidth(light_width_t width){
+}
+
+void light_setRange(light_range_t newRange){
+}
+
+void light_setHiThreshold(uint32_t luxTh){
+}
+
+void light_setLoThreshold(uint32_t luxTh){
+}
+
+void light_setIrqInCycles(light_cycle_t cycles){
+}
+
+uint8_t light_getIrqStatus(void){
+	return 0;
+}
+
+void light_clearIrqStatus(void){
+}
+
+void light_shutdown(void){
+}
+
+#ifdef FLASH_LOG
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// On-chip flash
+// Only the log sectors exist, sim_flash holds them and -F keeps them in a
+// file between runs. IAP commands check their arguments like the boot ROM,
+// program only clears bits, and are charged the datasheet program and erase
+// times (interrupts are off around the call, so time moves on afterwards).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_FLASH_SIZE			(FLOG_SECTORS * FLOG_SECTOR_SIZE)
+#define SIM_FLASH_PROG			(1 * SIM_CYCLES_PER_MS)		//256 byte page
+#define SIM_FLASH_ERASE			(100 * SIM_CYCLES_PER_MS)	//32kB sector
+#define SIM_IAP_INVALID_COMMAND	1
+#define SIM_IAP_SRC_ADDR_ERROR	2
+#define SIM_IAP_DST_ADDR_ERROR	3
+#define SIM_IAP_COUNT_ERROR		6
+#define SIM_IAP_INVALID_SECTOR	7
+#define SIM_IAP_NOT_PREPARED	9
+
+uint8_t sim_flash[SIM_FLASH_SIZE];
+static const char *sim_flash_path = NULL;				//-F
+static FILE *sim_flash_file = NULL;
+static uint32_t sim_flash_prepared = 0;					//sector mask, cleared by copy and erase
+static uint32_t sim_flash_programs = 0;
+static uint32_t sim_flash_erases = 0;
+
+static void sim_flash_open(void){
+	memset(sim_flash, 0xFF, sizeof(sim_flash));
+	if (sim_flash_path == NULL){
+		return;
+	}
+	sim_flash_file = fopen(sim_flash_path, "r+b");
+	if (sim_flash_file != NULL){
+		if (fread(sim_flash, 1, sizeof(sim_flash), sim_flash_file) != sizeof(sim_flash)){
+			fprintf(stderr, "sim: %s is not a %u byte flash image, starting blank\n", sim_flash_path, SIM_FLASH_SIZE);
+			memset(sim_flash, 0xFF, sizeof(sim_flash));
+		}
+		rewind(sim_flash_file);
+	}
+	else{
+		sim_flash_file = fopen(sim_flash_path, "w+b");
+	}
+	if ((sim_flash_file == NULL) || (fwrite(sim_flash, 1, sizeof(sim_flash), sim_flash_file) != sizeof(sim_flash))){
+		perror(sim_flash_path);
+		exit(1);
+	}
+	fflush(sim_flash_file);
+}
+
+static void sim_flash_save(uint32_t off, uint32_t len){
+	if (sim_flash_file == NULL){
+		return;
+	}
+	fseek(sim_flash_file, off, SEEK_SET);
+	fwrite(&sim_flash[off], 1, len, sim_flash_file);
+	fflush(sim_flash_file);
+}
+
+//Log sectors as bits of a mask, 0 if the range is not all log sectors
+static uint32_t sim_flash_sectors(uintptr_t start, uintptr_t end){
+	if ((start < FLOG_FIRST_SECTOR) || (end < start) || (end >= FLOG_FIRST_SECTOR + FLOG_SECTORS)){
+		return 0;
+	}
+	return ((2u << (end - FLOG_FIRST_SECTOR)) - 1) & ~((1u << (start - FLOG_FIRST_SECTOR)) - 1);
+}
+
+void sim_iap(uintptr_t *cmd, uintptr_t *result){
+	uint32_t mask, off, i;
+	uint8_t *src;
+
+	sim_charge(SIM_COST_DRIVER);
+	result[0] = IAP_CMD_SUCCESS;
+	switch (cmd[0]){
+	case IAP_PREPARE:
+		mask = sim_flash_sectors(cmd[1], cmd[2]);
+		if (mask == 0){
+			result[0] = SIM_IAP_INVALID_SECTOR;
+		}
+		sim_flash_prepared |= mask;
+		break;
+	case IAP_COPY_RAM_TO_FLASH:
+		off = cmd[1] - (uintptr_t)sim_flash;
+		src = (uint8_t *)cmd[2];
+		if ((cmd[1] < (uintptr_t)sim_flash) || (off >= SIM_FLASH_SIZE) || (off % FLOG_PAGE_SIZE)){
+			result[0] = SIM_IAP_DST_ADDR_ERROR;
+		}
+		else if (cmd[2] & 3){
+			result[0] = SIM_IAP_SRC_ADDR_ERROR;
+		}
+		else if ((cmd[3] != 256) && (cmd[3] != 512) && (cmd[3] != 1024) && (cmd[3] != 4096)){
+			result[0] = SIM_IAP_COUNT_ERROR;
+		}
+		else if ((off + cmd[3] > SIM_FLASH_SIZE) ||
+				!(sim_flash_prepared & (1u << (off / FLOG_SECTOR_SIZE)))){
+			result[0] = SIM_IAP_NOT_PREPARED;
+		}
+		else{
+			for (i = 0; i < cmd[3]; i++){
+				sim_flash[off + i] &= src[i];			//programming only clears bits
+			}
+			sim_flash_save(off, cmd[3]);
+			sim_flash_programs++;
+			sim_charge(SIM_FLASH_PROG);
+		}
+		sim_flash_prepared = 0;
+		break;
+	case IAP_ERASE:
+		mask = sim_flash_sectors(cmd[1], cmd[2]);
+		if (mask == 0){
+			result[0] = SIM_IAP_INVALID_SECTOR;
+		}
+		else if ((sim_flash_prepared & mask) != mask){
+			result[0] = SIM_IAP_NOT_PREPARED;
+		}
+		else{
+			off = (cmd[1] - FLOG_FIRST_SECTOR) * FLOG_SECTOR_SIZE;
+			memset(&sim_flash[off], 0xFF, (cmd[2] - cmd[1] + 1) * FLOG_SECTOR_SIZE);
+			sim_flash_save(off, (cmd[2] - cmd[1] + 1) * FLOG_SECTOR_SIZE);
+			sim_flash_erases += cmd[2] - cmd[1] + 1;
+			sim_charge(SIM_FLASH_ERASE * (cmd[2] - cmd[1] + 1));
+		}
+		sim_flash_prepared = 0;
+		break;
+	case IAP_BLANK_CHECK:
+		mask = sim_flash_sectors(cmd[1], cmd[2]);
+		if (mask == 0){
+			result[0] = SIM_IAP_INVALID_SECTOR;
+			break;
+		}
+		off = (cmd[1] - FLOG_FIRST_SECTOR) * FLOG_SECTOR_SIZE;
+		for (i = off; i < (cmd[2] - FLOG_FIRST_SECTOR + 1) * FLOG_SECTOR_SIZE; i++){
+			if (sim_flash[i] != 0xFF){
+				result[0] = IAP_SECTOR_NOT_BLANK;
+				result[1] = FLOG_BASE + (i & ~3u);		//first non blank word
+				result[2] = sim_flash[i & ~3u] | (sim_flash[(i & ~3u) + 1] << 8) |
+						(sim_flash[(i & ~3u) + 2] << 16) | ((uint32_t)sim_flash[(i & ~3u) + 3] << 24);
+				break;
+			}
+		}
+		break;
+	default:
+		result[0] = SIM_IAP_INVALID_COMMAND;
+	}
+}
+#endif
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Input script
+// One event per line: <time ms> <command> [args], '#' starts a comment
+//   sw4 [hold ms]          press SW4 (mode toggle)
+//   sw3 [hold ms]          press SW3 (get information in DATE mode)
+//   rotary <steps>         turn rotary switch, negative steps turn left
+//   joy <dir> [hold ms]    hold joystick up/down/left/right/center
+//   key <text>             type on the SAFE terminal, \s is a space
+//   flood <count> <text>   send count chars back to back, repeating text
+//   heartbeat <ms>         SAFE sends '\r' every ms from now on, 0 stops it
+//   light <lux>            light sensor reading
+//   acc <x> <y> <z>        raw accelerometer reading
+//   temp <0.1 deg C>       true temperature at the sensor
+//   expect <value> <n> [tolerance]
+//                          the run fails unless the firmware's value is n:
+//                          temp (0.1 deg C), acc_wakeups (-DACC_MOTION_MODE)
+//   dump                   print the OLED panel to stderr
+//   quit                   end the run
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+	uint64_t at;										//cycles
+	char cmd[16];
+	char arg[64];
+	int line;
+} SIM_EVENT;
+
+static SIM_EVENT *sim_script = NULL;
+static uint32_t sim_script_len = 0;
+static uint32_t sim_script_pos = 0;
+
+//Joystick response: time from a scripted press to the cursor first moving
+//(main flushes the OLED in the same pass) and to it reaching the display edge
+static int sim_joy_distance(void){
+	int dx = abs((int)cursor_x - sim_joy_from_x);
+	int dy = abs((int)cursor_y - sim_joy_from_y);
+
+	return (dx > dy) ? dx : dy;
+}
+
+static void sim_joy_track(void){
+	bool edge;
+
+	if ((sim_joy_pressed == SIM_NEVER) || (sim_joystick == 0)){
+		return;
+	}
+	if (!sim_joy_moved && ((cursor_x != sim_joy_from_x) || (cursor_y != sim_joy_from_y))){
+		sim_joy_moved = true;
+		fprintf(stderr, "%10.3f ms  joy first move after %.1f ms\n", sim_ms(),
+				(double)(sim_now - sim_joy_pressed) / SIM_CYCLES_PER_MS);
+	}
+	edge = ((sim_joystick & JOYSTICK_UP) && (cursor_y == 0)) ||
+			((sim_joystick & JOYSTICK_DOWN) && (cursor_y == OLED_DISPLAY_HEIGHT-1)) ||
+			((sim_joystick & JOYSTICK_LEFT) && (cursor_x == 0)) ||
+			((sim_joystick & JOYSTICK_RIGHT) && (cursor_x == OLED_DISPLAY_WIDTH-1));
+	if (sim_joy_moved && edge){
+		fprintf(stderr, "%10.3f ms  joy reached the edge after %.1f ms, %d px\n", sim_ms(),
+				(double)(sim_now - sim_joy_pressed) / SIM_CYCLES_PER_MS, sim_joy_distance());
+		sim_joy_pressed = SIM_NEVER;
+	}
+}
+
+//Script check of a firmware value, the run fails if it is off by more than tolerance
+static void sim_expect(const char *name, int want, int tolerance){
+	int have;
+
+	if (strcmp(name, "temp") == 0){
+		have = temperature;
+	}
+#ifdef ACC_MOTION_MODE
+	else if (strcmp(name, "acc_wakeups") == 0){
+		have = (int)acc_wakeups;
+	}
+#endif
+	else{
+		fprintf(stderr, "%10.3f ms  expect %s is not known in this build\n", sim_ms(), name);
+		exit(1);
+	}
+	sim_expects++;
+	if ((have < want - tolerance) || (have > want + tolerance)){
+		fprintf(stderr, "%10.3f ms  FAIL expect %s %d+-%d, firmware has %d\n", sim_ms(), name, want, tolerance, have);
+		sim_expects_failed++;
+	}
+}
+
+static void sim_finish(void);
+
+static void sim_load_script(const char *path){
+	FILE *f = fopen(path, "r");
+	char line[128];
+	unsigned long ms;
+	int n;
+	int line_no = 0;
+	uint64_t last = 0;
+
+	if (f == NULL){
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)){
+		SIM_EVENT *ev;
+		char *p;
+
+		line_no++;
+		if ((p = strchr(line, '#')) != NULL){
+			*p = '\0';
+		}
+		if ((p = strpbrk(line, "\r\n")) != NULL){
+			*p = '\0';
+		}
+		sim_script = realloc(sim_script, (sim_script_len + 1) * sizeof(SIM_EVENT));
+		ev = &sim_script[sim_script_len];
+		memset(ev, 0, sizeof(*ev));
+		if (sscanf(line, "%lu %15s %n", &ms, ev->cmd, &n) < 2){
+			continue;									//blank or comment
+		}
+		strncpy(ev->arg, line + n, sizeof(ev->arg) - 1);
+		for (p = ev->arg + strlen(ev->arg); p > ev->arg && isspace((unsigned char)p[-1]); p--){
+			p[-1] = '\0';								//drop padding before a comment
+		}
+		ev->at = (uint64_t)ms * SIM_CYCLES_PER_MS;
+		ev->line = line_no;
+		if (ev->at < last){
+			fprintf(stderr, "%s:%d: events must be in time order\n", path, line_no);
+			exit(1);
+		}
+		last = ev->at;
+		sim_script_len++;
+	}
+	fclose(f);
+}
+
+static uint64_t sim_hold(const char *arg){
+	int ms = SIM_BUTTON_HOLD;
+
+	sscanf(arg, "%d", &ms);
+	return sim_now + (uint64_t)ms * SIM_CYCLES_PER_MS;
+}
+
+static void sim_run_event(SIM_EVENT *ev){
+	int a, b, c;
+	char dir[16];
+
+	if (strcmp(ev->cmd, "sw4") == 0){
+		sim_gpio_drive(SIM_SW4_PORT, SIM_SW4_PIN, false);
+		sim_sw4_release = sim_hold(ev->arg);
+	}
+	else if (strcmp(ev->cmd, "sw3") == 0){
+		sim_gpio_drive(SIM_SW3_PORT, SIM_SW3_PIN, false);
+		sim_sw3_release = sim_hold(ev->arg);
+	}
+	else if (strcmp(ev->cmd, "rotary") == 0 && sscanf(ev->arg, "%d", &a) == 1){
+		sim_rotary_steps += a;
+	}
+	else if (strcmp(ev->cmd, "joy") == 0 && sscanf(ev->arg, "%15s %n", dir, &a) >= 1){
+		const char *names[5] = {"center", "up", "down", "left", "right"};
+		int i;
+
+		for (i = 0; i < 5; i++){
+			if (strcmp(dir, names[i]) == 0){
+				sim_joystick = 1 << i;
+				sim_joy_release = sim_hold(ev->arg + a);
+				if (i != 0){
+					sim_joy_pressed = sim_now;
+					sim_joy_from_x = cursor_x;
+					sim_joy_from_y = cursor_y;
+					sim_joy_moved = false;
+				}
+			}
+		}
+	}
+	else if ((strcmp(ev->cmd, "key") == 0) || (strcmp(ev->cmd, "flood") == 0 && sscanf(ev->arg, "%d %n", &a, &b) == 1)){
+		char *src = (ev->cmd[0] == 'f') ? ev->arg + b : ev->arg;
+		uint32_t len = 0;
+
+		while (*src && len < sizeof(sim_rx_line) - 1){
+			if (src[0] == '\\' && src[1] == 's'){
+				sim_rx_line[len++] = ' ';
+				src += 2;
+			}
+			else{
+				sim_rx_line[len++] = *src++;
+			}
+		}
+		sim_rx_line[len] = '\0';
+		sim_rx_line_len = len;
+		sim_rx_sent = 0;
+		sim_rx_left = (ev->cmd[0] == 'f') ? (uint32_t)a : len;
+		sim_rx_next = (len && sim_rx_left) ? sim_now : SIM_NEVER;
+	}
+	else if (strcmp(ev->cmd, "heartbeat") == 0 && sscanf(ev->arg, "%d", &a) == 1){
+		sim_heartbeat_period = (uint64_t)a * SIM_CYCLES_PER_MS;
+		sim_heartbeat_next = (a > 0) ? sim_now : SIM_NEVER;
+	}
+	else if (strcmp(ev->cmd, "light") == 0 && sscanf(ev->arg, "%d", &a) == 1){
+		sim_set_light(a);
+		sim_light_changed = sim_now;
+	}
+	else if (strcmp(ev->cmd, "acc") == 0 && sscanf(ev->arg, "%d %d %d", &a, &b, &c) == 3){
+		sim_set_acc(a, b, c);
+		sim_acc_changed = sim_now;
+	}
+	else if (strcmp(ev->cmd, "temp") == 0 && sscanf(ev->arg, "%d", &a) == 1){
+		sim_temp = a;
+	}
+	else if (strcmp(ev->cmd, "expect") == 0 && sscanf(ev->arg, "%15s %d %n", dir, &a, &c) >= 2){
+		b = 0;
+		sscanf(ev->arg + c, "%d", &b);					//optional tolerance
+		sim_expect(dir, a, b);
+	}
+	else if (strcmp(ev->cmd, "dump") == 0){
+		fprintf(stderr, "%10.3f ms  oled\n", sim_ms());
+		sim_oled_dump(stderr);
+	}
+	else if (strcmp(ev->cmd, "quit") == 0){
+		sim_finish();
+	}
+	else{
+		fprintf(stderr, "script line %d: bad event '%s %s'\n", ev->line, ev->cmd, ev->arg);
+		exit(1);
+	}
+}
+
+#ifdef SENSOR_TRACE
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Trace capture and replay
+// -T picks the trace frames of a dump ('t' typed on SAFE) out of the UART3
+// output and saves the trace image. -R replays an image instead of running
+// firmware main(): records go back to back through the firmware's own code
+//   sensors    light, x, y, z, then check_Waste, check_Algae and
+//              detection_case as passive_rgb_task runs them in PASSIVE
+//   temp       temperature
+//   joy        drawOled once per recorded poll, harvesting via check_filled
+//   key        queued in uart_rx_buf and run through charge_uart_input
+//   mode       the state PASSIVE and CHARGE start from
+// The report lists detection changes and CHARGE results, then DWT cycles
+// per record type for comparing builds (build like sim/bench.sh so the
+// cycle model charges firmware functions too). Last comes the batched
+// telemetry benchmark: the sensors records, with the temperature and
+// detections at the time, sent as TELEMETRY_BATCH records and decoded
+// again; ratio is single binary frames bytes per batch frame byte.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SIM_TRACE_IMAGE_MAX		(TRACE_IMAGE_HEADER + TRACE_BUF_SIZE)
+
+static const char *sim_trace_path = NULL;				//-T
+static uint8_t sim_trace_image[SIM_TRACE_IMAGE_MAX];
+static uint8_t sim_trace_frame[TLM_MAX_PAYLOAD * 2];		//COBS bytes since the last delimiter
+static uint32_t sim_trace_frame_len = 0;
+
+static void sim_trace_frame_done(void){
+	uint8_t payload[TLM_MAX_PAYLOAD * 2];
+	int len = tlm_decode_frame(sim_trace_frame, sim_trace_frame_len, payload, sizeof(payload));
+	uint32_t off;
+	FILE *f;
+
+	if ((len < 3) || (payload[0] != TLM_FRAME_TRACE)){
+		return;
+	}
+	off = payload[1] | (payload[2] << 8);
+	len -= 3;
+	if (off + len > SIM_TRACE_IMAGE_MAX){
+		fprintf(stderr, "sim: trace chunk at %u past the end of the image\n", off);
+		return;
+	}
+	if (len > 0){
+		memcpy(&sim_trace_image[off], &payload[3], len);
+		return;
+	}
+
+	//Empty chunk ends the dump
+	f = fopen(sim_trace_path, "wb");
+	if ((f == NULL) || (fwrite(sim_trace_image, 1, off, f) != off)){
+		perror(sim_trace_path);
+		exit(1);
+	}
+	fclose(f);
+	fprintf(stderr, "%10.3f ms  trace of %u bytes saved to %s\n", sim_ms(), off, sim_trace_path);
+}
+
+static void sim_trace_capture(const uint8_t *data, uint32_t len){
+	uint32_t i;
+
+	if (sim_trace_path == NULL){
+		return;
+	}
+	for (i = 0; i < len; i++){
+		if (data[i] == 0x00){
+			if (sim_trace_frame_len > 0){
+				sim_trace_frame_done();
+			}
+			sim_trace_frame_len = 0;
+		}
+		else if (sim_trace_frame_len < sizeof(sim_trace_frame)){
+			sim_trace_frame[sim_trace_frame_len++] = data[i];
+		}
+	}
+}
+
+static const char *sim_replay_names[TRACE_REC_COUNT] = {"", "sensors", "temp", "joy", "key", "mode"};
+
+static uint64_t sim_replay_t = 0;						//trace time in TRACE_TICK_US
+static char sim_replay_mode = ' ';
+
+static void sim_replay_note(const char *fmt, ...){
+	va_list args;
+
+	fprintf(stderr, "%10.1f ms  ", (double)sim_replay_t * TRACE_TICK_US / 1000);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+//What charge_run would end CHARGE mode on
+static void sim_replay_charge_check(void){
+	if (sim_replay_mode != 'C'){
+		return;
+	}
+	if (harvested == biofuel_count){
+		sim_replay_note("replay CHARGE full, cursor=%u,%u", cursor_x, cursor_y);
+		sim_replay_mode = ' ';
+	}
+	else if (EXIT){
+		sim_replay_note("replay CHARGE exit, harvested %d of %d", harvested, biofuel_count);
+		sim_replay_mode = ' ';
+	}
+	if (sim_replay_mode == ' '){
+		uart_rx_enable(false);
+		harvested = 0;
+	}
+}
+
+//Compression benchmark: every sensors record also goes through the batch
+//encoder as a telemetry record with the replayed temperature and detections,
+//each frame is decoded again and checked against what went in
+#define SIM_BATCH_LOG			1024
+
+static TLM_BATCH sim_batch;
+static TLM_SAMPLE sim_batch_log[SIM_BATCH_LOG];			//by seq
+static uint32_t sim_batch_records = 0;
+static uint32_t sim_batch_decoded = 0;
+static uint32_t sim_batch_frames = 0;
+static uint32_t sim_batch_errors = 0;
+static uint32_t sim_batch_text = 0;						//bytes the text records would take
+
+static bool sim_batch_same(const TLM_SAMPLE *a, const TLM_SAMPLE *b){
+	return (a->seq == b->seq) && (a->temp == b->temp) && (a->lux == b->lux) && (a->x == b->x) &&
+			(a->y == b->y) && (a->z == b->z) && (a->status == b->status);
+}
+
+static uint32_t sim_batch_check(const uint8_t *frame, uint32_t len){
+	uint8_t payload[TLM_MAX_PAYLOAD + 2];
+	TLM_SAMPLE got[TLM_BATCH_SAMPLES];
+	int n = tlm_decode_frame(&frame[1], len - 2, payload, sizeof(payload));	//without the delimiters
+	int i;
+
+	sim_batch_frames++;
+	n = (n < 0) ? -1 : tlm_decode_batch(payload, n, got);
+	if (n < 0){
+		sim_batch_errors++;
+		return len;
+	}
+	for (i = 0; i < n; i++){
+		if ((got[i].seq >= SIM_BATCH_LOG) || !sim_batch_same(&got[i], &sim_batch_log[got[i].seq])){
+			sim_batch_errors++;
+		}
+	}
+	sim_batch_decoded += n;
+	return len;
+}
+
+static void sim_batch_record(void){
+	char line[64];
+	TLM_SAMPLE s = {sim_batch_records, temperature, (light > 0xFFFF) ? 0xFFFF : light, x, y, z, status_bits()};
+
+	if (sim_batch_records >= SIM_BATCH_LOG){
+		return;
+	}
+	sim_batch_log[sim_batch_records++] = s;
+	sim_batch_text += text_sensor(line, s.seq, s.temp, s.lux, s.x, s.y, s.z);
+	tlm_batch_sample(&sim_batch, &s, (s.status & ~sim_batch.last.status) != 0, sim_batch_check);	//one trace, one visit
+}
+
+static void sim_replay_record(const TRACE_REC *rec, int *detected){
+	uint32_t i;
+	int now;
+
+	switch (rec->type){
+	case TRACE_REC_SENSORS:
+		light = rec->val[0];
+		x = unzigzag(rec->val[1]);
+		y = unzigzag(rec->val[2]);
+		z = unzigzag(rec->val[3]);
+		if (sim_replay_mode == 'P'){
+			now = detection_case(check_Waste(light), check_Algae(light));
+			if (now != *detected){
+				sim_replay_note("replay detection %d at light=%u", now, light);
+				*detected = now;
+			}
+		}
+		break;
+	case TRACE_REC_TEMP:
+		temperature = unzigzag(rec->val[0]);
+		break;
+	case TRACE_REC_JOY:
+		for (i = 0; (i < rec->val[1]) && (sim_replay_mode == 'C'); i++){
+			drawOled(rec->val[0]);
+			sim_replay_charge_check();
+		}
+		break;
+	case TRACE_REC_KEY:
+		if (sim_replay_mode == 'C'){
+			uart_rx_buf[uart_rx_head & (UART_RX_BUF_SIZE - 1)] = rec->val[0];
+			uart_rx_head++;
+			charge_uart_input();
+			sim_replay_charge_check();
+		}
+		break;
+	case TRACE_REC_MODE:
+		sim_replay_mode = rec->val[0];
+		sim_replay_note("replay mode %c", sim_replay_mode);
+		if (sim_replay_mode == 'P'){
+			Algae_Flag = false;
+			Waste_Flag = false;
+			*detected = 0;
+		}
+		else if (sim_replay_mode == 'C'){
+			EXIT = false;
+			uart_cmd_repeat = 0;
+			cursor_dir = 0;
+			fb_clearScreen(OLED_COLOR_BLACK);
+			biofuel_layout_load();
+			place_biofuel();
+			uart_rx_enable(true);
+		}
+		break;
+	}
+}
+
+static void sim_replay(const char *path){
+	static uint8_t image[SIM_TRACE_IMAGE_MAX];
+	uint32_t count[TRACE_REC_COUNT] = {0};
+	uint64_t cycles[TRACE_REC_COUNT] = {0};
+	struct timespec end;
+	TRACE_REC rec;
+	FILE *f = fopen(path, "rb");
+	uint32_t len, pos = TRACE_IMAGE_HEADER;
+	uint32_t records = 0, start;
+	int detected = 0;
+	double wall;
+	int i;
+
+	if (f == NULL){
+		perror(path);
+		exit(1);
+	}
+	len = fread(image, 1, sizeof(image), f);
+	fclose(f);
+	if ((len < TRACE_IMAGE_HEADER) || (image[0] != 'T') || (image[1] != 'R') || (image[2] != TRACE_IMAGE_VERSION) ||
+			(image[3] != TRACE_TICK_US) || (len != TRACE_IMAGE_HEADER + (image[4] | (image[5] << 8)))){
+		fprintf(stderr, "%s: not a version %d trace image\n", path, TRACE_IMAGE_VERSION);
+		exit(1);
+	}
+
+	//What main() sets up for the code being replayed: the OLED path and the cycle counter
+	trace_on = false;
+	sim_replaying = true;
+	ssp_dma_init();
+	priority_init();
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	sim_limit = SIM_NEVER;
+
+	while (trace_decode(image, len, &pos, &rec)){
+		sim_replay_t += rec.dt;
+		start = DWT->CYCCNT;
+		sim_replay_record(&rec, &detected);
+		cycles[rec.type] += DWT->CYCCNT - start;
+		count[rec.type]++;
+		if (rec.type == TRACE_REC_SENSORS){
+			sim_batch_record();							//outside the cycles of the record
+		}
+		records++;
+	}
+	ssp_drain();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wall = (end.tv_sec - sim_wall_start.tv_sec) + (end.tv_nsec - sim_wall_start.tv_nsec) / 1e9;
+	if (pos != len){
+		fprintf(stderr, "replay: corrupt record at byte %u\n", pos);
+	}
+	fprintf(stderr, "replay: %u records, %u dropped when recorded, %.3f s of trace in %.3f s host (%.0fx real time)\n",
+			records, image[6] | (image[7] << 8), (double)sim_replay_t * TRACE_TICK_US / 1e6, wall,
+			(wall > 0) ? (double)sim_replay_t * TRACE_TICK_US / 1e6 / wall : 0.0);
+	for (i = 1; i < TRACE_REC_COUNT; i++){
+		fprintf(stderr, "replay: %s count=%u cycles=%llu mean=%llu\n", sim_replay_names[i], count[i],
+				(unsigned long long)cycles[i], (unsigned long long)(count[i] ? cycles[i] / count[i] : 0));
+	}
+	fprintf(stderr, "replay: light=%u temperature=%d algae=%d waste=%d cursor=%u,%u harvested=%d oled crc=%04x\n",
+			light, (int)temperature, Algae_Flag, Waste_Flag, cursor_x, cursor_y, harvested,
+			crc16_ccitt(&oled_fb[0][0], sizeof(oled_fb)));
+	tlm_batch_flush(&sim_batch, sim_batch_check);
+	if (sim_batch_decoded != sim_batch_records){
+		sim_batch_errors++;
+	}
+	fprintf(stderr, "replay: batch records=%u frames=%u bytes=%u single=%u text=%u ratio=%u.%02u errors=%u\n",
+			sim_batch_records, sim_batch_frames, sim_batch.bytes, sim_batch.unbatched, sim_batch_text,
+			tlm_batch_ratio(&sim_batch) / 100, tlm_batch_ratio(&sim_batch) % 100, sim_batch_errors);
+	if (sim_verbose){
+		sim_oled_dump(stderr);
+	}
+	exit(((pos == len) && (sim_batch_errors == 0)) ? 0 : 1);
+}
+#endif
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Virtual clock
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static uint64_t sim_min(uint64_t a, uint64_t b){
+	return (a < b) ? a : b;
+}
+
+static uint64_t sim_next_event(void){
+	uint64_t next = SIM_NEVER;
+	int n;
+
+	//Work the firmware started since the last event
+	if ((sim_uart_next == SIM_NEVER) && (sim_uart3_fifo > 0)){
+		sim_uart_next = sim_now + SIM_UART_CHAR;
+	}
+	if ((sim_i2c_next == SIM_NEVER) && i2c_busy && sim_nvic_enabled[I2C2_IRQn]){
+		sim_i2c_next = sim_now + SIM_I2C_XFER;
+	}
+	if (sim_uart_rx_ready() || (sim_uart_thre_pending && sim_nvic_enabled[UART3_IRQn]) ||
+			(sim_dma_tc && sim_nvic_enabled[DMA_IRQn])){
+		return sim_now;
+	}
+
+	if (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk){
+		next = sim_systick_last + SysTick->LOAD + 1;
+	}
+	for (n = 0; n < 4; n++){
+		next = sim_min(next, sim_tim_next(n));
+	}
+	next = sim_min(next, sim_temp_next);
+	next = sim_min(next, sim_uart_next);
+	next = sim_min(next, sim_rx_next);
+	next = sim_min(next, sim_heartbeat_next);
+	if ((sim_rx_count > 0) && sim_uart_rbr_int && sim_nvic_enabled[UART3_IRQn]){
+		next = sim_min(next, sim_rx_timeout);
+	}
+	next = sim_min(next, sim_i2c_next);
+	next = sim_min(next, sim_dma_next);
+	next = sim_min(next, sim_light_next);
+	next = sim_min(next, sim_sw4_release);
+	next = sim_min(next, sim_sw3_release);
+	next = sim_min(next, sim_joy_release);
+	if (sim_script_pos < sim_script_len){
+		next = sim_min(next, sim_script[sim_script_pos].at);
+	}
+	return next;
+}
+
+//Handle every event due at sim_now
+static void sim_events(void){
+	int n;
+
+	if ((SysTick->CTRL & SysTick_CTRL_ENABLE_Msk) && (sim_now >= sim_systick_last + SysTick->LOAD + 1)){
+		sim_systick_last += SysTick->LOAD + 1;
+		SysTick->VAL = SysTick->LOAD;
+		sim_systick_count++;
+		if (SysTick->CTRL & SysTick_CTRL_TICKINT_Msk){
+			sim_exception(SysTick_Handler);
+		}
+	}
+	for (n = 0; n < 4; n++){
+		if (sim_now >= sim_tim_next(n)){
+			sim_tim_match(n);
+		}
+	}
+	if (sim_now >= sim_temp_next){
+		sim_temp_edge();
+	}
+	if (sim_now >= sim_i2c_next){
+		sim_i2c_event();
+	}
+	if (sim_now >= sim_dma_next){
+		sim_dma_event();
+	}
+	if (sim_now >= sim_light_next){
+		sim_light_cycle();
+	}
+	sim_gpio_drive(SIM_LIGHT_INT_PORT, SIM_LIGHT_INT_PIN, !(sim_i2c_regs[LIGHT_I2C_ADDR][SIM_LIGHT_CONTROL] & SIM_LIGHT_INT_FLAG));
+	sim_acc_update();
+	if (sim_dma_tc){
+		sim_irq(DMA_IRQn, DMA_IRQHandler);
+	}
+	if (sim_now >= sim_uart_next){
+		sim_uart_shift();
+	}
+	if (sim_uart_thre_pending && sim_nvic_enabled[UART3_IRQn]){
+		sim_uart_thre_irq();
+	}
+	if (sim_now >= sim_rx_next){
+		sim_uart_rx_arrive();
+	}
+	if (sim_now >= sim_heartbeat_next){
+		sim_uart_rx_put('\r');
+		sim_heartbeat_next += sim_heartbeat_period;
+	}
+	if (sim_uart_rx_ready()){
+		sim_uart_rx_irq();
+	}
+	if (sim_now >= sim_sw4_release){
+		sim_gpio_drive(SIM_SW4_PORT, SIM_SW4_PIN, true);
+		sim_sw4_release = SIM_NEVER;
+	}
+	if (sim_now >= sim_sw3_release){
+		sim_gpio_drive(SIM_SW3_PORT, SIM_SW3_PIN, true);
+		sim_sw3_release = SIM_NEVER;
+	}
+	if (sim_now >= sim_joy_release){
+		if (sim_joy_pressed != SIM_NEVER){
+			fprintf(stderr, "%10.3f ms  joy released after %.1f ms, %d px\n", sim_ms(),
+					(double)(sim_now - sim_joy_pressed) / SIM_CYCLES_PER_MS, sim_joy_distance());
+			sim_joy_pressed = SIM_NEVER;
+		}
+		sim_joystick = 0;
+		sim_joy_release = SIM_NEVER;
+	}
+	while ((sim_script_pos < sim_script_len) && (sim_now >= sim_script[sim_script_pos].at)){
+		sim_run_event(&sim_script[sim_script_pos++]);
+	}
+}
+
+//Handle events in time order up to target, then stop there
+static void sim_advance_to(uint64_t target){
+	uint64_t next;
+
+	while ((next = sim_next_event()) <= target){
+		if (next > sim_now){
+			sim_now = next;
+		}
+		sim_sync_core();
+		sim_events();
+	}
+	if (target > sim_now){
+		sim_now = target;
+	}
+	if (sim_now >= sim_limit){
+		sim_finish();
+	}
+	sim_sync_core();
+}
+
+//Sleep until the next interrupt: jump to the next event and raise it
+void __WFI(void){
+	uint64_t next;
+
+	sim_charge(0);
+	if (!sim_replaying){
+		sim_joy_track();
+		sim_light_track();
+		sim_acc_track();
+	}
+	next = sim_next_event();
+	if (next >= sim_limit){
+		sim_now = sim_limit;
+		sim_finish();
+	}
+	sim_now = next;
+	sim_sync_core();
+	sim_events();
+}
+
+static void sim_finish(void){
+	struct timespec end;
+	double wall;
+	int i;
+	double virt = (double)sim_now / SIM_CPU_HZ;
+
+	sim_uart_drain();
+	fflush(sim_uart_file);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wall = (end.tv_sec - sim_wall_start.tv_sec) + (end.tv_nsec - sim_wall_start.tv_nsec) / 1e9;
+
+	fprintf(stderr, "sim: %.3f s virtual in %.3f s host (%.0fx real time)\n", virt, wall, (wall > 0) ? virt / wall : 0.0);
+	fprintf(stderr, "sim: irq systick=%u timer0=%u timer3=%u eint3=%u uart3=%u i2c2=%u\n",
+			sim_systick_count, sim_irq_count[TIMER0_IRQn], sim_irq_count[TIMER3_IRQn],
+			sim_irq_count[EINT3_IRQn], sim_irq_count[UART3_IRQn], sim_irq_count[I2C2_IRQn]);
+	fprintf(stderr, "sim: uart3 tx=%u bytes rx=%u bytes rx_fifo_overruns=%u, i2c xfers=%u errors=%u polled_irq_on=%u, oled flushes=%u bytes=%u\n",
+			sim_uart_tx_bytes, sim_uart_rx_bytes, sim_uart_rx_overruns, i2c_xfer_count, i2c_error_count,
+			sim_i2c_polled_irq_on, oled_flush_count, oled_flush_bytes);
+	fprintf(stderr, "sim: ssp1 dma bytes=%u cs_errors=%u, firmware oled xfers=%u load=%u.%u%% wait_max=%uus, 7seg xfers=%u wait_max=%uus\n",
+			sim_ssp_dma_bytes, sim_ssp_cs_errors,
+			ssp_stats[SSP_DEV_OLED].xfers, ssp_bus_load(SSP_DEV_OLED) / 10, ssp_bus_load(SSP_DEV_OLED) % 10,
+			(unsigned)(ssp_stats[SSP_DEV_OLED].wait_max / SIM_CYCLES_PER_US),
+			ssp_stats[SSP_DEV_LED7SEG].xfers, (unsigned)(ssp_stats[SSP_DEV_LED7SEG].wait_max / SIM_CYCLES_PER_US));
+	fprintf(stderr, "sim: firmware cpu load=%u.%u%% since the last stats reset\n",
+			(unsigned)(sched_cpu_load() / 10), (unsigned)(sched_cpu_load() % 10));
+	fprintf(stderr, "sim: firmware uart3 rx=%u dropped=%u overrun=%u, cursor=%u,%u harvested=%d\n",
+			uart_rx_count, uart_rx_dropped, uart_rx_overrun, cursor_x, cursor_y, harvested);
+	fprintf(stderr, "sim: mode 7seg='%c' led array=%04x temperature=%d light=%u\n",
+			sim_7seg, sim_led_array, (int)temperature, light);
+#ifdef ACC_MOTION_MODE
+	fprintf(stderr, "sim: firmware acc wakeups=%u reads skipped=%u\n", (unsigned)acc_wakeups, (unsigned)acc_reads_skipped);
+#endif
+#ifdef BOOT_PROFILE
+	fprintf(stderr, "sim: firmware boot ready=%uus first temp=%uus passive=%uus first reading=%uus\n",
+			(unsigned)boot_marks[BOOT_MARK_READY], (unsigned)boot_marks[BOOT_MARK_TEMP],
+			(unsigned)boot_marks[BOOT_MARK_PASSIVE], (unsigned)boot_marks[BOOT_MARK_READING]);
+#endif
+	for (i = 0; i < TLM_CLASSES; i++){
+		if (tlm_stats[i].queued != 0){
+			fprintf(stderr, "sim: firmware tlm %s queued=%u sent=%u dropped=%u depth_max=%u latency mean=%uus max=%uus\n",
+					tlm_class_names[i], (unsigned)tlm_stats[i].queued, (unsigned)tlm_stats[i].sent,
+					(unsigned)tlm_stats[i].dropped, (unsigned)tlm_stats[i].depth_max,
+					(unsigned)(tlm_stats[i].sent ? tlm_stats[i].latency_sum / tlm_stats[i].sent / SIM_CYCLES_PER_US : 0),
+					(unsigned)(tlm_stats[i].latency_max / SIM_CYCLES_PER_US));
+		}
+	}
+	for (i = 0; i < (int)MODE_TRANSITIONS; i++){
+		if (mode_stats[i].count != 0){
+			fprintf(stderr, "sim: firmware mode %s>%s event=%s count=%u latency mean=%uus max=%uus\n",
+					mode_states[mode_transitions[i].state].name, mode_states[mode_transitions[i].target].name,
+					mode_event_names[mode_transitions[i].event],
+					(unsigned)mode_stats[i].count,
+					(unsigned)(mode_stats[i].latency_sum / mode_stats[i].count / SIM_CYCLES_PER_US),
+					(unsigned)(mode_stats[i].latency_max / SIM_CYCLES_PER_US));
+		}
+	}
+	if ((mode_ignored != 0) || (mode_dropped != 0)){
+		fprintf(stderr, "sim: firmware mode events ignored=%u dropped=%u\n", (unsigned)mode_ignored, (unsigned)mode_dropped);
+	}
+	if (tlm_batch.bytes != 0){
+		fprintf(stderr, "sim: firmware batch records=%u bytes=%u single=%u ratio=%u.%02u\n",
+				(unsigned)tlm_batch.samples, (unsigned)tlm_batch.bytes, (unsigned)tlm_batch.unbatched,
+				(unsigned)(tlm_batch_ratio(&tlm_batch) / 100), (unsigned)(tlm_batch_ratio(&tlm_batch) % 100));
+	}
+#ifdef TEMP_ISR_BENCH
+	fprintf(stderr, "sim: firmware temperature calculation cycles last=%u max=%u (calls only, arithmetic is not modelled)\n",
+			(unsigned)temp_isr_cycles, (unsigned)temp_isr_cycles_max);
+#endif
+#ifdef STACK_WATERMARK
+	fprintf(stderr, "sim: firmware stack used=%u of %u bytes (host frames)\n",
+			(unsigned)(STACK_SIM_BYTES - stack_free()), (unsigned)STACK_SIM_BYTES);
+#endif
+#ifdef FLASH_LOG
+	fprintf(stderr, "sim: flash programs=%u erases=%u, firmware flog records=%u flash=%u sent=%u lost=%u held=%u pages=%u marks=%u\n",
+			sim_flash_programs, sim_flash_erases, (unsigned)flog_records, (unsigned)flog_flash_records,
+			(unsigned)flog_sent, (unsigned)flog_lost, (unsigned)(flog_batch - flog_batch_sent),
+			(unsigned)flog_pages, (unsigned)flog_marks);
+#endif
+	if ((sim_tlm_frames != 0) || (sim_tlm_errors != 0)){
+		fprintf(stderr, "sim: telemetry frames=%u sensor=%u status=%u batch=%u records=%u changes=%u trace=%u text=%u bytes errors=%u\n",
+				sim_tlm_frames, sim_tlm_sensor, sim_tlm_status, sim_tlm_batch, sim_tlm_records, sim_tlm_changes, sim_tlm_trace,
+				sim_tlm_text, sim_tlm_errors);
+	}
+	if (sim_tlm_errors != 0){
+		fprintf(stderr, "sim: FAIL %u telemetry frames did not decode\n", sim_tlm_errors);
+		sim_failed = true;
+	}
+	if (sim_oled_stale() != 0){
+		fprintf(stderr, "sim: FAIL oled panel differs from the framebuffer in %u bytes\n", sim_oled_stale());
+		sim_failed = true;
+	}
+	if (sim_expects != 0){
+		fprintf(stderr, "sim: expect checks=%u failed=%u\n", sim_expects, sim_expects_failed);
+	}
+	if (sim_expects_failed != 0){
+		fprintf(stderr, "sim: FAIL %u script expect checks\n", sim_expects_failed);
+		sim_failed = true;
+	}
+	if (sim_i2c_polled_irq_on != 0){
+		fprintf(stderr, "sim: FAIL %u polled I2C transfers with I2C2_IRQn enabled\n", sim_i2c_polled_irq_on);
+		sim_failed = true;
+	}
+	exit(sim_failed ? 1 : 0);
+}
+
+static void sim_reset(void){
+#ifdef STACK_WATERMARK
+	size_t i;
+
+	for (i = 0; i < SIM_STACK_WORDS; i++){
+		sim_stack[i] = STACK_PAINT;						//as ResetISR does
+	}
+#endif
+	sim_gpio_in[SIM_SW4_PORT] |= 1u << SIM_SW4_PIN;		//buttons are pulled up
+	sim_gpio_in[SIM_SW3_PORT] |= 1u << SIM_SW3_PIN;
+	sim_gpio_in[SIM_LIGHT_INT_PORT] |= 1u << SIM_LIGHT_INT_PIN;	//open drain INT, pulled up
+	sim_i2c_regs[LIGHT_I2C_ADDR][SIM_LIGHT_INT_HT] = 0xFF;		//power on window never fires
+	sim_light_next = SIM_LIGHT_CYCLE;
+	sim_set_light(200);
+	sim_set_acc(0, 0, 64);								//flat on the bench, 64 counts per g
+	sim_temp_next = sim_temp_period();
+}
+
+static void sim_usage(const char *prog){
+	fprintf(stderr, "usage: %s [-t ms] [-s script] [-o uart_out] [-T trace_out] [-R trace] [-F flash] [-v]\n"
+			"  -t ms       virtual run time (default 10000)\n"
+			"  -s script   timed input events, see sim/host_sim.c\n"
+			"  -o file     write UART3 (SAFE) output to file instead of stdout\n"
+			"  -T file     save a sensor trace dumped over UART3 (-DSENSOR_TRACE)\n"
+			"  -R file     replay a saved sensor trace instead of running the firmware\n"
+			"  -F file     keep the flash log sectors in file between runs (-DFLASH_LOG)\n"
+			"  -v          trace 7 segment, RGB and LED array changes\n", prog);
+	exit(1);
+}
+
+//sim/fmt_test.c builds this file around its own main()
+#ifndef SIM_MAIN
+#define SIM_MAIN				main
+#endif
+
+int SIM_MAIN(int argc, char **argv){
+	unsigned long run_ms = 10000;
+#ifdef SENSOR_TRACE
+	const char *replay = NULL;
+#endif
+	int opt;
+
+	sim_uart_file = stdout;
+	while ((opt = getopt(argc, argv, "t:s:o:T:R:F:v")) != -1){
+		switch (opt){
+		case 't':
+			run_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sim_load_script(optarg);
+			break;
+		case 'o':
+			sim_uart_file = fopen(optarg, "wb");
+			if (sim_uart_file == NULL){
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+		case 'R':
+#ifdef SENSOR_TRACE
+			if (opt == 'T'){
+				sim_trace_path = optarg;
+			}
+			else{
+				replay = optarg;
+			}
+			break;
+#else
+			fprintf(stderr, "-%c needs a build with -DSENSOR_TRACE\n", opt);
+			return 1;
+#endif
+		case 'F':
+#ifdef FLASH_LOG
+			sim_flash_path = optarg;
+			break;
+#else
+			fprintf(stderr, "-F needs a build with -DFLASH_LOG\n");
+			return 1;
+#endif
+		case 'v':
+			sim_verbose = true;
+			break;
+		default:
+			sim_usage(argv[0]);
+		}
+	}
+	sim_limit = (uint64_t)run_ms * SIM_CYCLES_PER_MS;
+
+	clock_gettime(CLOCK_MONOTONIC, &sim_wall_start);
+	sim_reset();
+#ifdef FLASH_LOG
+	sim_flash_open();
+#endif
+#ifdef SENSOR_TRACE
+	if (replay != NULL){
+		sim_replay(replay);
+	}
+#endif
+#ifdef STACK_WATERMARK
+	sim_stack_base = (uintptr_t)__builtin_frame_address(0);
+#endif
+	firmware_main();
+	return 0;
+}
@@ -0,0 +1,212 @@
+//*****************************************************************************
+// Host stand-in for the CMSIS LPC17xx device header
+//
+// Only the peripherals and core functions used by main.c are declared.
+// Peripheral registers are plain structs owned by sim/host_sim.c, which reads
+// what the firmware writes and sets status bits before raising interrupts.
+//*****************************************************************************
+#ifndef __LPC17xx_H__
+#define __LPC17xx_H__
+
+#include <stdint.h>
+
+//Read-only registers stay writable so the simulator can update them
+#define __I		volatile
+#define __O		volatile
+#define __IO	volatile
+
+typedef enum IRQn {
+	SysTick_IRQn		= -1,
+	WDT_IRQn			= 0,
+	TIMER0_IRQn			= 1,
+	TIMER1_IRQn			= 2,
+	TIMER2_IRQn			= 3,
+	TIMER3_IRQn			= 4,
+	UART0_IRQn			= 5,
+	UART1_IRQn			= 6,
+	UART2_IRQn			= 7,
+	UART3_IRQn			= 8,
+	PWM1_IRQn			= 9,
+	I2C0_IRQn			= 10,
+	I2C1_IRQn			= 11,
+	I2C2_IRQn			= 12,
+	SPI_IRQn			= 13,
+	SSP0_IRQn			= 14,
+	SSP1_IRQn			= 15,
+	PLL0_IRQn			= 16,
+	RTC_IRQn			= 17,
+	EINT0_IRQn			= 18,
+	EINT1_IRQn			= 19,
+	EINT2_IRQn			= 20,
+	EINT3_IRQn			= 21,
+	ADC_IRQn			= 22,
+	BOD_IRQn			= 23,
+	USB_IRQn			= 24,
+	CAN_IRQn			= 25,
+	DMA_IRQn			= 26,
+	I2S_IRQn			= 27,
+	ENET_IRQn			= 28,
+	RIT_IRQn			= 29,
+	MCPWM_IRQn			= 30,
+	QEI_IRQn			= 31,
+	PLL1_IRQn			= 32,
+	USBActivity_IRQn	= 33,
+	CANActivity_IRQn	= 34,
+	SIM_IRQ_COUNT
+} IRQn_Type;
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Core peripherals
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__I  uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	__IO uint32_t DHCSR;
+	__O  uint32_t DCRSR;
+	__IO uint32_t DCRDR;
+	__IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define SysTick_CTRL_ENABLE_Msk			(1UL << 0)
+#define SysTick_CTRL_TICKINT_Msk		(1UL << 1)
+#define SysTick_CTRL_CLKSOURCE_Msk		(1UL << 2)
+#define DWT_CTRL_CYCCNTENA_Msk			(1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk		(1UL << 24)
+
+extern SysTick_Type sim_systick;
+extern DWT_Type sim_dwt;
+extern CoreDebug_Type sim_coredebug;
+
+#define SysTick			(&sim_systick)
+#define DWT				(&sim_dwt)
+#define CoreDebug		(&sim_coredebug)
+
+extern uint32_t SystemCoreClock;
+
+uint32_t SysTick_Config(uint32_t ticks);
+void NVIC_EnableIRQ(IRQn_Type IRQn);
+void NVIC_DisableIRQ(IRQn_Type IRQn);
+void NVIC_ClearPendingIRQ(IRQn_Type IRQn);
+void NVIC_SetPendingIRQ(IRQn_Type IRQn);
+void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority);
+uint32_t NVIC_EncodePriority(uint32_t PriorityGroup, uint32_t PreemptPriority, uint32_t SubPriority);
+
+//__WFI() is where virtual time advances, see sim/host_sim.c
+void __WFI(void);
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t priMask);
+uint32_t __get_MSP(void);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Device peripherals
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+	__IO uint32_t FIODIR;
+	__IO uint32_t FIOMASK;
+	__IO uint32_t FIOPIN;
+	__IO uint32_t FIOSET;
+	__O  uint32_t FIOCLR;
+} LPC_GPIO_TypeDef;
+
+typedef struct {
+	__I  uint32_t IntStatus;
+	__I  uint32_t IO0IntStatR;
+	__I  uint32_t IO0IntStatF;
+	__O  uint32_t IO0IntClr;
+	__IO uint32_t IO0IntEnR;
+	__IO uint32_t IO0IntEnF;
+	__I  uint32_t IO2IntStatR;
+	__I  uint32_t IO2IntStatF;
+	__O  uint32_t IO2IntClr;
+	__IO uint32_t IO2IntEnR;
+	__IO uint32_t IO2IntEnF;
+} LPC_GPIOINT_TypeDef;
+
+typedef struct {
+	__IO uint32_t IR;
+	__IO uint32_t TCR;
+	__IO uint32_t TC;
+	__IO uint32_t PR;
+	__IO uint32_t PC;
+	__IO uint32_t MCR;
+	__IO uint32_t MR0;
+	__IO uint32_t MR1;
+	__IO uint32_t MR2;
+	__IO uint32_t MR3;
+	__IO uint32_t CCR;
+	__I  uint32_t CR0;
+	__I  uint32_t CR1;
+	__IO uint32_t EMR;
+	__IO uint32_t CTCR;
+} LPC_TIM_TypeDef;
+
+typedef struct {
+	__I  uint8_t  RBR;
+	__O  uint8_t  THR;
+	__IO uint8_t  DLL;
+	__IO uint8_t  DLM;
+	__IO uint32_t IER;
+	__I  uint32_t IIR;
+	__O  uint8_t  FCR;
+	__IO uint8_t  LCR;
+	__I  uint8_t  LSR;
+	__IO uint8_t  SCR;
+} LPC_UART_TypeDef;
+
+typedef struct {
+	__IO uint32_t I2CONSET;
+	__I  uint32_t I2STAT;
+	__IO uint32_t I2DAT;
+	__IO uint32_t I2ADR0;
+	__IO uint32_t I2SCLH;
+	__IO uint32_t I2SCLL;
+	__O  uint32_t I2CONCLR;
+} LPC_I2C_TypeDef;
+
+typedef struct {
+	__IO uint32_t CR0;
+	__IO uint32_t CR1;
+	__IO uint32_t DR;
+	__I  uint32_t SR;
+	__IO uint32_t CPSR;
+	__IO uint32_t IMSC;
+	__I  uint32_t RIS;
+	__I  uint32_t MIS;
+	__O  uint32_t ICR;
+	__IO uint32_t DMACR;
+} LPC_SSP_TypeDef;
+
+extern LPC_GPIO_TypeDef sim_gpio[5];
+extern LPC_GPIOINT_TypeDef sim_gpioint;
+extern LPC_TIM_TypeDef sim_tim[4];
+extern LPC_UART_TypeDef sim_uart3;
+extern LPC_I2C_TypeDef sim_i2c2;
+extern LPC_SSP_TypeDef sim_ssp1;
+
+#define LPC_GPIO0		(&sim_gpio[0])
+#define LPC_GPIO1		(&sim_gpio[1])
+#define LPC_GPIO2		(&sim_gpio[2])
+#define LPC_GPIO3		(&sim_gpio[3])
+#define LPC_GPIO4		(&sim_gpio[4])
+#define LPC_GPIOINT		(&sim_gpioint)
+#define LPC_TIM0		(&sim_tim[0])
+#define LPC_TIM1		(&sim_tim[1])
+#define LPC_TIM2		(&sim_tim[2])
+#define LPC_TIM3		(&sim_tim[3])
+#define LPC_UART3		(&sim_uart3)
+#define LPC_I2C2		(&sim_i2c2)
+#define LPC_SSP1		(&sim_ssp1)
+
+#endif // __LPC17xx_H__
@@ -0,0 +1,27 @@
+//*****************************************************************************
+// Host stand-in for the baseboard MMA7455 accelerometer driver
+//*****************************************************************************
+#ifndef __ACC_H
+#define __ACC_H
+
+#include <stdint.h>
+
+typedef enum {
+	ACC_MODE_STANDBY,
+	ACC_MODE_MEASURE,
+	ACC_MODE_LEVEL,
+	ACC_MODE_PULSE
+} acc_mode_t;
+
+typedef enum {
+	ACC_RANGE_8G,
+	ACC_RANGE_2G,
+	ACC_RANGE_4G
+} acc_range_t;
+
+void acc_init(void);
+void acc_read(int8_t *x, int8_t *y, int8_t *z);
+void acc_setRange(acc_range_t range);
+void acc_setMode(acc_mode_t mode);
+
+#endif /* __ACC_H */
@@ -0,0 +1,24 @@
+//*****************************************************************************
+// Host stand-in for the baseboard 5x7 font
+//
+// Same layout as the real table (8 row bytes per char from 0x20, MSB is the
+// leftmost column) but every printable char is drawn as a hollow box, enough
+// to see text placement and redraws in sim_oled_dump()
+//*****************************************************************************
+#ifndef __FONT5X7_H
+#define __FONT5X7_H
+
+#include <stdint.h>
+
+#define FONT5X7_SPACE	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+#define FONT5X7_BOX		0xF8, 0x88, 0x88, 0x88, 0x88, 0x88, 0xF8, 0x00
+#define FONT5X7_BOX4	FONT5X7_BOX, FONT5X7_BOX, FONT5X7_BOX, FONT5X7_BOX
+#define FONT5X7_BOX16	FONT5X7_BOX4, FONT5X7_BOX4, FONT5X7_BOX4, FONT5X7_BOX4
+
+static const uint8_t font5x7[96*8] = {
+	FONT5X7_SPACE,
+	FONT5X7_BOX16, FONT5X7_BOX16, FONT5X7_BOX16, FONT5X7_BOX16, FONT5X7_BOX16,
+	FONT5X7_BOX4, FONT5X7_BOX4, FONT5X7_BOX4, FONT5X7_BOX, FONT5X7_BOX, FONT5X7_BOX
+};
+
+#endif /* __FONT5X7_H */
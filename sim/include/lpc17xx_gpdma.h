@@ -0,0 +1,59 @@
+//*****************************************************************************
+// Host stand-in for lpc17xx_gpdma.h
+//
+// Addresses are uintptr_t so host pointers survive the round trip, the
+// target header uses uint32_t.
+//*****************************************************************************
+#ifndef LPC17XX_GPDMA_H_
+#define LPC17XX_GPDMA_H_
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+#define GPDMA_NUMBER_CHANNELS		8
+
+#define GPDMA_CONN_SSP0_Tx			((0UL))
+#define GPDMA_CONN_SSP0_Rx			((1UL))
+#define GPDMA_CONN_SSP1_Tx			((2UL))
+#define GPDMA_CONN_SSP1_Rx			((3UL))
+
+#define GPDMA_TRANSFERTYPE_M2M		((0UL))
+#define GPDMA_TRANSFERTYPE_M2P		((1UL))
+#define GPDMA_TRANSFERTYPE_P2M		((2UL))
+#define GPDMA_TRANSFERTYPE_P2P		((3UL))
+
+#define GPDMA_WIDTH_BYTE			((0UL))
+
+typedef enum {
+	GPDMA_STAT_INT,
+	GPDMA_STAT_INTTC,
+	GPDMA_STAT_INTERR,
+	GPDMA_STAT_RAWINTTC,
+	GPDMA_STAT_RAWINTERR,
+	GPDMA_STAT_ENABLED_CH
+} GPDMA_Status_Type;
+
+typedef enum {
+	GPDMA_STATCLR_INTTC,
+	GPDMA_STATCLR_INTERR
+} GPDMA_StateClear_Type;
+
+typedef struct {
+	uint32_t ChannelNum;
+	uint32_t TransferSize;
+	uint32_t TransferWidth;
+	uintptr_t SrcMemAddr;
+	uintptr_t DstMemAddr;
+	uint32_t TransferType;
+	uint32_t SrcConn;
+	uint32_t DstConn;
+	uintptr_t DMALLI;
+} GPDMA_Channel_CFG_Type;
+
+void GPDMA_Init(void);
+Status GPDMA_Setup(GPDMA_Channel_CFG_Type *GPDMAChannelConfig);
+IntStatus GPDMA_IntGetStatus(GPDMA_Status_Type type, uint8_t channel);
+void GPDMA_ClearIntPending(GPDMA_StateClear_Type type, uint8_t channel);
+void GPDMA_ChannelCmd(uint8_t channelNum, FunctionalState NewState);
+
+#endif /* LPC17XX_GPDMA_H_ */
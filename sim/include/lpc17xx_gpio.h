@@ -0,0 +1,15 @@
+//*****************************************************************************
+// Host stand-in for lpc17xx_gpio.h
+//*****************************************************************************
+#ifndef LPC17XX_GPIO_H_
+#define LPC17XX_GPIO_H_
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+void GPIO_SetDir(uint8_t portNum, uint32_t bitValue, uint8_t dir);
+void GPIO_SetValue(uint8_t portNum, uint32_t bitValue);
+void GPIO_ClearValue(uint8_t portNum, uint32_t bitValue);
+uint32_t GPIO_ReadValue(uint8_t portNum);
+
+#endif /* LPC17XX_GPIO_H_ */
@@ -0,0 +1,44 @@
+//*****************************************************************************
+// Host stand-in for lpc17xx_i2c.h
+//*****************************************************************************
+#ifndef LPC17XX_I2C_H_
+#define LPC17XX_I2C_H_
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+#define I2C_I2CONSET_AA			((1<<2))
+#define I2C_I2CONSET_SI			((1<<3))
+#define I2C_I2CONSET_STO		((1<<4))
+#define I2C_I2CONSET_STA		((1<<5))
+#define I2C_I2CONSET_I2EN		((1<<6))
+
+#define I2C_I2CONCLR_AAC		((1<<2))
+#define I2C_I2CONCLR_SIC		((1<<3))
+#define I2C_I2CONCLR_STAC		((1<<5))
+#define I2C_I2CONCLR_I2ENC		((1<<6))
+
+typedef enum {
+	I2C_TRANSFER_POLLING = 0,
+	I2C_TRANSFER_INTERRUPT
+} I2C_TRANSFER_OPT_Type;
+
+typedef struct {
+	uint32_t sl_addr7bit;
+	uint8_t *tx_data;
+	uint32_t tx_length;
+	uint32_t tx_count;
+	uint8_t *rx_data;
+	uint32_t rx_length;
+	uint32_t rx_count;
+	uint32_t retransmissions_max;
+	uint32_t retransmissions_count;
+	uint32_t status;
+	void (*callback)(void);
+} I2C_M_SETUP_Type;
+
+void I2C_Init(LPC_I2C_TypeDef *I2Cx, uint32_t clockrate);
+void I2C_Cmd(LPC_I2C_TypeDef *I2Cx, FunctionalState NewState);
+Status I2C_MasterTransferData(LPC_I2C_TypeDef *I2Cx, I2C_M_SETUP_Type *TransferCfg, I2C_TRANSFER_OPT_Type Opt);
+
+#endif /* LPC17XX_I2C_H_ */
@@ -0,0 +1,56 @@
+//*****************************************************************************
+// Host stand-in for lpc17xx_ssp.h
+//*****************************************************************************
+#ifndef LPC17XX_SSP_H_
+#define LPC17XX_SSP_H_
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+#define SSP_CPHA_FIRST			((uint32_t)(0))
+#define SSP_CPOL_HI				((uint32_t)(0))
+#define SSP_MASTER_MODE			((uint32_t)(0))
+#define SSP_FRAME_SPI			((uint32_t)(0))
+#define SSP_DATABIT_8			((uint32_t)(7))
+
+#define SSP_SR_TFE				((uint32_t)(1<<0))
+#define SSP_SR_TNF				((uint32_t)(1<<1))
+#define SSP_SR_RNE				((uint32_t)(1<<2))
+#define SSP_SR_RFF				((uint32_t)(1<<3))
+#define SSP_SR_BSY				((uint32_t)(1<<4))
+
+#define SSP_DMA_RX				((uint32_t)(1<<0))
+#define SSP_DMA_TX				((uint32_t)(1<<1))
+
+typedef struct {
+	uint32_t Databit;
+	uint32_t CPHA;
+	uint32_t CPOL;
+	uint32_t Mode;
+	uint32_t FrameFormat;
+	uint32_t ClockRate;
+} SSP_CFG_Type;
+
+typedef enum {
+	SSP_TRANSFER_POLLING = 0,
+	SSP_TRANSFER_INTERRUPT
+} SSP_TRANSFER_Type;
+
+typedef struct {
+	void *tx_data;
+	uint32_t tx_cnt;
+	void *rx_data;
+	uint32_t rx_cnt;
+	uint32_t length;
+	uint32_t status;
+} SSP_DATA_SETUP_Type;
+
+void SSP_ConfigStructInit(SSP_CFG_Type *SSP_InitStruct);
+void SSP_Init(LPC_SSP_TypeDef *SSPx, SSP_CFG_Type *SSP_ConfigStruct);
+void SSP_Cmd(LPC_SSP_TypeDef *SSPx, FunctionalState NewState);
+int32_t SSP_ReadWrite(LPC_SSP_TypeDef *SSPx, SSP_DATA_SETUP_Type *dataCfg, SSP_TRANSFER_Type xfType);
+void SSP_SendData(LPC_SSP_TypeDef *SSPx, uint16_t Data);
+uint16_t SSP_ReceiveData(LPC_SSP_TypeDef *SSPx);
+void SSP_DMACmd(LPC_SSP_TypeDef *SSPx, uint32_t DMAMode, FunctionalState NewState);
+
+#endif /* LPC17XX_SSP_H_ */
@@ -0,0 +1,65 @@
+//*****************************************************************************
+// Host stand-in for lpc17xx_timer.h
+//*****************************************************************************
+#ifndef LPC17XX_TIMER_H_
+#define LPC17XX_TIMER_H_
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+typedef enum {
+	TIM_TIMER_MODE = 0,
+	TIM_COUNTER_RISING_MODE,
+	TIM_COUNTER_FALLING_MODE,
+	TIM_COUNTER_ANY_MODE
+} TIM_MODE_OPT;
+
+typedef enum {
+	TIM_PRESCALE_TICKVAL = 0,
+	TIM_PRESCALE_USVAL
+} TIM_PRESCALE_OPT;
+
+typedef enum {
+	TIM_COUNTER_INCAP0 = 0,
+	TIM_COUNTER_INCAP1
+} TIM_COUNTER_INPUT_OPT;
+
+typedef enum {
+	TIM_MR0_INT = 0,
+	TIM_MR1_INT,
+	TIM_MR2_INT,
+	TIM_MR3_INT,
+	TIM_CR0_INT,
+	TIM_CR1_INT
+} TIM_INT_TYPE;
+
+typedef struct {
+	uint8_t PrescaleOption;
+	uint8_t Reserved[3];
+	uint32_t PrescaleValue;
+} TIM_TIMERCFG_Type;
+
+typedef struct {
+	uint8_t CounterOption;
+	uint8_t CountInputSelect;
+	uint8_t Reserved[2];
+} TIM_COUNTERCFG_Type;
+
+typedef struct {
+	uint8_t MatchChannel;
+	uint8_t IntOnMatch;
+	uint8_t StopOnMatch;
+	uint8_t ResetOnMatch;
+	uint8_t ExtMatchOutputType;
+	uint8_t Reserved[3];
+	uint32_t MatchValue;
+} TIM_MATCHCFG_Type;
+
+void TIM_Init(LPC_TIM_TypeDef *TIMx, TIM_MODE_OPT TimerCounterMode, void *TIM_ConfigStruct);
+void TIM_DeInit(LPC_TIM_TypeDef *TIMx);
+void TIM_ConfigMatch(LPC_TIM_TypeDef *TIMx, TIM_MATCHCFG_Type *TIM_MatchConfigStruct);
+void TIM_Cmd(LPC_TIM_TypeDef *TIMx, FunctionalState NewState);
+void TIM_ResetCounter(LPC_TIM_TypeDef *TIMx);
+void TIM_ClearIntPending(LPC_TIM_TypeDef *TIMx, TIM_INT_TYPE IntFlag);
+
+#endif /* LPC17XX_TIMER_H_ */
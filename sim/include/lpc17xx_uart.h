@@ -0,0 +1,85 @@
+//*****************************************************************************
+// Host stand-in for lpc17xx_uart.h
+//*****************************************************************************
+#ifndef LPC17XX_UART_H_
+#define LPC17XX_UART_H_
+
+#include "LPC17xx.h"
+#include "lpc_types.h"
+
+#define UART_IIR_INTSTAT_PEND	((uint32_t)(1<<0))
+#define UART_IIR_INTID_RLS		((uint32_t)(3<<1))
+#define UART_IIR_INTID_RDA		((uint32_t)(2<<1))
+#define UART_IIR_INTID_CTI		((uint32_t)(6<<1))
+#define UART_IIR_INTID_THRE		((uint32_t)(1<<1))
+#define UART_IIR_INTID_MASK		((uint32_t)(7<<1))
+
+#define UART_LSR_RDR			((uint8_t)(1<<0))
+#define UART_LSR_OE				((uint8_t)(1<<1))
+#define UART_LSR_THRE			((uint8_t)(1<<5))
+#define UART_LSR_TEMT			((uint8_t)(1<<6))
+
+#define UART_TX_FIFO_SIZE		(16)
+
+typedef enum {
+	UART_FIFO_TRGLEV0 = 0,		//1 char
+	UART_FIFO_TRGLEV1,			//4 chars
+	UART_FIFO_TRGLEV2,			//8 chars
+	UART_FIFO_TRGLEV3			//14 chars
+} UART_FITO_LEVEL_Type;
+
+typedef enum {
+	UART_DATABIT_5 = 0,
+	UART_DATABIT_6,
+	UART_DATABIT_7,
+	UART_DATABIT_8
+} UART_DATABIT_Type;
+
+typedef enum {
+	UART_STOPBIT_1 = 0,
+	UART_STOPBIT_2
+} UART_STOPBIT_Type;
+
+typedef enum {
+	UART_PARITY_NONE = 0,
+	UART_PARITY_ODD,
+	UART_PARITY_EVEN,
+	UART_PARITY_SP_1,
+	UART_PARITY_SP_0
+} UART_PARITY_Type;
+
+typedef enum {
+	UART_INTCFG_RBR = 0,
+	UART_INTCFG_THRE,
+	UART_INTCFG_RLS,
+	UART1_INTCFG_MS,
+	UART1_INTCFG_CTS,
+	UART_INTCFG_ABEO,
+	UART_INTCFG_ABTO
+} UART_INT_Type;
+
+typedef struct {
+	FunctionalState FIFO_ResetRxBuf;
+	FunctionalState FIFO_ResetTxBuf;
+	FunctionalState FIFO_DMAMode;
+	UART_FITO_LEVEL_Type FIFO_Level;
+} UART_FIFO_CFG_Type;
+
+typedef struct {
+	uint32_t Baud_rate;
+	UART_PARITY_Type Parity;
+	UART_DATABIT_Type Databits;
+	UART_STOPBIT_Type Stopbits;
+} UART_CFG_Type;
+
+void UART_Init(LPC_UART_TypeDef *UARTx, UART_CFG_Type *UART_ConfigStruct);
+void UART_TxCmd(LPC_UART_TypeDef *UARTx, FunctionalState NewState);
+void UART_IntConfig(LPC_UART_TypeDef *UARTx, UART_INT_Type UARTIntCfg, FunctionalState NewState);
+uint32_t UART_Send(LPC_UART_TypeDef *UARTx, uint8_t *txbuf, uint32_t buflen, TRANSFER_BLOCK_Type flag);
+void UART_FIFOConfigStructInit(UART_FIFO_CFG_Type *UART_FIFOInitStruct);
+void UART_FIFOConfig(LPC_UART_TypeDef *UARTx, UART_FIFO_CFG_Type *FIFOCfg);
+uint8_t UART_GetLineStatus(LPC_UART_TypeDef *UARTx);
+uint8_t UART_ReceiveByte(LPC_UART_TypeDef *UARTx);
+uint32_t UART_Receive(LPC_UART_TypeDef *UARTx, uint8_t *rxbuf, uint32_t buflen, TRANSFER_BLOCK_Type flag);
+
+#endif /* LPC17XX_UART_H_ */
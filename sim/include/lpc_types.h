@@ -0,0 +1,21 @@
+//*****************************************************************************
+// Host stand-in for the CMSIS lpc_types.h
+//*****************************************************************************
+#ifndef LPC_TYPES_H
+#define LPC_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {FALSE = 0, TRUE = !FALSE} Bool;
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, IntStatus, SetState;
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+typedef enum {ERROR = 0, SUCCESS = !ERROR} Status;
+typedef enum {NONE_BLOCKING = 0, BLOCKING} TRANSFER_BLOCK_Type;
+
+typedef void (*PFV)(void);
+typedef int32_t (*PFI)();
+
+#define _BIT(n)		(1 << (n))
+
+#endif // LPC_TYPES_H
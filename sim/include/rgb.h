@@ -0,0 +1,16 @@
+//*****************************************************************************
+// Host stand-in for the baseboard RGB LED driver
+//*****************************************************************************
+#ifndef __RGB_H
+#define __RGB_H
+
+#include <stdint.h>
+
+#define RGB_RED		0x01
+#define RGB_BLUE	0x02
+#define RGB_GREEN	0x04
+
+void rgb_init(void);
+void rgb_setLeds(uint8_t ledMask);
+
+#endif /* __RGB_H */
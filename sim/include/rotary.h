@@ -0,0 +1,16 @@
+//*****************************************************************************
+// Host stand-in for the baseboard rotary switch driver
+//*****************************************************************************
+#ifndef __ROTARY_H
+#define __ROTARY_H
+
+#include <stdint.h>
+
+#define ROTARY_WAIT		0
+#define ROTARY_RIGHT	1
+#define ROTARY_LEFT		2
+
+void rotary_init(void);
+uint8_t rotary_read(void);
+
+#endif /* __ROTARY_H */
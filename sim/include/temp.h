@@ -0,0 +1,12 @@
+//*****************************************************************************
+// Host stand-in for the baseboard MAX6576 temperature driver
+//*****************************************************************************
+#ifndef __TEMP_H
+#define __TEMP_H
+
+#include <stdint.h>
+
+void temp_init(uint32_t (*getMsTicks)(void));
+int32_t temp_read(void);
+
+#endif /* __TEMP_H */
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Build the host simulator in each binary telemetry mode and check every
+# frame SAFE would receive, see the Telemetry monitor in sim/host_sim.c.
+#   sim/telemetry.sh
+# Prints the telemetry summary of each run, exits with 1 if a frame did not
+# decode or a batch run delivers other records or status changes than the
+# binary run of the same script. The flash log run sends held records back
+# as frames too.
+set -e
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+BIN=./host_sim_telemetry
+OUT=$(mktemp)
+FLASH=$(mktemp)
+SUMMARY=$(mktemp)
+trap 'rm -f "$OUT" "$FLASH" "$BIN" "$SUMMARY"' EXIT
+
+# run name script time [-D flags], a FLASH_LOG build starts from blank flash
+run() {
+	name=$1
+	script=$2
+	time=$3
+	shift 3
+	$CC -std=gnu99 -Wall -O2 -DHOST_SIM "$@" -Isim/include -o "$BIN" sim/host_sim.c
+	rm -f "$FLASH"
+	case "$*" in
+	*FLASH_LOG*)	set -- -F "$FLASH" ;;
+	*)				set -- ;;
+	esac
+	if ! "$BIN" -t "$time" -s "$script" "$@" -o "$OUT" 2> "$OUT.err"; then
+		sed "s/^/$name /" "$OUT.err"
+		rm -f "$OUT.err"
+		exit 1
+	fi
+	grep '^sim: telemetry' "$OUT.err" | sed "s/^sim: /$name /" | tee -a "$SUMMARY"
+	rm -f "$OUT.err"
+}
+
+# field run name, from the summary of an earlier run
+field() {
+	grep "^$1 " "$SUMMARY" | sed -n "s/.* $2=\([0-9]*\).*/\1/p"
+}
+
+# same binary_run batch_run, both must have seen the same records
+same() {
+	for f in records changes; do
+		if [ "$(field "$1" $f)" != "$(field "$2" $f)" ]; then
+			echo "$2 FAIL $f=$(field "$2" $f) but $1 $f=$(field "$1" $f)"
+			exit 1
+		fi
+	done
+}
+
+run binary sim/telemetry.txt 120000 -DTELEMETRY_MODE=TELEMETRY_BINARY
+run batch sim/telemetry.txt 120000 -DTELEMETRY_MODE=TELEMETRY_BATCH
+same binary batch
+run binary_flog sim/flash_log.txt 800000 -DTELEMETRY_MODE=TELEMETRY_BINARY -DFLASH_LOG
+run batch_flog sim/flash_log.txt 800000 -DTELEMETRY_MODE=TELEMETRY_BATCH -DFLASH_LOG
+same binary_flog batch_flog
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Flash and RAM used by a board build, and what the formatting code costs.
+#   ./size.sh Debug/CARE.axf                  one build
+#   ./size.sh Debug/CARE.axf before.axf       and the change from before.axf
+# Flash is .text plus the .data initialisers, RAM is .data plus .bss.
+# The format lines sum the printf family and the soft float helpers it
+# pulls in, they go to 0 once nothing calls sprintf.
+# Needs the GNU Arm toolchain on the PATH, CROSS overrides the prefix
+# (CROSS= for the host tools).
+set -e
+
+CROSS=${CROSS-arm-none-eabi-}
+FORMAT='printf|dtoa|mprec|_fpmaxtostr|__aeabi_[dl]|__[a-z]*df[0-9a-z]*$'
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+	echo "usage: $0 build.axf [before.axf]" >&2
+	exit 1
+fi
+
+# text data bss of one image
+sections() {
+	"${CROSS}size" -B "$1" | awk 'NR == 2 { print $1, $2, $3 }'
+}
+
+# bytes in the formatting symbols of one image
+format_bytes() {
+	"${CROSS}nm" -S -t d --size-sort "$1" | awk '{ print $2, $4 }' | grep -E " ($FORMAT)" |
+		awk '{ sum += $1 } END { print sum + 0 }'
+}
+
+report() {
+	set -- "$1" $(sections "$1") $(format_bytes "$1")
+	echo "$1 flash=$(($2 + $3)) ram=$(($3 + $4)) text=$2 data=$3 bss=$4 format=$5"
+}
+
+report "$1"
+if [ $# -eq 2 ]; then
+	report "$2"
+	set -- "$(report "$1")" "$(report "$2")"
+	echo "$1" "$2" | awk '{
+		for (i = 2; i <= 7; i++) {
+			split($i, a, "="); split($(i + 7), b, "=")
+			printf "%s%s=%+d", (i == 2) ? "change " : " ", a[1], a[2] - b[2]
+		}
+		printf "\n"
+	}'
+fi